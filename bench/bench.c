@@ -0,0 +1,632 @@
+/*
+ * Microbenchmarks for the B+tree and the pager.
+ * Links against db_study.c built with -DDB_STUDY_NO_MAIN, see `make bench`.
+ * Results are printed as one JSON document on stdout.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "../db_study.h"
+
+#define BENCH_DEFAULT_ROWS        20000
+#define BENCH_SCAN_REPEATS        20
+#define BENCH_WRITE_BUFFER_ROWS   16384
+
+typedef struct bench_result_struct  bench_result_t;
+
+/* Latency samples of one benchmark, in nanoseconds */
+struct bench_result_struct
+{
+    const char* name;
+    const char* unit;
+    uint64_t*   samples;
+    uint64_t    num_samples;
+    uint64_t    ops;
+    uint64_t    total_ns;
+};
+
+static bool first_result = true;
+
+uint64_t
+bench_now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+bench_result_t
+bench_result_new(
+  const char* name,
+  const char* unit,
+  uint64_t    capacity
+)
+{
+  bench_result_t result = { name, unit, malloc(capacity * sizeof(uint64_t)), 0, 0, 0 };
+  return result;
+}
+
+void
+bench_record(
+  bench_result_t* result,
+  uint64_t        elapsed_ns,
+  uint64_t        ops
+)
+{
+  result->samples[result->num_samples++]  = elapsed_ns;
+  result->ops                            += ops;
+  result->total_ns                       += elapsed_ns;
+}
+
+int
+compare_u64(
+  const void* a,
+  const void* b
+)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+uint64_t
+percentile(
+  bench_result_t* result,
+  double          fraction
+)
+{
+  if (result->num_samples == 0)
+  {
+    return 0;
+  }
+  uint64_t index = (uint64_t)(fraction * (result->num_samples - 1) + 0.5);
+  return result->samples[index];
+}
+
+void
+bench_report(
+  bench_result_t* result
+)
+{
+  qsort(result->samples, result->num_samples, sizeof(uint64_t), compare_u64);
+  double seconds = result->total_ns / 1e9;
+
+  printf("%s    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, \"samples\": %llu, "
+         "\"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+         "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+         first_result ? "" : ",\n",
+         result->name, result->unit,
+         (unsigned long long)result->ops, (unsigned long long)result->num_samples,
+         seconds, seconds > 0 ? result->ops / seconds : 0.0,
+         (unsigned long long)percentile(result, 0.50),
+         (unsigned long long)percentile(result, 0.99),
+         (unsigned long long)percentile(result, 0.999));
+  first_result = false;
+  free(result->samples);
+}
+
+void
+make_row(
+  uint32_t  id,
+  row_t*    row
+)
+{
+  row->id = id;
+  snprintf(row->username, sizeof(row->username), "user%u", id);
+  snprintf(row->email, sizeof(row->email), "person%u@example.com", id);
+}
+
+void
+shuffle(
+  uint32_t* keys,
+  uint32_t  count
+)
+{
+  for (uint32_t i = count - 1; i > 0; i--)
+  {
+    uint32_t j   = rand() % (i + 1);
+    uint32_t tmp = keys[i];
+    keys[i]      = keys[j];
+    keys[j]      = tmp;
+  }
+}
+
+table_t*
+open_fresh(
+  const char*   filename,
+  database_t**  database
+)
+{
+  unlink(filename);
+  *database = db_open(filename);
+  return database_find_table(*database, DEFAULT_TABLE_NAME);
+}
+
+/*
+ Goes through the statement path, text values and all.
+ With buffer_rows set, inserts go through the write buffer and the final drain is
+ recorded as one more sample.
+*/
+void
+bench_execute_insert(
+  const char* name,
+  const char* filename,
+  uint32_t*   keys,
+  uint32_t    count,
+  uint32_t    buffer_rows
+)
+{
+  database_t*     database;
+  table_t*        table  = open_fresh(filename, &database);
+  bench_result_t  result = bench_result_new(name, "row", count + 1);
+  char            id[16];
+  char            username[COLUMN_USERNAME_SIZE + 1];
+  char            email[COLUMN_EMAIL_SIZE + 1];
+  statement_t     statement;
+
+  database_set_write_buffer(database, buffer_rows);
+  statement.type        = STATEMENT_INSERT;
+  statement.num_values  = 3;
+  statement.values[0]   = id;
+  statement.values[1]   = username;
+  statement.values[2]   = email;
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    snprintf(id, sizeof(id), "%u", keys[i]);
+    snprintf(username, sizeof(username), "user%u", keys[i]);
+    snprintf(email, sizeof(email), "person%u@example.com", keys[i]);
+
+    uint64_t start = bench_now_ns();
+    execute_insert(&statement, table);
+    bench_record(&result, bench_now_ns() - start, 1);
+  }
+  if (buffer_rows > 0)
+  {
+    uint64_t start = bench_now_ns();
+    table_flush_write_buffer(table);
+    bench_record(&result, bench_now_ns() - start, 0);
+  }
+  bench_report(&result);
+  db_close(database);
+}
+
+/* The same rows as a CSV file in key order given, loaded by one copy ... from */
+void
+bench_copy_from(
+  const char* filename,
+  uint32_t*   keys,
+  uint32_t    count
+)
+{
+  char  csv_name[256];
+  snprintf(csv_name, sizeof(csv_name), "%s.csv", filename);
+  FILE* csv = fopen(csv_name, "w");
+  for (uint32_t i = 0; i < count; i++)
+  {
+    fprintf(csv, "%u,user%u,person%u@example.com\n", keys[i], keys[i], keys[i]);
+  }
+  fclose(csv);
+
+  database_t*     database;
+  table_t*        table  = open_fresh(filename, &database);
+  bench_result_t  result = bench_result_new("copy_from_random", "row", 1);
+  uint32_t        rows_copied;
+  uint64_t        error_line;
+  uint64_t        start  = bench_now_ns();
+  table_copy_from(table, csv_name, &rows_copied, &error_line);
+  bench_record(&result, bench_now_ns() - start, rows_copied);
+  bench_report(&result);
+  db_close(database);
+  unlink(csv_name);
+}
+
+/* The whole table exported by copy ... to, into a file next to the database */
+void
+bench_copy_to(
+  const char*     name,
+  const char*     filename,
+  table_t*        table,
+  result_format_e format
+)
+{
+  char  out_name[256];
+  snprintf(out_name, sizeof(out_name), "%s.out", filename);
+
+  bench_result_t  result = bench_result_new(name, "row", BENCH_SCAN_REPEATS);
+  for (uint32_t i = 0; i < BENCH_SCAN_REPEATS; i++)
+  {
+    uint32_t  rows_copied;
+    uint64_t  start = bench_now_ns();
+    table_copy_to(table, out_name, format, &rows_copied);
+    bench_record(&result, bench_now_ns() - start, rows_copied);
+  }
+  bench_report(&result);
+  unlink(out_name);
+}
+
+/*
+ Load keys in order, timing only the inserts that land in a full leaf
+ and therefore go through leaf_node_split_and_insert().
+*/
+void
+bench_leaf_split(
+  const char* filename,
+  uint32_t    count
+)
+{
+  database_t*     database;
+  table_t*        table  = open_fresh(filename, &database);
+  bench_result_t  result = bench_result_new("leaf_node_split_and_insert", "split", count);
+  uint8_t         buffer[4096];
+  row_t           row;
+
+  for (uint32_t key = 1; key <= count; key++)
+  {
+    make_row(key, &row);
+    serialize_row(&row, buffer);
+
+    cursor_t* cursor = table_find(table, key);
+    void*     node   = get_page(table->pager, cursor->page_num);
+    if (*leaf_node_num_cells(node) < leaf_node_max_cells(node))
+    {
+      free(cursor);
+      table_insert(table, buffer);
+      continue;
+    }
+
+    increment_ancestor_row_counts(table->pager, cursor->page_num);
+    uint64_t start = bench_now_ns();
+    leaf_node_split_and_insert(cursor, key, buffer);
+    bench_record(&result, bench_now_ns() - start, 1);
+    free(cursor);
+  }
+  bench_report(&result);
+  db_close(database);
+}
+
+void
+bench_table_find(
+  table_t*  table,
+  uint32_t* keys,
+  uint32_t  count
+)
+{
+  bench_result_t result = bench_result_new("table_find", "lookup", count);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint64_t  start  = bench_now_ns();
+    cursor_t* cursor = table_find(table, keys[i]);
+    bench_record(&result, bench_now_ns() - start, 1);
+    free(cursor);
+  }
+  bench_report(&result);
+}
+
+/* One sample per full scan, ops count rows visited */
+void
+bench_full_scan(
+  table_t*  table
+)
+{
+  bench_result_t result = bench_result_new("cursor_advance_full_scan", "row", BENCH_SCAN_REPEATS);
+  for (uint32_t i = 0; i < BENCH_SCAN_REPEATS; i++)
+  {
+    uint64_t  rows   = 0;
+    uint64_t  start  = bench_now_ns();
+    cursor_t* cursor = table_start(table);
+    while (!(cursor->end_of_table))
+    {
+      row_view_t view = row_view_at(cursor);
+      rows += row_view_id(&view) != 0;
+      cursor_advance(cursor);
+    }
+    bench_record(&result, bench_now_ns() - start, rows);
+    free(cursor);
+  }
+  bench_report(&result);
+}
+
+bool
+bench_count_row(
+  row_view_t* view,
+  void*       context
+)
+{
+  *(uint64_t*)context += row_view_id(view) != 0;
+  return true;
+}
+
+/* Full scans filtering on username, a text column; ops count rows examined */
+void
+bench_filter_scan(
+  const char* name,
+  table_t*    table
+)
+{
+  where_clause_t  where  = { WHERE_EQUAL, "username", "user7", 1, 0 };
+  bench_result_t  result = bench_result_new(name, "row", BENCH_SCAN_REPEATS);
+  for (uint32_t i = 0; i < BENCH_SCAN_REPEATS; i++)
+  {
+    uint64_t  matches  = 0;
+    uint64_t  examined = table->pager->stats.rows_examined;
+    uint64_t  start    = bench_now_ns();
+    table_select_where(table, &where, bench_count_row, &matches);
+    bench_record(&result, bench_now_ns() - start, table->pager->stats.rows_examined - examined);
+  }
+  bench_report(&result);
+}
+
+/* One page of a listing: order by a column with a limit, or a deep offset in id order */
+void
+bench_order_limit(
+  const char*   name,
+  database_t*   database,
+  table_t*      table,
+  char*         column,
+  uint32_t      limit,
+  uint32_t      offset
+)
+{
+  statement_t     statement = { 0 };
+  bench_result_t  result    = bench_result_new(name, "row", BENCH_SCAN_REPEATS);
+  statement.type            = STATEMENT_SELECT;
+  statement.where.op        = WHERE_NONE;
+  statement.order_column    = column;
+  statement.limit           = limit;
+  statement.offset          = offset;
+  for (uint32_t i = 0; i < BENCH_SCAN_REPEATS; i++)
+  {
+    uint64_t  matches  = 0;
+    uint64_t  examined = table->pager->stats.rows_examined;
+    uint64_t  start    = bench_now_ns();
+    table_select_ordered(database, table, &statement, bench_count_row, &matches);
+    bench_record(&result, bench_now_ns() - start, table->pager->stats.rows_examined - examined);
+  }
+  bench_report(&result);
+}
+
+/* Full scans through the select result writer into /dev/null, text against binary rows */
+void
+bench_result_output(
+  const char*     name,
+  table_t*        table,
+  result_format_e format
+)
+{
+  FILE*           sink   = fopen("/dev/null", "w");
+  bench_result_t  result = bench_result_new(name, "row", BENCH_SCAN_REPEATS);
+  for (uint32_t i = 0; i < BENCH_SCAN_REPEATS; i++)
+  {
+    uint64_t        rows   = 0;
+    uint64_t        start  = bench_now_ns();
+    result_writer_t writer;
+    result_writer_init(&writer, sink, format, table->pager);
+    cursor_t* cursor = table_start(table);
+    while (!(cursor->end_of_table))
+    {
+      row_view_t view = row_view_at(cursor);
+      result_writer_row(&view, &writer);
+      rows += 1;
+      cursor_advance(cursor);
+    }
+    result_writer_finish(&writer);
+    fflush(sink);
+    bench_record(&result, bench_now_ns() - start, rows);
+    free(cursor);
+  }
+  bench_report(&result);
+  fclose(sink);
+}
+
+/* Cold means the OS cache dropped and no warm list for db_open() to prefetch */
+void
+bench_drop_caches(
+  const char* filename
+)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd != -1)
+  {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.warm", filename);
+  unlink(path);
+}
+
+/* One full scan right after reopening the file with the OS cache dropped */
+void
+bench_cold_scan(
+  const char* name,
+  const char* filename
+)
+{
+  bench_drop_caches(filename);
+  database_t*     database  = db_open(filename);
+  table_t*        table     = database_find_table(database, DEFAULT_TABLE_NAME);
+  bench_result_t  result    = bench_result_new(name, "row", 1);
+  uint64_t        rows      = 0;
+  uint64_t        start     = bench_now_ns();
+  cursor_t*       cursor    = table_start(table);
+  while (!(cursor->end_of_table))
+  {
+    rows += 1;
+    cursor_advance(cursor);
+  }
+  bench_record(&result, bench_now_ns() - start, rows);
+  free(cursor);
+  bench_report(&result);
+  db_close(database);
+}
+
+/* Cold scans of the randomly loaded file before and after .vacuum packs it into key order */
+void
+bench_vacuum(
+  const char* filename
+)
+{
+  bench_cold_scan("full_scan_cold_fragmented", filename);
+
+  database_t*     database  = db_open(filename);
+  bench_result_t  result    = bench_result_new("vacuum", "page", 1);
+  uint32_t        num_pages = database->pager->num_pages;
+  uint64_t        start     = bench_now_ns();
+  database_vacuum(database, 100, false);
+  bench_record(&result, bench_now_ns() - start, num_pages);
+  bench_report(&result);
+  db_close(database);
+
+  bench_cold_scan("full_scan_cold_vacuumed", filename);
+}
+
+/* The vacuumed file rewritten with compressed pages, then scanned cold like above */
+void
+bench_compress(
+  const char* filename
+)
+{
+  database_t*     database  = db_open(filename);
+  bench_result_t  result    = bench_result_new("compress", "page", 1);
+  uint32_t        num_pages = database->pager->num_pages;
+  uint64_t        start     = bench_now_ns();
+  database_vacuum(database, 100, true);
+  bench_record(&result, bench_now_ns() - start, num_pages);
+  bench_report(&result);
+  db_close(database);
+
+  bench_cold_scan("full_scan_cold_compressed", filename);
+}
+
+/*
+ Cold: first access of every page after reopening the file with the OS cache dropped.
+ Warm: the same pages again, now resident in the pager.
+*/
+void
+bench_get_page(
+  const char* filename
+)
+{
+  bench_drop_caches(filename);
+  database_t*     database  = db_open(filename);
+  pager_t*        pager     = database->pager;
+  uint32_t        num_pages = pager->num_pages;
+  bench_result_t  cold      = bench_result_new("get_page_cold", "page", num_pages);
+  bench_result_t  warm      = bench_result_new("get_page_warm", "page", num_pages);
+
+  for (uint32_t i = 1; i < num_pages; i++)
+  {
+    uint64_t start = bench_now_ns();
+    get_page(pager, i);
+    bench_record(&cold, bench_now_ns() - start, 1);
+  }
+  for (uint32_t i = 1; i < num_pages; i++)
+  {
+    uint64_t start = bench_now_ns();
+    get_page(pager, i);
+    bench_record(&warm, bench_now_ns() - start, 1);
+  }
+  bench_report(&cold);
+  bench_report(&warm);
+  db_close(database);
+}
+
+void
+usage(
+  const char* program
+)
+{
+  fprintf(stderr, "Usage: %s [--rows N] [--file PATH] [--seed N]\n", program);
+  exit(EXIT_FAILURE);
+}
+
+int
+main(
+  int     argc,
+  char*   argv[]
+)
+{
+  uint32_t    count     = BENCH_DEFAULT_ROWS;
+  const char* filename  = "bench.db";
+  uint32_t    seed      = 1;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc)
+    {
+      count = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc)
+    {
+      filename = argv[++i];
+    }
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+    {
+      seed = atoi(argv[++i]);
+    }
+    else
+    {
+      usage(argv[0]);
+    }
+  }
+  if (count == 0)
+  {
+    usage(argv[0]);
+  }
+  srand(seed);
+
+  uint32_t* sequential = malloc(count * sizeof(uint32_t));
+  uint32_t* random     = malloc(count * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; i++)
+  {
+    sequential[i] = i + 1;
+    random[i]     = i + 1;
+  }
+  shuffle(random, count);
+
+  printf("{\n  \"config\": {\"rows\": %u, \"seed\": %u, \"max_pages\": %u},\n  \"benchmarks\": [\n",
+         count, seed, TABLE_MAX_PAGES);
+
+  bench_execute_insert("execute_insert_sequential", filename, sequential, count, 0);
+  bench_leaf_split(filename, count);
+  bench_execute_insert("execute_insert_random", filename, random, count, 0);
+  bench_vacuum(filename);
+  bench_compress(filename);
+  bench_execute_insert("execute_insert_random_write_buffer", filename, random, count, BENCH_WRITE_BUFFER_ROWS);
+  bench_copy_from(filename, random, count);
+
+  database_t* database = db_open(filename);
+  table_t*    table    = database_find_table(database, DEFAULT_TABLE_NAME);
+  shuffle(random, count);
+  bench_table_find(table, random, count);
+  bench_full_scan(table);
+  bench_result_output("select_output_text", table, RESULT_FORMAT_TEXT);
+  bench_result_output("select_output_binary", table, RESULT_FORMAT_BINARY);
+  bench_copy_to("copy_to_csv", filename, table, RESULT_FORMAT_CSV);
+  bench_copy_to("copy_to_binary", filename, table, RESULT_FORMAT_BINARY);
+  bench_filter_scan("filter_scan_rows", table);
+  bench_order_limit("order_by_top_k", database, table, "email", 10, 0);
+  bench_order_limit("order_by_sort", database, table, "email", UINT32_MAX, count - 10);
+  bench_order_limit("limit_offset_rank_seek", database, table, NULL, 10, count / 2);
+  table->leaf_layout = LEAF_LAYOUT_PAX;
+  database_vacuum(database, 100, false);
+  bench_filter_scan("filter_scan_pax", table);
+  db_close(database);
+
+  bench_get_page(filename);
+
+  printf("\n  ]\n}\n");
+  // Takes the warm list db_close() leaves next to the file with it
+  bench_drop_caches(filename);
+  unlink(filename);
+  free(sequential);
+  free(random);
+  return 0;
+}
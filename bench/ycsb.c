@@ -0,0 +1,706 @@
+/*
+ * YCSB-style workload driver.
+ * Loads a users table, then runs a read/update/scan/insert mix against it with
+ * uniform, zipfian, sequential or latest key choice. The cache can be made smaller
+ * than the database to reproduce eviction traffic. With --restart the database is
+ * reopened after the run, with the OS cache dropped and its warm list kept or not,
+ * and the run repeated, so the timeline shows how fast throughput recovers.
+ * Results are one JSON document.
+ * Links against db_study.c built with -DDB_STUDY_NO_MAIN, see `make ycsb`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "../db_study.h"
+
+#define YCSB_DEFAULT_RECORDS      100000
+#define YCSB_DEFAULT_OPERATIONS   200000
+#define YCSB_DEFAULT_CACHE_PAGES  1024
+#define YCSB_DEFAULT_INTERVAL_MS  250
+#define YCSB_DEFAULT_SCAN_LENGTH  100
+#define YCSB_ZIPFIAN_CONSTANT     0.99
+
+typedef enum operation_enum     operation_e;
+typedef enum distribution_enum  distribution_e;
+typedef struct workload_struct  workload_t;
+typedef struct zipfian_struct   zipfian_t;
+typedef struct latency_struct   latency_t;
+typedef struct driver_struct    driver_t;
+typedef struct interval_struct  interval_t;
+
+enum operation_enum
+{
+    OPERATION_LOAD,
+    OPERATION_READ,
+    OPERATION_UPDATE,
+    OPERATION_SCAN,
+    OPERATION_INSERT,
+    OPERATION_COUNT
+};
+
+enum distribution_enum
+{
+    DISTRIBUTION_UNIFORM,
+    DISTRIBUTION_ZIPFIAN,
+    DISTRIBUTION_SEQUENTIAL,
+    DISTRIBUTION_LATEST
+};
+
+/* Operation mix, the proportions add up to 1 */
+struct workload_struct
+{
+    const char*     letter;
+    const char*     name;
+    double          read;
+    double          update;
+    double          scan;
+    double          insert;
+    distribution_e  distribution;
+};
+
+/* Gray et al. zipfian generator over [0, items), as used by YCSB */
+struct zipfian_struct
+{
+    uint64_t    items;
+    double      theta;
+    double      alpha;
+    double      zeta2;
+    double      zetan;
+    double      eta;
+};
+
+struct latency_struct
+{
+    uint64_t*   samples;
+    uint64_t    count;
+    uint64_t    total_ns;
+};
+
+struct driver_struct
+{
+    database_t*     database;
+    table_t*        table;
+    workload_t*     workload;
+    distribution_e  distribution;
+    zipfian_t       zipfian;
+    uint64_t        rng;
+    uint32_t        max_key;
+    uint32_t        next_sequential;
+    uint32_t        scan_length;
+    latency_t       latency[OPERATION_COUNT];
+};
+
+/* Throughput timeline, one JSON object per interval */
+struct interval_struct
+{
+    uint64_t    start_ns;
+    uint64_t    ops;
+    uint64_t    misses;
+    uint64_t    evictions;
+    uint32_t    pages;
+};
+
+static workload_t workloads[] =
+{
+    { "a", "update-heavy",  0.50, 0.50, 0.00, 0.00, DISTRIBUTION_ZIPFIAN },
+    { "b", "read-heavy",    0.95, 0.05, 0.00, 0.00, DISTRIBUTION_ZIPFIAN },
+    { "c", "read-only",     1.00, 0.00, 0.00, 0.00, DISTRIBUTION_ZIPFIAN },
+    { "d", "insert-latest", 0.95, 0.00, 0.00, 0.05, DISTRIBUTION_LATEST  },
+    { "e", "scan-heavy",    0.00, 0.00, 0.95, 0.05, DISTRIBUTION_ZIPFIAN },
+};
+
+static const char* operation_names[]    = { "load", "read", "update", "scan", "insert" };
+static const char* distribution_names[] = { "uniform", "zipfian", "sequential", "latest" };
+
+uint64_t
+now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* xorshift64* */
+uint64_t
+rng_next(
+  uint64_t* state
+)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1Dull;
+}
+
+double
+rng_double(
+  uint64_t* state
+)
+{
+  return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* FNV-1a, spreads zipfian ranks over the key space */
+uint64_t
+fnv_hash(
+  uint64_t  value
+)
+{
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (int i = 0; i < 8; i++)
+  {
+    hash ^= value & 0xFF;
+    hash *= 0x100000001B3ull;
+    value >>= 8;
+  }
+  return hash;
+}
+
+/* Grows the item count, extending zeta(n) incrementally */
+void
+zipfian_resize(
+  zipfian_t*  zipfian,
+  uint64_t    items
+)
+{
+  for (uint64_t i = zipfian->items + 1; i <= items; i++)
+  {
+    zipfian->zetan += 1.0 / pow((double)i, zipfian->theta);
+  }
+  zipfian->items  = items;
+  zipfian->eta    = (1.0 - pow(2.0 / items, 1.0 - zipfian->theta)) /
+                    (1.0 - zipfian->zeta2 / zipfian->zetan);
+}
+
+void
+zipfian_init(
+  zipfian_t*  zipfian,
+  uint64_t    items,
+  double      theta
+)
+{
+  zipfian->items  = 0;
+  zipfian->theta  = theta;
+  zipfian->alpha  = 1.0 / (1.0 - theta);
+  zipfian->zeta2  = 1.0 + 1.0 / pow(2.0, theta);
+  zipfian->zetan  = 0;
+  zipfian_resize(zipfian, items);
+}
+
+uint64_t
+zipfian_next(
+  zipfian_t*  zipfian,
+  uint64_t*   rng
+)
+{
+  double u  = rng_double(rng);
+  double uz = u * zipfian->zetan;
+  if (uz < 1.0)
+  {
+    return 0;
+  }
+  if (uz < 1.0 + pow(0.5, zipfian->theta))
+  {
+    return 1;
+  }
+  uint64_t rank = (uint64_t)(zipfian->items * pow(zipfian->eta * u - zipfian->eta + 1.0, zipfian->alpha));
+  return rank < zipfian->items ? rank : zipfian->items - 1;
+}
+
+/* Picks an existing key in [1, max_key] */
+uint32_t
+driver_next_key(
+  driver_t* driver
+)
+{
+  switch (driver->distribution)
+  {
+    case (DISTRIBUTION_UNIFORM):
+      return 1 + rng_next(&(driver->rng)) % driver->max_key;
+    case (DISTRIBUTION_ZIPFIAN):
+      return 1 + fnv_hash(zipfian_next(&(driver->zipfian), &(driver->rng))) % driver->max_key;
+    case (DISTRIBUTION_SEQUENTIAL):
+      driver->next_sequential = driver->next_sequential % driver->max_key + 1;
+      return driver->next_sequential;
+    case (DISTRIBUTION_LATEST):
+      return driver->max_key - zipfian_next(&(driver->zipfian), &(driver->rng));
+  }
+  return 1;
+}
+
+void
+make_row(
+  uint32_t  id,
+  uint32_t  version,
+  row_t*    row
+)
+{
+  row->id = id;
+  snprintf(row->username, sizeof(row->username), "user%u", id);
+  snprintf(row->email, sizeof(row->email), "user%u-v%u@example.com", id, version);
+}
+
+void
+latency_record(
+  latency_t*  latency,
+  uint64_t    elapsed_ns
+)
+{
+  latency->samples[latency->count++]  = elapsed_ns;
+  latency->total_ns                  += elapsed_ns;
+}
+
+void
+do_read(
+  driver_t* driver,
+  uint32_t  key
+)
+{
+  row_t row;
+  void* stored = table_get_row(driver->table, key);
+  if (stored != NULL)
+  {
+    deserialize_row(stored, &row);
+  }
+}
+
+/* Overwrites the username and email in place with table_update(), one descent for the row */
+void
+do_update(
+  driver_t* driver,
+  uint32_t  key
+)
+{
+  row_t     row;
+  uint32_t  columns[]  = { 1, 2 };
+  char*     values[]   = { row.username, row.email };
+  bool      found;
+  make_row(key, (uint32_t)rng_next(&(driver->rng)), &row);
+  table_update(driver->table, key, columns, values, 2, &found);
+}
+
+void
+do_scan(
+  driver_t* driver,
+  uint32_t  key
+)
+{
+  row_t     row;
+  uint32_t  length = 1 + rng_next(&(driver->rng)) % driver->scan_length;
+  table_flush_write_buffer(driver->table);
+  cursor_t* cursor = table_find(driver->table, key);
+  void*     node   = get_page(driver->table->pager, cursor->page_num);
+  if (cursor->cell_num >= *leaf_node_num_cells(node))
+  {
+    free(cursor);
+    return;
+  }
+  for (uint32_t i = 0; i < length && !(cursor->end_of_table); i++)
+  {
+    deserialize_row(cursor_value(cursor), &row);
+    cursor_advance(cursor);
+  }
+  free(cursor);
+}
+
+void
+do_insert(
+  driver_t* driver,
+  uint32_t  key
+)
+{
+  uint8_t buffer[PAGE_SIZE];
+  row_t   row;
+  make_row(key, 0, &row);
+  serialize_row(&row, buffer);
+  if (table_insert(driver->table, buffer) != EXECUTE_SUCCESS)
+  {
+    printf("Insert of key %u failed.\n", key);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static bool first_interval = true;
+
+void
+interval_begin(
+  interval_t* interval,
+  pager_t*    pager
+)
+{
+  interval->start_ns  = now_ns();
+  interval->ops       = 0;
+  interval->misses    = pager->stats.cache_misses;
+  interval->evictions = pager->stats.cache_evictions;
+  interval->pages     = pager->num_pages;
+}
+
+void
+interval_report(
+  interval_t* interval,
+  pager_t*    pager,
+  const char* phase,
+  uint64_t    run_start_ns
+)
+{
+  uint64_t  now     = now_ns();
+  double    seconds = (now - interval->start_ns) / 1e9;
+  printf("%s    {\"phase\": \"%s\", \"t\": %.3f, \"ops\": %llu, \"ops_per_sec\": %.1f, "
+         "\"cache_misses\": %llu, \"evictions\": %llu, \"new_pages\": %u}",
+         first_interval ? "" : ",\n", phase, (now - run_start_ns) / 1e9,
+         (unsigned long long)interval->ops, seconds > 0 ? interval->ops / seconds : 0.0,
+         (unsigned long long)(pager->stats.cache_misses - interval->misses),
+         (unsigned long long)(pager->stats.cache_evictions - interval->evictions),
+         pager->num_pages - interval->pages);
+  first_interval = false;
+  interval_begin(interval, pager);
+}
+
+void
+run_phase(
+  driver_t*   driver,
+  const char* phase,
+  uint64_t    operations,
+  uint64_t    interval_ns,
+  uint64_t    run_start_ns
+)
+{
+  pager_t*    pager = driver->table->pager;
+  workload_t* mix   = driver->workload;
+  interval_t  interval;
+  interval_begin(&interval, pager);
+
+  for (uint64_t i = 0; i < operations; i++)
+  {
+    operation_e operation = OPERATION_LOAD;
+    uint32_t    key       = (uint32_t)i + 1;
+    if (strcmp(phase, "load") != 0)
+    {
+      double choice = rng_double(&(driver->rng));
+      if ((choice -= mix->read) < 0)          { operation = OPERATION_READ; }
+      else if ((choice -= mix->update) < 0)   { operation = OPERATION_UPDATE; }
+      else if ((choice -= mix->scan) < 0)     { operation = OPERATION_SCAN; }
+      else                                    { operation = OPERATION_INSERT; }
+      key = (operation == OPERATION_INSERT) ? driver->max_key + 1 : driver_next_key(driver);
+    }
+
+    // With the page writer on, operations take the database lock like process_input() does
+    uint64_t start = now_ns();
+    if (driver->database->writer_running)
+    {
+      pthread_mutex_lock(&(driver->database->lock));
+    }
+    switch (operation)
+    {
+      case (OPERATION_READ):
+        do_read(driver, key);
+        break;
+      case (OPERATION_UPDATE):
+        do_update(driver, key);
+        break;
+      case (OPERATION_SCAN):
+        do_scan(driver, key);
+        break;
+      default:
+        do_insert(driver, key);
+        break;
+    }
+    pager_release_pages(pager);
+    if (driver->database->writer_running)
+    {
+      pthread_mutex_unlock(&(driver->database->lock));
+    }
+    uint64_t end = now_ns();
+    latency_record(&(driver->latency[operation]), end - start);
+
+    if (operation == OPERATION_LOAD || operation == OPERATION_INSERT)
+    {
+      driver->max_key = key;
+      if (driver->distribution != DISTRIBUTION_UNIFORM && driver->distribution != DISTRIBUTION_SEQUENTIAL)
+      {
+        zipfian_resize(&(driver->zipfian), key);
+      }
+    }
+
+    interval.ops += 1;
+    if (end - interval.start_ns >= interval_ns)
+    {
+      interval_report(&interval, pager, phase, run_start_ns);
+    }
+  }
+  if (interval.ops > 0)
+  {
+    interval_report(&interval, pager, phase, run_start_ns);
+  }
+}
+
+/* Opens the database with the cache, write buffer and page writer the run asks for */
+void
+driver_open(
+  driver_t*   driver,
+  const char* filename,
+  uint32_t    cache_pages,
+  uint32_t    write_buffer,
+  bool        writer
+)
+{
+  driver->database  = db_open(filename);
+  driver->table     = database_find_table(driver->database, DEFAULT_TABLE_NAME);
+  driver->database->pager->cache_capacity = cache_pages;
+  database_set_write_buffer(driver->database, write_buffer);
+  if (writer)
+  {
+    database_start_writer(driver->database);
+  }
+}
+
+int
+compare_u64(
+  const void* a,
+  const void* b
+)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+uint64_t
+percentile(
+  latency_t*  latency,
+  double      fraction
+)
+{
+  return latency->samples[(uint64_t)(fraction * (latency->count - 1) + 0.5)];
+}
+
+void
+report_latencies(
+  driver_t* driver
+)
+{
+  bool first = true;
+  for (int i = 0; i < OPERATION_COUNT; i++)
+  {
+    latency_t* latency = &(driver->latency[i]);
+    if (latency->count == 0)
+    {
+      continue;
+    }
+    qsort(latency->samples, latency->count, sizeof(uint64_t), compare_u64);
+    double seconds = latency->total_ns / 1e9;
+    printf("%s    {\"operation\": \"%s\", \"ops\": %llu, \"ops_per_sec\": %.1f, \"mean_ns\": %llu, "
+           "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+           first ? "" : ",\n", operation_names[i], (unsigned long long)latency->count,
+           seconds > 0 ? latency->count / seconds : 0.0,
+           (unsigned long long)(latency->total_ns / latency->count),
+           (unsigned long long)percentile(latency, 0.50),
+           (unsigned long long)percentile(latency, 0.99),
+           (unsigned long long)percentile(latency, 0.999),
+           (unsigned long long)latency->samples[latency->count - 1]);
+    first = false;
+  }
+}
+
+workload_t*
+find_workload(
+  const char* name
+)
+{
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+  {
+    if (strcmp(name, workloads[i].letter) == 0 || strcmp(name, workloads[i].name) == 0)
+    {
+      return &workloads[i];
+    }
+  }
+  return NULL;
+}
+
+bool
+find_distribution(
+  const char*     name,
+  distribution_e* distribution
+)
+{
+  for (int i = 0; i <= DISTRIBUTION_LATEST; i++)
+  {
+    if (strcmp(name, distribution_names[i]) == 0)
+    {
+      *distribution = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+usage(
+  const char* program
+)
+{
+  fprintf(stderr,
+          "Usage: %s [--workload a|b|c|d|e|update-heavy|read-heavy|read-only|insert-latest|scan-heavy]\n"
+          "          [--distribution uniform|zipfian|sequential|latest] [--records N] [--operations N]\n"
+          "          [--cache-pages N] [--scan-length N] [--interval-ms N] [--write-buffer ROWS]\n"
+          "          [--writer on|off] [--restart off|cold|warm] [--seed N] [--file PATH]\n",
+          program);
+  exit(EXIT_FAILURE);
+}
+
+int
+main(
+  int     argc,
+  char*   argv[]
+)
+{
+  workload_t*     workload          = &workloads[0];
+  bool            distribution_set  = false;
+  distribution_e  distribution      = DISTRIBUTION_ZIPFIAN;
+  uint32_t        records           = YCSB_DEFAULT_RECORDS;
+  uint64_t        operations        = YCSB_DEFAULT_OPERATIONS;
+  uint32_t        cache_pages       = YCSB_DEFAULT_CACHE_PAGES;
+  uint32_t        scan_length       = YCSB_DEFAULT_SCAN_LENGTH;
+  uint64_t        interval_ms       = YCSB_DEFAULT_INTERVAL_MS;
+  uint32_t        write_buffer      = 0;
+  bool            writer            = false;
+  const char*     restart           = "off";
+  uint64_t        seed              = 1;
+  const char*     filename          = "ycsb.db";
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+    if (value == NULL)
+    {
+      usage(argv[0]);
+    }
+    if (strcmp(argv[i], "--workload") == 0)
+    {
+      workload = find_workload(value);
+      if (workload == NULL)
+      {
+        usage(argv[0]);
+      }
+    }
+    else if (strcmp(argv[i], "--distribution") == 0)
+    {
+      if (!find_distribution(value, &distribution))
+      {
+        usage(argv[0]);
+      }
+      distribution_set = true;
+    }
+    else if (strcmp(argv[i], "--records") == 0)       { records     = atoi(value); }
+    else if (strcmp(argv[i], "--operations") == 0)    { operations  = strtoull(value, NULL, 10); }
+    else if (strcmp(argv[i], "--cache-pages") == 0)   { cache_pages = atoi(value); }
+    else if (strcmp(argv[i], "--scan-length") == 0)   { scan_length = atoi(value); }
+    else if (strcmp(argv[i], "--interval-ms") == 0)   { interval_ms = strtoull(value, NULL, 10); }
+    else if (strcmp(argv[i], "--write-buffer") == 0)  { write_buffer = atoi(value); }
+    else if (strcmp(argv[i], "--writer") == 0)        { writer      = strcmp(value, "on") == 0; }
+    else if (strcmp(argv[i], "--restart") == 0)       { restart     = value; }
+    else if (strcmp(argv[i], "--seed") == 0)          { seed        = strtoull(value, NULL, 10); }
+    else if (strcmp(argv[i], "--file") == 0)          { filename    = value; }
+    else
+    {
+      usage(argv[0]);
+    }
+    i++;
+  }
+  if (records == 0 || cache_pages == 0 || scan_length == 0 || seed == 0 ||
+      (strcmp(restart, "off") != 0 && strcmp(restart, "cold") != 0 && strcmp(restart, "warm") != 0))
+  {
+    usage(argv[0]);
+  }
+
+  driver_t driver;
+  memset(&driver, 0, sizeof(driver));
+  driver.workload     = workload;
+  driver.distribution = distribution_set ? distribution : workload->distribution;
+  driver.rng          = seed;
+  driver.scan_length  = scan_length;
+  zipfian_init(&(driver.zipfian), 1, YCSB_ZIPFIAN_CONSTANT);
+  driver.latency[OPERATION_LOAD].samples = malloc(records * sizeof(uint64_t));
+  for (int i = OPERATION_READ; i < OPERATION_COUNT; i++)
+  {
+    driver.latency[i].samples = malloc(operations * sizeof(uint64_t));
+  }
+
+  char warm_path[PATH_MAX];
+  snprintf(warm_path, sizeof(warm_path), "%s.warm", filename);
+  unlink(filename);
+  unlink(warm_path);
+  driver_open(&driver, filename, cache_pages, write_buffer, writer);
+
+  printf("{\n  \"config\": {\"workload\": \"%s\", \"distribution\": \"%s\", \"records\": %u, "
+         "\"operations\": %llu, \"cache_pages\": %u, \"write_buffer\": %u, \"writer\": %s, \"restart\": \"%s\", "
+         "\"page_size\": %u, \"max_pages\": %u, \"seed\": %llu},\n",
+         workload->name, distribution_names[driver.distribution], records,
+         (unsigned long long)operations, cache_pages, write_buffer, writer ? "true" : "false", restart,
+         PAGE_SIZE, TABLE_MAX_PAGES, (unsigned long long)seed);
+  printf("  \"timeline\": [\n");
+
+  uint64_t interval_ns     = interval_ms * 1000000ull;
+  uint64_t run_start       = now_ns();
+  run_phase(&driver, "load", records, interval_ns, run_start);
+  pager_t* pager           = driver.database->pager;
+  uint64_t load_misses     = pager->stats.cache_misses;
+  uint64_t load_evictions  = pager->stats.cache_evictions;
+  uint64_t load_writes     = pager->stats.eviction_writes;
+  run_phase(&driver, "run", operations, interval_ns, run_start);
+
+  // The latencies and cache figures below then cover the restarted run only
+  if (strcmp(restart, "off") != 0)
+  {
+    for (int i = OPERATION_READ; i < OPERATION_COUNT; i++)
+    {
+      driver.latency[i].count     = 0;
+      driver.latency[i].total_ns  = 0;
+    }
+    db_close(driver.database);
+    if (strcmp(restart, "cold") == 0)
+    {
+      unlink(warm_path);
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd != -1)
+    {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+    // The page writer loads the warm list, so it runs after either restart
+    driver_open(&driver, filename, cache_pages, write_buffer, true);
+    pager           = driver.database->pager;
+    load_misses     = 0;
+    load_evictions  = 0;
+    load_writes     = 0;
+    run_phase(&driver, "restart", operations, interval_ns, run_start);
+  }
+
+  printf("\n  ],\n  \"operations\": [\n");
+  report_latencies(&driver);
+  uint64_t hits   = pager->stats.cache_hits;
+  uint64_t misses = pager->stats.cache_misses;
+  printf("\n  ],\n  \"cache\": {\"database_pages\": %u, \"run_misses\": %llu, \"run_evictions\": %llu, "
+         "\"run_eviction_writes\": %llu, \"warm_pages_loaded\": %llu, \"hit_ratio\": %.4f}\n}\n",
+         pager->num_pages,
+         (unsigned long long)(misses - load_misses),
+         (unsigned long long)(pager->stats.cache_evictions - load_evictions),
+         (unsigned long long)(pager->stats.eviction_writes - load_writes),
+         (unsigned long long)pager->stats.warm_pages_loaded,
+         hits + misses ? (double)hits / (hits + misses) : 0.0);
+
+  db_close(driver.database);
+  unlink(filename);
+  unlink(warm_path);
+  for (int i = 0; i < OPERATION_COUNT; i++)
+  {
+    free(driver.latency[i].samples);
+  }
+  return 0;
+}
@@ -1,22 +1,45 @@
+// 64-bit off_t on 32-bit hosts too, files go past 4 GB
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #include "db_study.h"
 
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
-void*get_page(pager_t* pager, uint32_t page_num);
 void set_node_type(void* node, node_type_e type);
 void set_node_root(void* node, bool is_root);
+bool is_node_root(void* node);
+void print_tables(database_t* database);
+void schema_add_column(schema_t* schema, const char* name, column_type_e type, uint32_t size);
 uint32_t* internal_node_num_keys(void* node);
 uint32_t* internal_node_key(void* node, uint32_t key_num);
 uint32_t* internal_node_child(void* node, uint32_t child_num);
 uint32_t* internal_node_right_child(void* node);
-cursor_t* table_find(table_t* table, uint32_t key);
+uint32_t* internal_node_row_count(void* node);
+uint32_t get_node_max_key(pager_t* pager, void* node);
+void internal_node_split_and_insert(table_t* table, uint32_t parent_page_num, uint32_t child_page_num);
+pager_t* pager_open(const char* filename);
+void pager_flush_all(pager_t* pager);
+void pager_flush_catalog(pager_t* pager);
+bool pager_flush(pager_t* pager, uint32_t page_num);
+void pager_read_ahead(pager_t* pager, uint32_t page_num);
+uint32_t* pager_warm_list(pager_t* pager);
+void database_save_warm(database_t* database, uint32_t* list);
+uint32_t get_unused_page_num(pager_t* pager);
 
 const uint32_t ID_SIZE        = size_of_attribute(row_t, id);
 const uint32_t USERNAME_SIZE  = size_of_attribute(row_t, username);
@@ -29,6 +52,9 @@ const uint32_t ROW_SIZE         = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
 
 const uint32_t PAGE_SIZE      = 4096;
+/* Every page ends with the CRC32C of the bytes before it, see pager_flush() */
+const uint32_t PAGE_CHECKSUM_SIZE   = sizeof(uint32_t);
+const uint32_t PAGE_CHECKSUM_OFFSET = PAGE_SIZE - PAGE_CHECKSUM_SIZE;
 //const uint32_t ROWS_PER_PAGE  = PAGE_SIZE / ROW_SIZE;
 //const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
 
@@ -53,20 +79,41 @@ const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 //const uint32_t LEAF_NODE_HEADER_SIZE      = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+/* Row width of the owning table, so cells can be located without the schema */
+const uint32_t LEAF_NODE_VALUE_SIZE_SIZE   = sizeof(uint16_t);
+const uint32_t LEAF_NODE_VALUE_SIZE_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+/* leaf_layout_e, the upper half of what used to be a 32-bit value size, so older leaves hold rows */
+const uint32_t LEAF_NODE_LAYOUT_SIZE       = sizeof(uint16_t);
+const uint32_t LEAF_NODE_LAYOUT_OFFSET     = LEAF_NODE_VALUE_SIZE_OFFSET + LEAF_NODE_VALUE_SIZE_SIZE;
 const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
                                        LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+                                       LEAF_NODE_NEXT_LEAF_SIZE +
+                                       LEAF_NODE_VALUE_SIZE_SIZE +
+                                       LEAF_NODE_LAYOUT_SIZE;
+
+/*
+ * PAX leaves: the width of every column follows the header, then one minipage
+ * per column holds that column for all max_cells cells. The id column comes
+ * first and doubles as the keys, a minipage starts at max_cells times the
+ * column's offset in the serialized row.
+ */
+const uint32_t LEAF_NODE_PAX_NUM_COLUMNS_OFFSET = LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_PAX_WIDTHS_OFFSET      = LEAF_NODE_PAX_NUM_COLUMNS_OFFSET + sizeof(uint16_t);
+const uint32_t LEAF_NODE_PAX_HEADER_SIZE        = LEAF_NODE_PAX_WIDTHS_OFFSET +
+                                                  TABLE_MAX_COLUMNS * sizeof(uint16_t);
 
 
 /*
  * Leaf Node Body Layout
+ * The sizes below are those of the default users table,
+ * other tables size their cells from LEAF_NODE_VALUE_SIZE_OFFSET.
  */
 const uint32_t LEAF_NODE_KEY_SIZE         = sizeof(uint32_t);
 const uint32_t LEAF_NODE_KEY_OFFSET       = 0;
 const uint32_t LEAF_NODE_VALUE_SIZE       = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET     = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
 const uint32_t LEAF_NODE_CELL_SIZE        = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS  = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_SPACE_FOR_CELLS  = PAGE_CHECKSUM_OFFSET - LEAF_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_MAX_CELLS        = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
 
 const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
@@ -82,9 +129,15 @@ const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE   = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + 
                                                   INTERNAL_NODE_NUM_KEYS_SIZE;
 
+/* Number of rows stored in the whole subtree, kept for O(1) count(*) */
+const uint32_t INTERNAL_NODE_ROW_COUNT_SIZE     = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_ROW_COUNT_OFFSET   = INTERNAL_NODE_RIGHT_CHILD_OFFSET +
+                                                  INTERNAL_NODE_RIGHT_CHILD_SIZE;
+
 const uint32_t INTERNAL_NODE_HEADER_SIZE        = COMMON_NODE_HEADER_SIZE +
                                                   INTERNAL_NODE_NUM_KEYS_SIZE +
-                                                  INTERNAL_NODE_RIGHT_CHILD_SIZE;
+                                                  INTERNAL_NODE_RIGHT_CHILD_SIZE +
+                                                  INTERNAL_NODE_ROW_COUNT_SIZE;
 
 /*
  * Internal Node Body Layout
@@ -97,6 +150,113 @@ const uint32_t INTERNAL_NODE_CELL_SIZE  = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NO
 /* Keep this small for testing */
 const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
 
+/* Right child of an internal node that has no children yet */
+#define INVALID_PAGE_NUM UINT32_MAX
+
+
+/*
+ * Catalog Layout (page 0)
+ * Header: magic, number of tables.
+ * Then one fixed-size entry per table: name, root page, number of columns
+ * and for every column its name, type, size and index root (0 = not indexed).
+ * The format version sits at the end of the page, where older files have zeros.
+ */
+const uint32_t CATALOG_PAGE_NUM                 = 0;
+const uint32_t CATALOG_MAGIC                    = 0x54534244; // "DBST"
+const uint32_t CATALOG_MAGIC_SIZE               = sizeof(uint32_t);
+const uint32_t CATALOG_MAGIC_OFFSET             = 0;
+const uint32_t CATALOG_NUM_TABLES_SIZE          = sizeof(uint32_t);
+const uint32_t CATALOG_NUM_TABLES_OFFSET        = CATALOG_MAGIC_OFFSET + CATALOG_MAGIC_SIZE;
+const uint32_t CATALOG_HEADER_SIZE              = CATALOG_MAGIC_SIZE + CATALOG_NUM_TABLES_SIZE;
+
+const uint32_t CATALOG_COLUMN_NAME_OFFSET       = 0;
+const uint32_t CATALOG_COLUMN_TYPE_OFFSET       = CATALOG_COLUMN_NAME_OFFSET + COLUMN_NAME_SIZE;
+const uint32_t CATALOG_COLUMN_SIZE_OFFSET       = CATALOG_COLUMN_TYPE_OFFSET + sizeof(uint32_t);
+const uint32_t CATALOG_COLUMN_INDEX_ROOT_OFFSET = CATALOG_COLUMN_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t CATALOG_COLUMN_ENTRY_SIZE        = CATALOG_COLUMN_INDEX_ROOT_OFFSET + sizeof(uint32_t);
+
+const uint32_t CATALOG_TABLE_NAME_OFFSET        = 0;
+const uint32_t CATALOG_TABLE_ROOT_PAGE_OFFSET   = CATALOG_TABLE_NAME_OFFSET + TABLE_NAME_SIZE;
+const uint32_t CATALOG_TABLE_NUM_COLUMNS_OFFSET = CATALOG_TABLE_ROOT_PAGE_OFFSET + sizeof(uint32_t);
+const uint32_t CATALOG_TABLE_COLUMNS_OFFSET     = CATALOG_TABLE_NUM_COLUMNS_OFFSET + sizeof(uint32_t);
+/* DB_MAX_TABLES entries of this size, the Bloom roots and the version must end before the checksum */
+const uint32_t CATALOG_TABLE_ENTRY_SIZE         = CATALOG_TABLE_COLUMNS_OFFSET +
+                                                  TABLE_MAX_COLUMNS * CATALOG_COLUMN_ENTRY_SIZE;
+/* Bloom filter root page of each table, after the last possible table entry */
+const uint32_t CATALOG_BLOOM_ROOTS_OFFSET       = CATALOG_HEADER_SIZE + DB_MAX_TABLES * CATALOG_TABLE_ENTRY_SIZE;
+const uint32_t CATALOG_VERSION_OFFSET           = CATALOG_BLOOM_ROOTS_OFFSET + DB_MAX_TABLES * sizeof(uint32_t);
+/*
+ Version 1: files from before the version field, page offsets were computed in 32 bits.
+ Version 2: 64-bit page offsets; page numbers stay 32 bits, 16 TB of 4 KB pages.
+ Version 3: CRC32C page trailers. Older files are rewritten by a vacuum when opened.
+ Version 4: optional compressed pages, located through a page map named after the version.
+ Version 5: table leaves may use the PAX layout, recorded per table after the page map.
+ Version 6: text columns wider than COLUMN_TEXT_MAX_SIZE, long values in overflow pages.
+*/
+const uint32_t CATALOG_FORMAT_VERSION           = 6;
+const uint32_t CATALOG_CHECKSUM_VERSION         = 3;
+/* Compressed files only, zero in plain ones: first sector, entries and CRC32C of the page map */
+const uint32_t CATALOG_PAGE_MAP_SECTOR_OFFSET   = CATALOG_VERSION_OFFSET + sizeof(uint32_t);
+const uint32_t CATALOG_PAGE_MAP_ENTRIES_OFFSET  = CATALOG_PAGE_MAP_SECTOR_OFFSET + sizeof(uint64_t);
+const uint32_t CATALOG_PAGE_MAP_CHECKSUM_OFFSET = CATALOG_PAGE_MAP_ENTRIES_OFFSET + sizeof(uint32_t);
+/* One leaf_layout_e byte per table, zero (rows) in older files */
+const uint32_t CATALOG_LEAF_LAYOUTS_OFFSET      = CATALOG_PAGE_MAP_CHECKSUM_OFFSET + sizeof(uint32_t);
+
+/*
+ * Baseline Layout
+ * Files from before the catalog hold only the users table, rooted at page 0.
+ * Leaves: common header, number of cells, next leaf (0 = none), then (key, row) cells.
+ * Internal nodes: common header, number of keys, right child, then (child, key) cells.
+ * Only read, to migrate such files, see database_migrate_baseline().
+ */
+const uint32_t BASELINE_NUM_CELLS_OFFSET        = COMMON_NODE_HEADER_SIZE;
+const uint32_t BASELINE_NEXT_PAGE_OFFSET        = BASELINE_NUM_CELLS_OFFSET + sizeof(uint32_t);
+const uint32_t BASELINE_NODE_HEADER_SIZE        = BASELINE_NEXT_PAGE_OFFSET + sizeof(uint32_t);
+const uint32_t BASELINE_INTERNAL_CELL_SIZE      = 2 * sizeof(uint32_t);
+const uint32_t BASELINE_LEAF_CELL_SIZE          = sizeof(uint32_t) + ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+const uint32_t BASELINE_LEAF_MAX_CELLS          = (PAGE_SIZE - BASELINE_NODE_HEADER_SIZE) / BASELINE_LEAF_CELL_SIZE;
+
+/*
+ * Bloom filter root page layout
+ */
+const uint32_t BLOOM_MAGIC                      = 0x464D4C42; // "BLMF"
+const uint32_t BLOOM_MAGIC_OFFSET               = 0;
+const uint32_t BLOOM_NUM_PAGES_OFFSET           = BLOOM_MAGIC_OFFSET + sizeof(uint32_t);
+const uint32_t BLOOM_NUM_KEYS_OFFSET            = BLOOM_NUM_PAGES_OFFSET + sizeof(uint32_t);
+const uint32_t BLOOM_PAGES_OFFSET               = BLOOM_NUM_KEYS_OFFSET + sizeof(uint32_t);
+const uint32_t BLOOM_MAX_PAGES                  = (PAGE_CHECKSUM_OFFSET - BLOOM_PAGES_OFFSET) / sizeof(uint32_t);
+const uint32_t BLOOM_BLOCK_SIZE                 = 64;
+const uint32_t BLOOM_BLOCKS_PER_PAGE            = PAGE_CHECKSUM_OFFSET / BLOOM_BLOCK_SIZE;
+const uint32_t BLOOM_BITS_PER_KEY               = 10;
+const uint32_t BLOOM_NUM_PROBES                 = 6;
+
+
+/*
+ * Index Node Body Layout
+ * Leaf cell:     key (column value, NUL padded) + id
+ * Internal cell: child + key + id
+ * The id makes entries unique, so (key, id) is compared as a whole.
+ */
+const uint32_t INDEX_NODE_ID_SIZE = sizeof(uint32_t);
+
+
+/*
+ * Overflow text
+ * The row keeps a slot: the value's length, its first overflow page (0 for none) and
+ * the first OVERFLOW_SLOT_PREFIX_SIZE bytes, NUL padded when the value is shorter.
+ * The rest of a longer value is chained through overflow pages, each holding the
+ * next page, the number of bytes it holds and the bytes.
+ */
+const uint32_t OVERFLOW_SLOT_LENGTH_OFFSET      = 0;
+const uint32_t OVERFLOW_SLOT_PAGE_OFFSET        = OVERFLOW_SLOT_LENGTH_OFFSET + sizeof(uint32_t);
+const uint32_t OVERFLOW_SLOT_PREFIX_OFFSET      = OVERFLOW_SLOT_PAGE_OFFSET + sizeof(uint32_t);
+const uint32_t OVERFLOW_SLOT_PREFIX_SIZE        = 24;
+const uint32_t OVERFLOW_SLOT_SIZE               = OVERFLOW_SLOT_PREFIX_OFFSET + OVERFLOW_SLOT_PREFIX_SIZE;
+const uint32_t OVERFLOW_NODE_NEXT_PAGE_OFFSET   = COMMON_NODE_HEADER_SIZE;
+const uint32_t OVERFLOW_NODE_LENGTH_OFFSET      = OVERFLOW_NODE_NEXT_PAGE_OFFSET + sizeof(uint32_t);
+const uint32_t OVERFLOW_NODE_HEADER_SIZE        = OVERFLOW_NODE_LENGTH_OFFSET + sizeof(uint32_t);
+const uint32_t OVERFLOW_NODE_SPACE              = PAGE_CHECKSUM_OFFSET - OVERFLOW_NODE_HEADER_SIZE;
+
 
 uint32_t*
 node_parent(
@@ -122,13 +282,85 @@ leaf_node_num_cells(
   return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
+uint16_t*
+leaf_node_value_size(
+  void*   node
+)
+{
+  return node + LEAF_NODE_VALUE_SIZE_OFFSET;
+}
+
+uint16_t*
+leaf_node_layout(
+  void*   node
+)
+{
+  return node + LEAF_NODE_LAYOUT_OFFSET;
+}
+
+bool
+leaf_node_is_pax(
+  void*   node
+)
+{
+  return *leaf_node_layout(node) == LEAF_LAYOUT_PAX;
+}
+
+uint16_t*
+leaf_node_pax_num_columns(
+  void*   node
+)
+{
+  return node + LEAF_NODE_PAX_NUM_COLUMNS_OFFSET;
+}
+
+uint16_t*
+leaf_node_pax_width(
+  void*     node,
+  uint32_t  column
+)
+{
+  return node + LEAF_NODE_PAX_WIDTHS_OFFSET + column * sizeof(uint16_t);
+}
+
+uint32_t
+leaf_node_cell_size(
+  void*   node
+)
+{
+  return LEAF_NODE_KEY_SIZE + *leaf_node_value_size(node);
+}
+
+uint32_t
+leaf_node_max_cells(
+  void*   node
+)
+{
+  if (leaf_node_is_pax(node))
+  {
+    return (PAGE_CHECKSUM_OFFSET - LEAF_NODE_PAX_HEADER_SIZE) / *leaf_node_value_size(node);
+  }
+  return LEAF_NODE_SPACE_FOR_CELLS / leaf_node_cell_size(node);
+}
+
+/* Key and row of a cell side by side, row leaves only */
 void*
 leaf_node_cell(
   void*     node,
   uint32_t  cell_num
 )
 {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+  return node + LEAF_NODE_HEADER_SIZE + cell_num * leaf_node_cell_size(node);
+}
+
+/* Minipage of a PAX leaf column starting at byte offset of the serialized row */
+uint8_t*
+leaf_node_pax_minipage(
+  void*     node,
+  uint32_t  offset
+)
+{
+  return (uint8_t*)node + LEAF_NODE_PAX_HEADER_SIZE + leaf_node_max_cells(node) * offset;
 }
 
 uint32_t*
@@ -137,9 +369,14 @@ leaf_node_key(
   uint32_t    cell_num
 )
 {
+  if (leaf_node_is_pax(node))
+  {
+    return (uint32_t*)(leaf_node_pax_minipage(node, 0) + cell_num * LEAF_NODE_KEY_SIZE);
+  }
   return leaf_node_cell(node, cell_num);
 }
 
+/* Row leaves only, PAX leaves have no contiguous row */
 void*
 leaf_node_value(
   void*       node,
@@ -151,13 +388,132 @@ leaf_node_value(
 
 void
 initialize_leaf_node(
-  void*     node
+  void*     node,
+  uint32_t  value_size
 )
 {
   set_node_type(node, NODE_LEAF);
   set_node_root(node , false);
-  *leaf_node_num_cells(node) = 0;
-  *leaf_node_next_leaf(node) = 0;//0 represents no sibling
+  *leaf_node_num_cells(node)  = 0;
+  *leaf_node_next_leaf(node)  = 0;//0 represents no sibling
+  *leaf_node_value_size(node) = value_size;
+  *leaf_node_layout(node)     = LEAF_LAYOUT_ROWS;
+}
+
+/* A leaf for rows of the schema, PAX leaves note the width of every column */
+void
+initialize_table_leaf_node(
+  void*         node,
+  schema_t*     schema,
+  leaf_layout_e layout
+)
+{
+  initialize_leaf_node(node, schema->row_size);
+  if (layout == LEAF_LAYOUT_PAX)
+  {
+    *leaf_node_layout(node)           = LEAF_LAYOUT_PAX;
+    *leaf_node_pax_num_columns(node)  = schema->num_columns;
+    for (uint32_t i = 0; i < TABLE_MAX_COLUMNS; i++)
+    {
+      *leaf_node_pax_width(node, i) = i < schema->num_columns ? schema->columns[i].size : 0;
+    }
+  }
+}
+
+/* An empty leaf with the cell format of model */
+void
+initialize_leaf_node_like(
+  void*   node,
+  void*   model
+)
+{
+  initialize_leaf_node(node, *leaf_node_value_size(model));
+  *leaf_node_layout(node) = *leaf_node_layout(model);
+  if (leaf_node_is_pax(model))
+  {
+    memcpy(node + LEAF_NODE_PAX_NUM_COLUMNS_OFFSET, model + LEAF_NODE_PAX_NUM_COLUMNS_OFFSET,
+           LEAF_NODE_PAX_HEADER_SIZE - LEAF_NODE_PAX_NUM_COLUMNS_OFFSET);
+  }
+}
+
+/* Copies the serialized row of a cell out of a leaf of either layout */
+void
+leaf_node_read_row(
+  void*     node,
+  uint32_t  cell_num,
+  void*     row
+)
+{
+  if (!leaf_node_is_pax(node))
+  {
+    memcpy(row, leaf_node_value(node, cell_num), *leaf_node_value_size(node));
+    return;
+  }
+  uint32_t offset = 0;
+  for (uint32_t i = 0; i < *leaf_node_pax_num_columns(node); i++)
+  {
+    uint32_t width = *leaf_node_pax_width(node, i);
+    memcpy((uint8_t*)row + offset, leaf_node_pax_minipage(node, offset) + cell_num * width, width);
+    offset += width;
+  }
+}
+
+/* Sets a cell to a serialized row, whose id is key; PAX leaves take the key from the id column */
+void
+leaf_node_write_row(
+  void*       node,
+  uint32_t    cell_num,
+  uint32_t    key,
+  const void* row
+)
+{
+  if (!leaf_node_is_pax(node))
+  {
+    *leaf_node_key(node, cell_num) = key;
+    memcpy(leaf_node_value(node, cell_num), row, *leaf_node_value_size(node));
+    return;
+  }
+  uint32_t offset = 0;
+  for (uint32_t i = 0; i < *leaf_node_pax_num_columns(node); i++)
+  {
+    uint32_t width = *leaf_node_pax_width(node, i);
+    memcpy(leaf_node_pax_minipage(node, offset) + cell_num * width, (const uint8_t*)row + offset, width);
+    offset += width;
+  }
+}
+
+/* Copies a cell between leaves of one table, or of any two layouts through a serialized row */
+void
+leaf_node_copy_cell(
+  void*     destination,
+  uint32_t  destination_cell,
+  void*     source,
+  uint32_t  source_cell
+)
+{
+  bool destination_pax  = leaf_node_is_pax(destination);
+  bool source_pax       = leaf_node_is_pax(source);
+  if (!destination_pax && !source_pax)
+  {
+    memcpy(leaf_node_cell(destination, destination_cell), leaf_node_cell(source, source_cell),
+           leaf_node_cell_size(source));
+    return;
+  }
+  if (destination_pax && source_pax)
+  {
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < *leaf_node_pax_num_columns(source); i++)
+    {
+      uint32_t width = *leaf_node_pax_width(source, i);
+      memcpy(leaf_node_pax_minipage(destination, offset) + destination_cell * width,
+             leaf_node_pax_minipage(source, offset) + source_cell * width, width);
+      offset += width;
+    }
+    return;
+  }
+  uint8_t row[PAGE_SIZE];
+  leaf_node_read_row(source, source_cell, row);
+  leaf_node_write_row(destination, destination_cell, *leaf_node_key(source, source_cell), row);
 }
 
 void
@@ -167,7 +523,14 @@ initialize_internal_node(
 {
   set_node_type(node, NODE_INTERNAL);
   set_node_root(node, false);
-  *internal_node_num_keys(node) = 0;
+  *internal_node_num_keys(node)   = 0;
+  *internal_node_row_count(node)  = 0;
+  /*
+  Necessary because the root page number is 0; by not initializing an internal
+  node's right child to an invalid page number when initializing the node, we may
+  end up with 0 as the node's right child, which makes the node a parent of the root
+  */
+  *internal_node_right_child(node) = INVALID_PAGE_NUM;
 }
 
 void
@@ -181,7 +544,8 @@ cursor_advance(
   //one page = one node
   void*       node      = get_page(cursor->table->pager, page_num);
   cursor->cell_num     += 1;
-  if(cursor->cell_num >= (*leaf_node_num_cells(node)))
+  // A loop, index leaves emptied by updates are passed over (see index_remove())
+  while(cursor->cell_num >= (*leaf_node_num_cells(node)))
   {
     //cursor->end_of_table = true;
     /* Advance to next leaf node */
@@ -190,11 +554,13 @@ cursor_advance(
     {
       /* This was rightmost leaf */
       cursor->end_of_table = true;
-    } else 
-    {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+      break;
     }
+    // Scans may run over more pages than the cache holds
+    pager_release_pages(cursor->table->pager);
+    cursor->page_num = next_page_num;
+    cursor->cell_num = 0;
+    node             = get_page(cursor->table->pager, next_page_num);
   }
 }
 
@@ -279,6 +645,7 @@ leaf_node_find(
   void*     node      = get_page(table->pager, page_num);
   uint32_t  num_cells = *leaf_node_num_cells(node);
   cursor_t* cursor    = malloc(sizeof(cursor_t));
+  table->pager->stats.cursors_allocated += 1;
 
   cursor->table       = table;
   cursor->page_num    = page_num;
@@ -361,6 +728,10 @@ internal_node_find(
       return leaf_node_find(table, child_num, key);
     case NODE_INTERNAL:
       return internal_node_find(table, child_num, key);
+    default:
+      // Overflow pages hang off leaf cells, never off internal nodes
+      printf("Page %u is not a tree node. Corrupt file.\n", child_num);
+      exit(EXIT_FAILURE);
   }
 }
 
@@ -385,764 +756,7591 @@ table_find(
   }
 }
 
-void 
-pager_flush(
-  pager_t* pager, 
-  uint32_t page_num
+uint64_t
+monotonic_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+ * CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has it
+ * and a table driven loop otherwise. crc32c() picks one on first use.
+ */
+uint32_t        crc32c_table[256];
+pthread_once_t  crc32c_once = PTHREAD_ONCE_INIT;
+uint32_t        (*crc32c_update)(uint32_t crc, const uint8_t* data, size_t length);
+
+uint32_t
+crc32c_software(
+  uint32_t        crc,
+  const uint8_t*  data,
+  size_t          length
 )
 {
-  if (pager->pages[page_num] == NULL) 
+  for (size_t i = 0; i < length; i++)
   {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+    crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
   }
+  return crc;
+}
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t
+crc32c_sse42(
+  uint32_t        crc,
+  const uint8_t*  data,
+  size_t          length
+)
+{
+  uint64_t value = crc;
+  for (; length >= sizeof(uint64_t); data += sizeof(uint64_t), length -= sizeof(uint64_t))
+  {
+    uint64_t word;
+    memcpy(&word, data, sizeof(uint64_t));
+    value = _mm_crc32_u64(value, word);
   }
-
-  ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-
-  if (bytes_written == -1) 
+  crc = value;
+  for (; length > 0; data++, length--)
   {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+    crc = _mm_crc32_u8(crc, *data);
   }
+  return crc;
 }
+#endif
 
-void 
-db_close(
-  table_t* table
-) 
+void
+crc32c_init()
 {
-  pager_t* pager          = table->pager;
-  //uint32_t num_full_pages = table->num_rows / ROWS_PER_PAGE;
-
-  for (uint32_t i = 0; i < pager->num_pages; i++) 
+  for (uint32_t i = 0; i < 256; i++)
   {
-    if (pager->pages[i] == NULL) 
+    uint32_t crc = i;
+    for (uint32_t bit = 0; bit < 8; bit++)
     {
-      continue;
+      crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
     }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+    crc32c_table[i] = crc;
   }
-
-  // There may be a partial page to write to the end of the file
-  // This should not be needed after we switch to a B-tree
-  // uint32_t num_additional_rows = table->num_rows % ROWS_PER_PAGE;
-  // if (num_additional_rows > 0) 
-  // {
-  //   uint32_t page_num = num_full_pages;
-  //   if (pager->pages[page_num] != NULL) 
-  //   {
-  //     pager_flush(pager, page_num, num_additional_rows * ROW_SIZE);
-  //     free(pager->pages[page_num]);
-  //     pager->pages[page_num] = NULL;
-  //   }
-  // }
-
-  int result = close(pager->file_descriptor);
-  if (result == -1) 
+  crc32c_update = crc32c_software;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
   {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+    crc32c_update = crc32c_sse42;
   }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) 
+#endif
+}
+
+uint32_t
+crc32c(
+  const void* data,
+  size_t      length
+)
+{
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_update(~0u, data, length);
+}
+
+/* Checksum of a page as stored in its trailer */
+uint32_t
+page_checksum(
+  const void* page
+)
+{
+  return crc32c(page, PAGE_CHECKSUM_OFFSET);
+}
+
+bool
+page_checksum_valid(
+  const void* page
+)
+{
+  uint32_t stored;
+  memcpy(&stored, (const uint8_t*)page + PAGE_CHECKSUM_OFFSET, PAGE_CHECKSUM_SIZE);
+  return stored == page_checksum(page);
+}
+
+/*
+ * Page compression, the LZ4 block format: sequences of a token holding the
+ * literal and match lengths, the literals, a 2-byte match offset and the rest of
+ * a long length in 255s. The last sequence has literals only. Rows are padded to
+ * their column sizes with zeros, so leaves mostly compress into a sector or two.
+ */
+const uint32_t COMPRESS_HASH_BITS               = 12;
+const uint32_t COMPRESS_MIN_MATCH               = 4;
+/* Released sectors are reused after a new map, written once they are 4 times the map or this many */
+const uint32_t PAGE_MAP_CHECKPOINT_SECTORS      = 256;
+
+uint32_t
+compress_put_length(
+  uint8_t*  destination,
+  uint32_t  out,
+  uint32_t  length
+)
+{
+  while (length >= 255)
   {
-    void* page = pager->pages[i];
-    if (page) 
-    {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+    destination[out++]  = 255;
+    length             -= 255;
   }
-  free(pager);
-  free(table);
+  destination[out++] = length;
+  return out;
 }
 
-void*
-get_page(
-  pager_t*    pager,
-  uint32_t    page_num
+/* Writes one sequence, returns the new output length or 0 if it would not fit in capacity */
+uint32_t
+compress_put_sequence(
+  uint8_t*        destination,
+  uint32_t        out,
+  uint32_t        capacity,
+  const uint8_t*  literals,
+  uint32_t        num_literals,
+  uint32_t        offset,
+  uint32_t        match_length
 )
 {
-  if(page_num > TABLE_MAX_PAGES)
+  uint32_t extra = match_length ? match_length - COMPRESS_MIN_MATCH : 0;
+  if ((uint64_t)out + 1 + num_literals / 255 + 1 + num_literals + 2 + extra / 255 + 1 > capacity)
   {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
+    return 0;
   }
-  if(pager->pages[page_num] == NULL)
+  uint32_t token      = out++;
+  destination[token]  = (num_literals < 15 ? num_literals : 15) << 4;
+  if (num_literals >= 15)
   {
-    // Cache miss. Allocate memory and load from file.
-    void*     page      = malloc(PAGE_SIZE);
-    uint32_t  num_pages = pager->file_length / PAGE_SIZE;
-    // We might save a partial page at the end of the file
-    if (pager->file_length % PAGE_SIZE) 
+    out = compress_put_length(destination, out, num_literals - 15);
+  }
+  memcpy(destination + out, literals, num_literals);
+  out += num_literals;
+  if (match_length == 0)
+  {
+    return out;
+  }
+  destination[token]   |= extra < 15 ? extra : 15;
+  destination[out++]    = offset & 0xFF;
+  destination[out++]    = offset >> 8;
+  if (extra >= 15)
+  {
+    out = compress_put_length(destination, out, extra - 15);
+  }
+  return out;
+}
+
+/* Compresses a page into at most capacity bytes, returns the compressed length or 0 if it does not fit */
+uint32_t
+page_compress(
+  const uint8_t*  source,
+  uint8_t*        destination,
+  uint32_t        capacity
+)
+{
+  uint16_t  positions[1 << COMPRESS_HASH_BITS];
+  uint32_t  anchor    = 0;
+  uint32_t  position  = 0;
+  uint32_t  out       = 0;
+  memset(positions, 0, sizeof(positions));
+
+  while (position + COMPRESS_MIN_MATCH <= PAGE_SIZE)
+  {
+    uint32_t sequence;
+    memcpy(&sequence, source + position, sizeof(uint32_t));
+    uint32_t hash       = (sequence * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+    uint32_t candidate  = positions[hash];
+    positions[hash]     = position;
+    if (candidate >= position || memcmp(source + candidate, source + position, COMPRESS_MIN_MATCH) != 0)
     {
-      num_pages += 1;
+      position += 1;
+      continue;
     }
 
-    if (page_num <= num_pages) 
+    uint32_t length = COMPRESS_MIN_MATCH;
+    while (position + length < PAGE_SIZE && source[candidate + length] == source[position + length])
     {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) 
-      {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
+      length += 1;
     }
-
-    pager->pages[page_num] = page;
-
-    if(page_num >= pager->num_pages)
+    out = compress_put_sequence(destination, out, capacity, source + anchor, position - anchor,
+                                position - candidate, length);
+    if (out == 0)
     {
-      pager->num_pages = page_num + 1;
+      return 0;
     }
+    position += length;
+    anchor    = position;
   }
-  return pager->pages[page_num];
+  return compress_put_sequence(destination, out, capacity, source + anchor, PAGE_SIZE - anchor, 0, 0);
 }
 
-void* 
-cursor_value(
-  cursor_t*   cursor
-) 
+bool
+compress_get_length(
+  const uint8_t*  source,
+  uint32_t        length,
+  uint32_t*       in,
+  uint32_t*       value
+)
 {
-  // uint32_t row_num      = cursor->row_num;
-  // uint32_t page_num     = row_num / ROWS_PER_PAGE;
-  uint32_t page_num     = cursor->page_num;
-  void*    page         = get_page(cursor->table->pager, page_num);
-  // uint32_t row_offset   = row_num % ROWS_PER_PAGE;
-  // uint32_t byte_offset  = row_offset * ROW_SIZE;
-  // return page + byte_offset;
-  return    leaf_node_value(page, cursor->cell_num);
-}
-
-void 
-serialize_row(
-  row_t*  source, 
-  void*   destination
-) 
-{
-  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  // memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-  // memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
-  /*
-  If we wanted to ensure that all bytes are initialized, 
-  it would suffice to use strncpy instead of memcpy
-   while copying the username and email fields of rows 
-   in serialize_row
-  */
-  strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-  strncpy(destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+  uint8_t byte;
+  do
+  {
+    if (*in >= length)
+    {
+      return false;
+    }
+    byte    = source[(*in)++];
+    *value += byte;
+  } while (byte == 255);
+  return true;
 }
 
-void 
-deserialize_row(
-   void*  source,
-   row_t* destination
-) 
+/* Expands length compressed bytes into a page, false if they are malformed or not exactly a page */
+bool
+page_decompress(
+  const uint8_t*  source,
+  uint32_t        length,
+  uint8_t*        destination
+)
 {
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
-}
-
-input_buffer_t* 
-new_input_buffer()
- {
-  input_buffer_t* input_buffer = malloc(sizeof(input_buffer_t));
-  input_buffer->buffer          = NULL;
-  input_buffer->buffer_length   = 0;
-  input_buffer->input_length    = 0;
+  uint32_t in   = 0;
+  uint32_t out  = 0;
+  while (in < length)
+  {
+    uint8_t   token         = source[in++];
+    uint32_t  num_literals  = token >> 4;
+    if (num_literals == 15 && !compress_get_length(source, length, &in, &num_literals))
+    {
+      return false;
+    }
+    if (num_literals > length - in || num_literals > PAGE_SIZE - out)
+    {
+      return false;
+    }
+    memcpy(destination + out, source + in, num_literals);
+    in  += num_literals;
+    out += num_literals;
+    if (in == length)
+    {
+      break;
+    }
 
-  return input_buffer;
+    uint32_t match_length = (token & 15) + COMPRESS_MIN_MATCH;
+    if (length - in < 2)
+    {
+      return false;
+    }
+    uint32_t offset = source[in] | (source[in + 1] << 8);
+    in += 2;
+    if ((token & 15) == 15 && !compress_get_length(source, length, &in, &match_length))
+    {
+      return false;
+    }
+    if (offset == 0 || offset > out || match_length > PAGE_SIZE - out)
+    {
+      return false;
+    }
+    // Matches may overlap their own output, runs of zeros have offset 1
+    if (offset >= match_length)
+    {
+      memcpy(destination + out, destination + out - offset, match_length);
+    }
+    else if (offset == 1)
+    {
+      memset(destination + out, destination[out - 1], match_length);
+    }
+    else
+    {
+      for (uint32_t i = 0; i < match_length; i++)
+      {
+        destination[out + i] = destination[out + i - offset];
+      }
+    }
+    out += match_length;
+  }
+  return out == PAGE_SIZE;
 }
 
-void 
-print_prompt() 
-{ 
-    printf("db > "); 
+/* Byte offset of a page in the file; page_num * PAGE_SIZE in 32 bits wraps at 4 GB */
+off_t
+pager_page_offset(
+  uint32_t  page_num
+)
+{
+  return (off_t)page_num * PAGE_SIZE;
 }
 
-void 
-read_input(
-    input_buffer_t* input_buffer
+void
+sector_list_push(
+  sector_list_t*  list,
+  uint64_t        value
 )
- {
-  /*
-    ssize_t getline(char **lineptr, size_t *n, FILE *stream);
-  */
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-
-  if (bytes_read <= 0) 
+{
+  if (list->count == list->capacity)
   {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+    list->capacity  = list->capacity ? 2 * list->capacity : 64;
+    list->sectors   = realloc(list->sectors, list->capacity * sizeof(uint64_t));
   }
-
-  // Ignore trailing newline
-  input_buffer->input_length            = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1]  = 0;
+  list->sectors[list->count++] = value;
 }
 
-void 
-close_input_buffer(
-    input_buffer_t* input_buffer
-) 
+uint64_t
+page_map_sectors(
+  uint64_t  bytes
+)
 {
-    free(input_buffer->buffer);
-    free(input_buffer);
+  return (bytes + PAGE_MAP_SECTOR_SIZE - 1) / PAGE_MAP_SECTOR_SIZE;
 }
 
-void 
-print_constants()
+/* Page 0 is the catalog, stored uncompressed in the first sectors of every file */
+page_map_t*
+page_map_new(
+  void
+)
 {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+  page_map_t* map = calloc(1, sizeof(page_map_t));
+  map->entries[CATALOG_PAGE_NUM]  = PAGE_SIZE;
+  map->end_sector                 = page_map_sectors(PAGE_SIZE);
+  return map;
 }
 
-// void 
-// print_leaf_node(
-//   void* node
-// ) 
-// {
-//   uint32_t num_cells = *leaf_node_num_cells(node);
-//   printf("leaf (size %d)\n", num_cells);
-//   for (uint32_t i = 0; i < num_cells; i++) 
-//   {
-//     uint32_t key = *leaf_node_key(node, i);
-//     printf("  - %d : %d\n", i, key);
-//   }
-// }
+void
+page_map_destroy(
+  page_map_t* map
+)
+{
+  if (map == NULL)
+  {
+    return;
+  }
+  for (uint32_t i = 0; i <= PAGE_MAP_SIZE_CLASSES; i++)
+  {
+    free(map->free[i].sectors);
+  }
+  free(map->pending.sectors);
+  free(map);
+}
 
-void 
-indent(
-  uint32_t level
-) 
+/* Free sectors go into the lists in runs of at most PAGE_MAP_SIZE_CLASSES */
+void
+page_map_free(
+  page_map_t* map,
+  uint64_t    sector,
+  uint64_t    count
+)
 {
-  for (uint32_t i = 0; i < level; i++) 
+  while (count > 0)
   {
-    printf("  ");
+    uint64_t run = count < PAGE_MAP_SIZE_CLASSES ? count : PAGE_MAP_SIZE_CLASSES;
+    sector_list_push(&(map->free[run]), sector);
+    sector += run;
+    count  -= run;
   }
 }
 
-void 
-print_tree(
-  pager_t* pager, 
-  uint32_t page_num, 
-  uint32_t indentation_level
-) 
+/* Sectors of a rewritten page, still referenced by the map on disk until the next one */
+void
+page_map_release(
+  page_map_t* map,
+  uint64_t    entry
+)
 {
-  void* node = get_page(pager, page_num);
-  uint32_t num_keys;
-  uint32_t child;
+  sector_list_push(&(map->pending), (entry >> 16) << 4 | page_map_sectors(entry & 0xFFFF));
+  map->pending_sectors += page_map_sectors(entry & 0xFFFF);
+}
 
-  switch (get_node_type(node)) 
+/* A free run of exactly count sectors, else the tail of a longer one, else the end of the file */
+uint64_t
+page_map_allocate(
+  page_map_t* map,
+  uint32_t    count
+)
+{
+  for (uint32_t run = count; run <= PAGE_MAP_SIZE_CLASSES; run++)
   {
-    case (NODE_LEAF):
-      num_keys = *leaf_node_num_cells(node);
-      indent(indentation_level);
-      printf("- leaf (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) 
-      {
-        indent(indentation_level + 1);
-        printf("- %d\n", *leaf_node_key(node, i));
-      }
-      break;
-    case (NODE_INTERNAL):
-      num_keys = *internal_node_num_keys(node);
-      indent(indentation_level);
-      printf("- internal (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) 
-      {
-        child = *internal_node_child(node, i);
-        print_tree(pager, child, indentation_level + 1);
-
-        indent(indentation_level + 1);
-        printf("- key %d\n", *internal_node_key(node, i));
-      }
-      child = *internal_node_right_child(node);
-      print_tree(pager, child, indentation_level + 1);
-      break;
+    sector_list_t* list = &(map->free[run]);
+    if (list->count > 0)
+    {
+      uint64_t sector = list->sectors[--list->count];
+      page_map_free(map, sector + count, run - count);
+      return sector;
+    }
   }
+  uint64_t sector   = map->end_sector;
+  map->end_sector  += count;
+  return sector;
 }
 
-meta_command_result_e 
-do_meta_command(
-  input_buffer_t* input_buffer,
-  table_t*        table
-) 
+/*
+ Writes the map of every page flushed so far and points the catalog page at it.
+ The caller writes the catalog page right after, then calls page_map_commit().
+*/
+void
+page_map_save(
+  pager_t*  pager,
+  void*     catalog
+)
 {
-  if (strcmp(input_buffer->buffer, ".exit") == 0) 
-  {
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  } 
-  else if(strcmp(input_buffer->buffer, ".btree") == 0)
+  page_map_t* map     = pager->page_map;
+  uint32_t    entries = pager->num_pages;
+  uint64_t    bytes   = (uint64_t)entries * sizeof(uint64_t);
+  uint64_t    sectors = page_map_sectors(bytes);
+  uint64_t    sector;
+
+  // Two maps alternate: the one on disk must survive until the catalog points elsewhere
+  if (map->spare_sectors >= sectors)
   {
-     printf("Tree:\n");
-//     print_leaf_node(get_page(table->pager, 0));
-     print_tree(table->pager, 0, 0);
-     return META_COMMAND_SUCCESS;
+    sector  = map->spare_sector;
+    sectors = map->spare_sectors;
   }
-  else if(strcmp(input_buffer->buffer , ".constants") == 0)
+  else
   {
-    printf("Constants:\n");
-    print_constants();
-    return META_COMMAND_SUCCESS;
+    page_map_free(map, map->spare_sector, map->spare_sectors);
+    sector            = map->end_sector;
+    map->end_sector  += sectors;
   }
-  else 
+  if (pwrite(pager->file_descriptor, map->entries, bytes, (off_t)sector * PAGE_MAP_SECTOR_SIZE) != (ssize_t)bytes)
   {
-    return META_COMMAND_UNRECONGNIZED_COMMAND;
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
   }
+  pager->stats.bytes_written += bytes;
+
+  uint32_t checksum = crc32c(map->entries, bytes);
+  memcpy((uint8_t*)catalog + CATALOG_PAGE_MAP_SECTOR_OFFSET, &sector, sizeof(uint64_t));
+  memcpy((uint8_t*)catalog + CATALOG_PAGE_MAP_ENTRIES_OFFSET, &entries, sizeof(uint32_t));
+  memcpy((uint8_t*)catalog + CATALOG_PAGE_MAP_CHECKSUM_OFFSET, &checksum, sizeof(uint32_t));
+  map->spare_sector   = map->map_sector;
+  map->spare_sectors  = map->map_sectors;
+  map->map_sector     = sector;
+  map->map_sectors    = sectors;
 }
 
-prepare_result_e 
-prepare_insert(
-  input_buffer_t* input_buffer, 
-  statement_t*    statement
-) 
+/* The catalog on disk references the new map, sectors released before it can be reused */
+void
+page_map_commit(
+  page_map_t* map
+)
 {
-  statement->type = STATEMENT_INSERT;
+  for (uint32_t i = 0; i < map->pending.count; i++)
+  {
+    page_map_free(map, map->pending.sectors[i] >> 4, map->pending.sectors[i] & 15);
+  }
+  map->pending.count    = 0;
+  map->pending_sectors  = 0;
+}
 
-  char* keyword   = strtok(input_buffer->buffer, " ");
-  char* id_string = strtok(NULL, " ");
-  char* username  = strtok(NULL, " ");
-  char* email     = strtok(NULL, " ");
+typedef struct sector_run_struct
+{
+  uint64_t  sector;
+  uint64_t  count;
+} sector_run_t;
+
+int
+page_map_compare_runs(
+  const void* a,
+  const void* b
+)
+{
+  uint64_t a_sector = ((const sector_run_t*)a)->sector;
+  uint64_t b_sector = ((const sector_run_t*)b)->sector;
+  return (a_sector > b_sector) - (a_sector < b_sector);
+}
 
-  if (id_string == NULL || username == NULL || email == NULL) 
+/* Reads the page map named by the catalog, NULL for plain files; free space is what no page or map uses */
+page_map_t*
+page_map_load(
+  int         fd,
+  const void* catalog,
+  uint32_t*   num_pages
+)
+{
+  uint64_t  sector;
+  uint32_t  entries;
+  uint32_t  checksum;
+  memcpy(&sector, (const uint8_t*)catalog + CATALOG_PAGE_MAP_SECTOR_OFFSET, sizeof(uint64_t));
+  memcpy(&entries, (const uint8_t*)catalog + CATALOG_PAGE_MAP_ENTRIES_OFFSET, sizeof(uint32_t));
+  memcpy(&checksum, (const uint8_t*)catalog + CATALOG_PAGE_MAP_CHECKSUM_OFFSET, sizeof(uint32_t));
+  if (entries == 0)
   {
-    return PREPARE_SYNTAX_ERROR;
+    return NULL;
+  }
+  if (entries > TABLE_MAX_PAGES)
+  {
+    printf("Db file has more pages than TABLE_MAX_PAGES (%u), rebuild with a larger limit.\n", TABLE_MAX_PAGES);
+    exit(EXIT_FAILURE);
   }
 
-  int id = atoi(id_string);
-  if(id < 0)
+  page_map_t* map   = page_map_new();
+  uint64_t    bytes = (uint64_t)entries * sizeof(uint64_t);
+  if (pread(fd, map->entries, bytes, (off_t)sector * PAGE_MAP_SECTOR_SIZE) != (ssize_t)bytes ||
+      crc32c(map->entries, bytes) != checksum)
   {
-    return PREPARE_NEGATIVE_ID;
+    printf("Db file page map failed its checksum. Corrupt file.\n");
+    exit(EXIT_FAILURE);
   }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  map->map_sector   = sector;
+  map->map_sectors  = page_map_sectors(bytes);
+
+  // Sectors of every page and of the map itself, in file order; the gaps between them are free
+  sector_run_t* runs      = malloc((entries + 1) * sizeof(sector_run_t));
+  uint32_t      num_runs  = 0;
+  for (uint32_t i = 0; i < entries; i++)
+  {
+    if (map->entries[i] != 0)
+    {
+      runs[num_runs].sector = map->entries[i] >> 16;
+      runs[num_runs].count  = page_map_sectors(map->entries[i] & 0xFFFF);
+      num_runs += 1;
+    }
   }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) 
+  runs[num_runs].sector = map->map_sector;
+  runs[num_runs].count  = map->map_sectors;
+  num_runs += 1;
+  qsort(runs, num_runs, sizeof(sector_run_t), page_map_compare_runs);
+  uint64_t end = 0;
+  for (uint32_t i = 0; i < num_runs; i++)
   {
-    return PREPARE_STRING_TOO_LONG;
+    if (runs[i].sector < end)
+    {
+      printf("Db file page map has overlapping pages. Corrupt file.\n");
+      exit(EXIT_FAILURE);
+    }
+    page_map_free(map, end, runs[i].sector - end);
+    end = runs[i].sector + runs[i].count;
   }
-
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
-
-  return PREPARE_SUCCESS;
+  map->end_sector = end;
+  *num_pages      = entries;
+  free(runs);
+  return map;
 }
 
-
-prepare_result_e 
-prepare_statement(
-  input_buffer_t*   input_buffer,
-  statement_t*      statement
-) 
+/* Where a page is stored and in how many bytes, 0 bytes for a page not written yet */
+off_t
+pager_stored_offset(
+  pager_t*  pager,
+  uint32_t  page_num
+)
 {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) 
+  if (pager->page_map == NULL)
   {
-    return prepare_insert(input_buffer, statement);
-  }
-  if (strcmp(input_buffer->buffer, "select") == 0)
-   {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+    return pager_page_offset(page_num);
   }
+  return (off_t)(pager->page_map->entries[page_num] >> 16) * PAGE_MAP_SECTOR_SIZE;
+}
 
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+uint32_t
+pager_stored_length(
+  pager_t*  pager,
+  uint32_t  page_num
+)
+{
+  return pager->page_map ? pager->page_map->entries[page_num] & 0xFFFF : PAGE_SIZE;
+}
+
+/* Bytes the file uses */
+uint64_t
+pager_file_bytes(
+  pager_t*  pager
+)
+{
+  if (pager->page_map == NULL)
+  {
+    return (uint64_t)pager->num_pages * PAGE_SIZE;
+  }
+  return pager->page_map->end_sector * PAGE_MAP_SECTOR_SIZE;
 }
 
 /*
-Until we start recycling free pages, new pages will always
-go onto the end of the database file
+ Reads a page as stored, expanding compressed ones. Returns the bytes read like
+ pread(), less than PAGE_SIZE for pages not written yet. A compressed page that
+ cannot be expanded comes back as zeros, for the checksum to report. Only reads
+ the pager, so .check calls it from several threads.
 */
-uint32_t
-get_unused_page_num(
+ssize_t
+pager_read_page(
+  pager_t*  pager,
+  uint32_t  page_num,
+  void*     page
+)
+{
+  uint32_t  length = pager_stored_length(pager, page_num);
+  off_t     offset = pager_stored_offset(pager, page_num);
+  if (length == PAGE_SIZE)
+  {
+    return pread(pager->file_descriptor, page, PAGE_SIZE, offset);
+  }
+  if (length == 0)
+  {
+    return 0;
+  }
+
+  uint8_t buffer[PAGE_SIZE];
+  ssize_t bytes_read = pread(pager->file_descriptor, buffer, length, offset);
+  if (bytes_read == -1)
+  {
+    return -1;
+  }
+  if (bytes_read != length || !page_decompress(buffer, length, page))
+  {
+    memset(page, 0, PAGE_SIZE);
+  }
+  return PAGE_SIZE;
+}
+
+/*
+ Compressed files: writes a new map and the catalog page pointing at it, so the sectors
+ of rewritten pages can be reused. A catalog page not in the cache is as it was written.
+*/
+void
+pager_checkpoint(
   pager_t*  pager
 )
 {
-  return pager->num_pages;
+  if (pager->pages[CATALOG_PAGE_NUM] != NULL)
+  {
+    pager_flush(pager, CATALOG_PAGE_NUM);
+    return;
+  }
+  uint8_t catalog[PAGE_SIZE];
+  if (pread(pager->file_descriptor, catalog, PAGE_SIZE, pager_page_offset(CATALOG_PAGE_NUM)) != PAGE_SIZE)
+  {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  page_map_save(pager, catalog);
+  uint32_t checksum = page_checksum(catalog);
+  memcpy(catalog + PAGE_CHECKSUM_OFFSET, &checksum, PAGE_CHECKSUM_SIZE);
+  if (pwrite(pager->file_descriptor, catalog, PAGE_SIZE, pager_page_offset(CATALOG_PAGE_NUM)) != PAGE_SIZE)
+  {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->stats.pages_written += 1;
+  pager->stats.bytes_written += PAGE_SIZE;
+  page_map_commit(pager->page_map);
+}
+
+/* Compressed files: the page goes to new sectors, uncompressed if it does not save one */
+void
+pager_write_compressed(
+  pager_t*    pager,
+  uint32_t    page_num,
+  const void* page
+)
+{
+  page_map_t* map = pager->page_map;
+  uint8_t     buffer[PAGE_SIZE];
+  const void* data    = buffer;
+  uint32_t    length  = page_compress(page, buffer, PAGE_SIZE - PAGE_MAP_SECTOR_SIZE);
+  if (length == 0)
+  {
+    data    = page;
+    length  = PAGE_SIZE;
+  }
+
+  if (map->entries[page_num] != 0)
+  {
+    page_map_release(map, map->entries[page_num]);
+  }
+  uint64_t sector = page_map_allocate(map, page_map_sectors(length));
+  if (pwrite(pager->file_descriptor, data, length, (off_t)sector * PAGE_MAP_SECTOR_SIZE) == -1)
+  {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  map->entries[page_num]      = sector << 16 | length;
+  pager->stats.bytes_written += length;
+
+  uint64_t map_sectors = page_map_sectors((uint64_t)pager->num_pages * sizeof(uint64_t));
+  if (map->pending_sectors >= PAGE_MAP_CHECKPOINT_SECTORS && map->pending_sectors >= 4 * map_sectors)
+  {
+    pager_checkpoint(pager);
+  }
+}
+
+/*
+ Writes a cached page back unless the file already holds it: pages not handed out
+ since, or handed out but byte for byte the same as their clean copy. The checksum
+ only guards against corruption, two pages may share one. Returns whether it wrote.
+*/
+bool
+pager_flush(
+  pager_t* pager, 
+  uint32_t page_num
+)
+{
+  if (pager->pages[page_num] == NULL) 
+  {
+    printf("Tried to flush null page\n");
+    exit(EXIT_FAILURE);
+  }
+  // The catalog page of a compressed file names the map of the pages written before it
+  bool catalog_of_map = pager->page_map != NULL && page_num == CATALOG_PAGE_NUM;
+  if (pager->page_state[page_num] == PAGE_CLEAN && !catalog_of_map)
+  {
+    return false;
+  }
+  if (catalog_of_map)
+  {
+    page_map_save(pager, pager->pages[page_num]);
+  }
+  // Byte for byte the file's page, its trailer included
+  bool unchanged = pager->page_state[page_num] == PAGE_HANDED_OUT && !catalog_of_map &&
+                   memcmp(pager->pages[page_num], pager->clean_copies[page_num], PAGE_SIZE) == 0;
+  // A clean page needs no copy until it is handed out again
+  free(pager->clean_copies[page_num]);
+  pager->clean_copies[page_num] = NULL;
+  if (unchanged)
+  {
+    pager->page_state[page_num]    = PAGE_CLEAN;
+    pager->stats.pages_unchanged  += 1;
+    return false;
+  }
+  // Files from before checksums are written back as they are, until a vacuum converts them
+  if (pager->checksums)
+  {
+    uint32_t checksum = page_checksum(pager->pages[page_num]);
+    memcpy((uint8_t*)pager->pages[page_num] + PAGE_CHECKSUM_OFFSET, &checksum, PAGE_CHECKSUM_SIZE);
+  }
+  pager->page_state[page_num]  = PAGE_CLEAN;
+  pager->stats.pages_written  += 1;
+
+  if (pager->page_map != NULL && !catalog_of_map)
+  {
+    pager_write_compressed(pager, page_num, pager->pages[page_num]);
+    return true;
+  }
+  ssize_t bytes_written = pwrite(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE,
+                                 pager_page_offset(page_num));
+
+  if (bytes_written == -1) 
+  {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->stats.bytes_written += PAGE_SIZE;
+  if (catalog_of_map)
+  {
+    page_map_commit(pager->page_map);
+  }
+  return true;
+}
+
+void 
+db_close(
+  database_t* database
+) 
+{
+  // Stopped first, it may be writing; most pages are already written
+  database_stop_writer(database);
+
+  pager_t* pager          = database->pager;
+  //uint32_t num_full_pages = table->num_rows / ROWS_PER_PAGE;
+
+  // Buffered rows go into the tree before the pages are written
+  database_set_write_buffer(database, 0);
+  pager_flush_all(pager);
+  database_save_warm(database, pager_warm_list(pager));
+
+  // There may be a partial page to write to the end of the file
+  // This should not be needed after we switch to a B-tree
+  // uint32_t num_additional_rows = table->num_rows % ROWS_PER_PAGE;
+  // if (num_additional_rows > 0) 
+  // {
+  //   uint32_t page_num = num_full_pages;
+  //   if (pager->pages[page_num] != NULL) 
+  //   {
+  //     pager_flush(pager, page_num, num_additional_rows * ROW_SIZE);
+  //     free(pager->pages[page_num]);
+  //     pager->pages[page_num] = NULL;
+  //   }
+  // }
+
+  int result = close(pager->file_descriptor);
+  if (result == -1) 
+  {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) 
+  {
+    void* page = pager->pages[i];
+    if (page) 
+    {
+      free(page);
+      pager->pages[i] = NULL;
+    }
+    free(pager->clean_copies[i]);
+    pager->clean_copies[i] = NULL;
+  }
+  page_map_destroy(pager->page_map);
+  free(pager->warm_pages);
+  free(pager);
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    for (uint32_t j = 0; j < TABLE_MAX_COLUMNS; j++)
+    {
+      free(database->tables[i]->overflow_values[j]);
+    }
+    free(database->tables[i]);
+  }
+  pthread_mutex_destroy(&(database->lock));
+  pthread_mutex_destroy(&(database->writer_mutex));
+  pthread_cond_destroy(&(database->writer_wake));
+  free(database->filename);
+  free(database);
+}
+
+/*
+ Warm cache. The pages cached when the file is closed, and after each checkpoint, are
+ listed in <db>.warm, referenced ones first. Opening the file again asks the kernel to
+ read them in file order, and the page writer loads them into free cache slots a batch
+ per wake up, so a restart does not pay a miss for each page of the upper tree levels
+ and hot leaves. The list is a hint only: it is not synced, a failure to write it is
+ ignored, pages the file no longer has are skipped and nothing is evicted to load one.
+*/
+
+int
+compare_page_nums(
+  const void* a,
+  const void* b
+)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
 }
 
+/* The list as written to the file: magic, count, then the cached pages, hottest first */
 uint32_t*
-internal_node_num_keys(
-  void*   node
+pager_warm_list(
+  pager_t*  pager
 )
 {
-  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+  uint32_t* list  = malloc((2 + (size_t)pager->num_cached) * sizeof(uint32_t));
+  uint32_t  count = 0;
+  for (int referenced = 1; referenced >= 0; referenced--)
+  {
+    for (uint32_t i = 0; i < pager->num_pages && count < pager->num_cached; i++)
+    {
+      if (pager->pages[i] != NULL && pager->page_referenced[i] == referenced)
+      {
+        list[2 + count++] = i;
+      }
+    }
+  }
+  list[0] = PAGER_WARM_MAGIC;
+  list[1] = count;
+  return list;
+}
+
+/* Replaces <db>.warm by renaming a complete new list over it, and frees the list */
+void
+database_save_warm(
+  database_t* database,
+  uint32_t*   list
+)
+{
+  char path[PATH_MAX];
+  char temporary[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.warm", database->filename);
+  snprintf(temporary, sizeof(temporary), "%s.warm.tmp", database->filename);
+
+  size_t  length  = (2 + (size_t)list[1]) * sizeof(uint32_t);
+  int     fd      = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd != -1)
+  {
+    bool written = write(fd, list, length) == (ssize_t)length;
+    if (close(fd) == -1 || !written || rename(temporary, path) == -1)
+    {
+      unlink(temporary);
+    }
+  }
+  free(list);
+}
+
+/*
+ Reads <db>.warm for the page writer, keeping as many of the hottest pages as the cache
+ holds, and starts the kernel reading them in file order.
+*/
+void
+database_load_warm(
+  database_t* database
+)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.warm", database->filename);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+  {
+    return;
+  }
+
+  pager_t*  pager = database->pager;
+  uint32_t  header[2];
+  if (read(fd, header, sizeof(header)) == sizeof(header) && header[0] == PAGER_WARM_MAGIC)
+  {
+    uint32_t  count   = header[1] < pager->cache_capacity ? header[1] : pager->cache_capacity;
+    uint32_t* pages   = malloc(((size_t)count + 1) * sizeof(uint32_t));
+    ssize_t   length  = read(fd, pages, (size_t)count * sizeof(uint32_t));
+    count             = length > 0 ? length / sizeof(uint32_t) : 0;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      if (pages[i] < pager->num_pages)
+      {
+        pages[kept++] = pages[i];
+      }
+    }
+    qsort(pages, kept, sizeof(uint32_t), compare_page_nums);
+    for (uint32_t i = 0; i < kept; i++)
+    {
+      pager_read_ahead(pager, pages[i]);
+    }
+    pager->warm_pages     = pages;
+    pager->num_warm_pages = kept;
+    pager->next_warm_page = 0;
+  }
+  close(fd);
+}
+
+/* Loads up to max_pages listed pages into free cache slots. Returns false once the list is done. */
+bool
+pager_load_warm(
+  pager_t*  pager,
+  uint32_t  max_pages
+)
+{
+  uint32_t loaded = 0;
+  while (pager->next_warm_page < pager->num_warm_pages && loaded < max_pages &&
+         pager->num_cached < pager->cache_capacity)
+  {
+    uint32_t page_num = pager->warm_pages[pager->next_warm_page++];
+    if (page_num >= pager->num_pages || pager->pages[page_num] != NULL)
+    {
+      continue;
+    }
+    // Pages not written yet stay out, and a corrupt one is left for get_page() to report
+    void* page = malloc(PAGE_SIZE);
+    if (pager_read_page(pager, page_num, page) != PAGE_SIZE ||
+        (pager->checksums && !page_checksum_valid(page)))
+    {
+      free(page);
+      continue;
+    }
+    pager->pages[page_num]            = page;
+    pager->page_state[page_num]       = PAGE_CLEAN;
+    pager->page_referenced[page_num]  = 1;
+    pager->num_cached                += 1;
+    pager->stats.pages_read          += 1;
+    pager->stats.bytes_read          += pager_stored_length(pager, page_num);
+    loaded                           += 1;
+  }
+  pager->stats.warm_pages_loaded += loaded;
+  if (pager->next_warm_page < pager->num_warm_pages && pager->num_cached < pager->cache_capacity)
+  {
+    return true;
+  }
+  free(pager->warm_pages);
+  pager->warm_pages     = NULL;
+  pager->num_warm_pages = 0;
+  pager->next_warm_page = 0;
+  return false;
+}
+
+/*
+ Background page writer. Between inputs it writes the dirty pages the clock reaches
+ without a reference, PAGER_WRITER_BATCH_PAGES at a time, so that misses mostly find
+ clean victims and evictions do not wait for writes. Every PAGER_CHECKPOINT_INTERVAL_MS
+ a checkpoint starts: a sweep writes every dirty page, hot ones too, a batch per wake
+ up, then the catalog, and syncs the file outside the lock. The file is never much
+ older than that and closing has little left to write. Rows in a write buffer are not
+ in pages yet and are not covered until it drains. Until the warm list is loaded it
+ wakes up again right away, and a checkpoint that saw misses rewrites the list.
+*/
+
+/*
+ Writes up to max_pages dirty pages from *hand on, unreferenced ones only when cold_only.
+ A compressed file's catalog carries the page map and is left to the end of a checkpoint.
+ Returns true once the sweep has passed the last page.
+*/
+bool
+pager_write_pages(
+  pager_t*  pager,
+  uint32_t* hand,
+  uint32_t  max_pages,
+  bool      cold_only
+)
+{
+  uint32_t written = 0;
+  while (*hand < pager->num_pages && written < max_pages)
+  {
+    uint32_t page_num = (*hand)++;
+    if (pager->pages[page_num] == NULL || pager->page_state[page_num] == PAGE_CLEAN ||
+        (cold_only && pager->page_referenced[page_num]) ||
+        (pager->page_map != NULL && page_num == CATALOG_PAGE_NUM))
+    {
+      continue;
+    }
+    written += pager_flush(pager, page_num);
+  }
+  pager->stats.writer_pages_written += written;
+  return *hand >= pager->num_pages;
+}
+
+void*
+database_writer(
+  void* argument
+)
+{
+  database_t* database        = argument;
+  uint64_t    last_checkpoint = monotonic_ns();
+  bool        checkpointing   = false;
+  uint32_t    checkpoint_hand = 0;
+  bool        warming         = true;
+
+  pthread_mutex_lock(&(database->lock));
+  uint64_t    synced_writes   = database->pager->stats.pages_written;
+  uint64_t    saved_misses    = database->pager->stats.cache_misses;
+  pthread_mutex_unlock(&(database->lock));
+
+  pthread_mutex_lock(&(database->writer_mutex));
+  while (!(database->writer_stopping))
+  {
+    if (!warming)
+    {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += PAGER_WRITER_INTERVAL_MS * 1000000L;
+      deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&(database->writer_wake), &(database->writer_mutex), &deadline);
+      if (database->writer_stopping)
+      {
+        break;
+      }
+    }
+    pthread_mutex_unlock(&(database->writer_mutex));
+
+    int       sync_fd   = -1;
+    uint32_t* warm_list = NULL;
+    pthread_mutex_lock(&(database->lock));
+    pager_t* pager = database->pager;
+    if (warming)
+    {
+      warming = pager_load_warm(pager, PAGER_WARM_BATCH_PAGES);
+    }
+    if (!checkpointing && monotonic_ns() - last_checkpoint >= PAGER_CHECKPOINT_INTERVAL_MS * 1000000ull)
+    {
+      checkpointing   = true;
+      checkpoint_hand = 0;
+    }
+    if (!checkpointing)
+    {
+      if (pager_write_pages(pager, &(pager->writer_hand), PAGER_WRITER_BATCH_PAGES, true))
+      {
+        pager->writer_hand = 0;
+      }
+    }
+    else if (pager_write_pages(pager, &checkpoint_hand, PAGER_WRITER_BATCH_PAGES, false))
+    {
+      // Evictions write too, their pages need the sync as well
+      if (pager->stats.pages_written != synced_writes)
+      {
+        pager_flush_catalog(pager);
+        sync_fd = dup(pager->file_descriptor);
+        pager->stats.checkpoints += 1;
+      }
+      if (!warming && pager->stats.cache_misses != saved_misses)
+      {
+        warm_list     = pager_warm_list(pager);
+        saved_misses  = pager->stats.cache_misses;
+      }
+      synced_writes   = pager->stats.pages_written;
+      checkpointing   = false;
+      last_checkpoint = monotonic_ns();
+    }
+    pthread_mutex_unlock(&(database->lock));
+
+    // A vacuum may replace the file meanwhile, the duplicate keeps the one written open
+    if (sync_fd != -1)
+    {
+      if (fdatasync(sync_fd) == -1)
+      {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      close(sync_fd);
+    }
+    if (warm_list != NULL)
+    {
+      database_save_warm(database, warm_list);
+    }
+    pthread_mutex_lock(&(database->writer_mutex));
+  }
+  pthread_mutex_unlock(&(database->writer_mutex));
+  return NULL;
+}
+
+/* Callers then hold database->lock whenever they use the database */
+void
+database_start_writer(
+  database_t* database
+)
+{
+  if (database->writer_running)
+  {
+    return;
+  }
+  database->writer_stopping = false;
+  database->writer_running  = pthread_create(&(database->writer), NULL, database_writer, database) == 0;
+}
+
+/* Called without database->lock, the writer may be waiting for it */
+void
+database_stop_writer(
+  database_t* database
+)
+{
+  if (!(database->writer_running))
+  {
+    return;
+  }
+  pthread_mutex_lock(&(database->writer_mutex));
+  database->writer_stopping = true;
+  pthread_cond_signal(&(database->writer_wake));
+  pthread_mutex_unlock(&(database->writer_mutex));
+  pthread_join(database->writer, NULL);
+  database->writer_running  = false;
+}
+
+/*
+ Clock sweep over the cached pages. A page gets a second chance when it was
+ referenced since the last sweep, and is skipped entirely while in use by the
+ current operation. A victim the page writer has not cleaned yet is only taken
+ when no clean one follows within PAGER_CLEAN_SEARCH_PAGES, so that a miss
+ rarely waits for a write. Returns INVALID_PAGE_NUM when every cached page is in use.
+*/
+uint32_t
+pager_find_victim(
+  pager_t*  pager
+)
+{
+  uint32_t dirty  = INVALID_PAGE_NUM;
+  uint32_t search = 0;
+  for (uint64_t step = 0; step < 2 * (uint64_t)pager->num_pages; step++)
+  {
+    uint32_t page_num = pager->clock_hand;
+    pager->clock_hand = (pager->clock_hand + 1) % pager->num_pages;
+
+    if (dirty != INVALID_PAGE_NUM && ++search > PAGER_CLEAN_SEARCH_PAGES)
+    {
+      break;
+    }
+    if (pager->pages[page_num] == NULL || pager->page_epoch[page_num] == pager->epoch)
+    {
+      continue;
+    }
+    if (pager->page_referenced[page_num])
+    {
+      // The search for a clean page gives no second chances of its own
+      if (dirty == INVALID_PAGE_NUM)
+      {
+        pager->page_referenced[page_num] = 0;
+      }
+      continue;
+    }
+    if (pager->page_state[page_num] == PAGE_CLEAN)
+    {
+      return page_num;
+    }
+    if (dirty == INVALID_PAGE_NUM)
+    {
+      dirty = page_num;
+    }
+  }
+  if (dirty != INVALID_PAGE_NUM)
+  {
+    pager->clock_hand = (dirty + 1) % pager->num_pages;
+  }
+  return dirty;
+}
+
+/* A page read from a file with checksums must match its trailer, or the file is corrupt */
+void
+pager_verify_page(
+  pager_t*    pager,
+  uint32_t    page_num,
+  const void* page
+)
+{
+  if (pager->checksums && !page_checksum_valid(page))
+  {
+    printf("Page %u failed its checksum. Corrupt file.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Write every cached page the file does not hold yet, they stay cached */
+void
+pager_flush_all(
+  pager_t*  pager
+)
+{
+  for (uint32_t i = 1; i < pager->num_pages; i++)
+  {
+    if (pager->pages[i] != NULL)
+    {
+      pager_flush(pager, i);
+    }
+  }
+  pager_flush_catalog(pager);
+}
+
+/* Last, so that a compressed file's map covers every page written before */
+void
+pager_flush_catalog(
+  pager_t*  pager
+)
+{
+  if (pager->page_map != NULL)
+  {
+    get_page(pager, CATALOG_PAGE_NUM);
+  }
+  if (pager->num_pages > 0 && pager->pages[CATALOG_PAGE_NUM] != NULL)
+  {
+    pager_flush(pager, CATALOG_PAGE_NUM);
+  }
+}
+
+/* Write the page back and hand its buffer to the caller */
+void*
+pager_evict(
+  pager_t*  pager,
+  uint32_t  page_num
+)
+{
+  void* page = pager->pages[page_num];
+  pager->stats.eviction_writes += pager_flush(pager, page_num);
+  pager->pages[page_num]  = NULL;
+  pager->num_cached      -= 1;
+  pager->stats.cache_evictions += 1;
+  return page;
+}
+
+/*
+ Ends the current operation: pages handed out so far become candidates for
+ eviction, so callers must not keep pointers from get_page() across this call.
+*/
+void
+pager_release_pages(
+  pager_t*  pager
+)
+{
+  pager->epoch += 1;
+}
+
+/* Asks the kernel to start reading a page that is not cached yet, without waiting for it */
+void
+pager_read_ahead(
+  pager_t*  pager,
+  uint32_t  page_num
+)
+{
+  if (page_num < pager->num_pages && pager->pages[page_num] == NULL)
+  {
+    posix_fadvise(pager->file_descriptor, pager_stored_offset(pager, page_num),
+                  pager_stored_length(pager, page_num), POSIX_FADV_WILLNEED);
+  }
+}
+
+void*
+get_page(
+  pager_t*    pager,
+  uint32_t    page_num
+)
+{
+  if(page_num >= TABLE_MAX_PAGES)
+  {
+    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
+    exit(EXIT_FAILURE);
+  }
+  if(pager->pages[page_num] == NULL)
+  {
+    // Cache miss. Reuse an evicted buffer if the cache is full, then load from file.
+    void* page = NULL;
+    while (pager->num_cached >= pager->cache_capacity)
+    {
+      uint32_t victim = pager_find_victim(pager);
+      if (victim == INVALID_PAGE_NUM)
+      {
+        break;
+      }
+      free(page);
+      page = pager_evict(pager, victim);
+    }
+    if (page == NULL)
+    {
+      page = malloc(PAGE_SIZE);
+    }
+
+    // Pages past the end were never written, not even by an eviction
+    if (page_num < pager->num_pages) 
+    {
+      ssize_t bytes_read = pager_read_page(pager, page_num, page);
+      if (bytes_read == -1) 
+      {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      if (bytes_read < PAGE_SIZE)
+      {
+        // Allocated past the end of the file in this session and not written yet
+        memset((uint8_t*)page + bytes_read, 0, PAGE_SIZE - bytes_read);
+        pager->page_state[page_num] = PAGE_NEW;
+      }
+      else
+      {
+        pager_verify_page(pager, page_num, page);
+        pager->page_state[page_num] = PAGE_CLEAN;
+      }
+      pager->stats.pages_read += 1;
+      pager->stats.bytes_read += pager_stored_length(pager, page_num);
+    }
+    else
+    {
+      memset(page, 0, PAGE_SIZE);
+      pager->page_state[page_num] = PAGE_NEW;
+    }
+
+    pager->pages[page_num]  = page;
+    pager->num_cached          += 1;
+    pager->stats.cache_misses  += 1;
+
+    if(page_num >= pager->num_pages)
+    {
+      pager->num_pages = page_num + 1;
+    }
+  }
+  else
+  {
+    pager->stats.cache_hits += 1;
+  }
+  // The caller may write through the pointer, a flush compares the page with this copy
+  if (pager->page_state[page_num] == PAGE_CLEAN)
+  {
+    if (pager->clean_copies[page_num] == NULL)
+    {
+      pager->clean_copies[page_num] = malloc(PAGE_SIZE);
+    }
+    memcpy(pager->clean_copies[page_num], pager->pages[page_num], PAGE_SIZE);
+    pager->page_state[page_num] = PAGE_HANDED_OUT;
+  }
+  pager->page_epoch[page_num]       = pager->epoch;
+  pager->page_referenced[page_num]  = 1;
+  return pager->pages[page_num];
+}
+
+/* The serialized row at the cursor, in row leaves only */
+void* 
+cursor_value(
+  cursor_t*   cursor
+) 
+{
+  // uint32_t row_num      = cursor->row_num;
+  // uint32_t page_num     = row_num / ROWS_PER_PAGE;
+  uint32_t page_num     = cursor->page_num;
+  void*    page         = get_page(cursor->table->pager, page_num);
+  // uint32_t row_offset   = row_num % ROWS_PER_PAGE;
+  // uint32_t byte_offset  = row_offset * ROW_SIZE;
+  // return page + byte_offset;
+  return    leaf_node_value(page, cursor->cell_num);
+}
+
+void 
+serialize_row(
+  row_t*  source, 
+  void*   destination
+) 
+{
+  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
+  // memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
+  // memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+  /*
+  If we wanted to ensure that all bytes are initialized, 
+  it would suffice to use strncpy instead of memcpy
+   while copying the username and email fields of rows 
+   in serialize_row
+  */
+  strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
+  strncpy(destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+}
+
+void 
+deserialize_row(
+   void*  source,
+   row_t* destination
+) 
+{
+  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
+  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+}
+
+/* View of a cell of a table leaf in either layout */
+row_view_t
+row_view_at_cell(
+  table_t*    table,
+  void*       node,
+  uint32_t    cell_num
+)
+{
+  row_view_t view;
+  view.data     = leaf_node_is_pax(node) ? NULL : leaf_node_value(node, cell_num);
+  view.schema   = &(table->schema);
+  view.node     = node;
+  view.cell_num = cell_num;
+  view.table    = table;
+  return view;
+}
+
+/* View of a serialized row of the table, from the write buffer or a caller's buffer */
+row_view_t
+row_view_of(
+  table_t*    table,
+  const void* row
+)
+{
+  row_view_t view = { row, &(table->schema), NULL, 0, table };
+  return view;
+}
+
+row_view_t
+row_view_at(
+  cursor_t*   cursor
+)
+{
+  return row_view_at_cell(cursor->table, get_page(cursor->table->pager, cursor->page_num), cursor->cell_num);
+}
+
+/* Where a column of the row starts, in the row itself or in its PAX leaf's minipage */
+const uint8_t*
+row_view_column(
+  row_view_t* view,
+  uint32_t    column
+)
+{
+  column_t* definition = &(view->schema->columns[column]);
+  if (view->data != NULL)
+  {
+    return (const uint8_t*)view->data + definition->offset;
+  }
+  return leaf_node_pax_minipage(view->node, definition->offset) + view->cell_num * definition->size;
+}
+
+/* The primary key is always the first column */
+uint32_t
+row_view_id(
+  row_view_t* view
+)
+{
+  uint32_t id;
+  memcpy(&id, row_view_column(view, 0), sizeof(uint32_t));
+  return id;
+}
+
+uint32_t
+row_view_int(
+  row_view_t* view,
+  uint32_t    column
+)
+{
+  uint32_t value;
+  memcpy(&value, row_view_column(view, column), sizeof(uint32_t));
+  return value;
+}
+
+uint32_t
+overflow_slot_length(
+  const uint8_t*  slot
+)
+{
+  uint32_t length;
+  memcpy(&length, slot + OVERFLOW_SLOT_LENGTH_OFFSET, sizeof(uint32_t));
+  return length;
+}
+
+uint32_t
+overflow_slot_page(
+  const uint8_t*  slot
+)
+{
+  uint32_t page_num;
+  memcpy(&page_num, slot + OVERFLOW_SLOT_PAGE_OFFSET, sizeof(uint32_t));
+  return page_num;
+}
+
+uint32_t*
+overflow_node_next_page(
+  void*   node
+)
+{
+  return node + OVERFLOW_NODE_NEXT_PAGE_OFFSET;
+}
+
+uint32_t*
+overflow_node_length(
+  void*   node
+)
+{
+  return node + OVERFLOW_NODE_LENGTH_OFFSET;
+}
+
+/*
+ Fills an overflow slot with the value, chaining what the prefix cannot hold through the
+ pages of the chain from reuse_page on, then new pages. Pass 0 for a new value; pages an
+ old chain no longer needs are left unreferenced until a vacuum.
+*/
+void
+overflow_store(
+  pager_t*    pager,
+  const char* value,
+  uint32_t    length,
+  uint8_t*    slot,
+  uint32_t    reuse_page
+)
+{
+  uint32_t  first_page  = 0;
+  uint32_t  written     = length < OVERFLOW_SLOT_PREFIX_SIZE ? length : OVERFLOW_SLOT_PREFIX_SIZE;
+  void*     previous    = NULL;
+
+  memset(slot, 0, OVERFLOW_SLOT_SIZE);
+  memcpy(slot + OVERFLOW_SLOT_LENGTH_OFFSET, &length, sizeof(uint32_t));
+  memcpy(slot + OVERFLOW_SLOT_PREFIX_OFFSET, value, written);
+  while (written < length)
+  {
+    uint32_t  page_num  = get_unused_page_num(pager);
+    if (reuse_page != 0 && reuse_page < pager->num_pages && get_node_type(get_page(pager, reuse_page)) == NODE_OVERFLOW)
+    {
+      page_num = reuse_page;
+    }
+    void*     node      = get_page(pager, page_num);
+    uint32_t  chunk     = length - written < OVERFLOW_NODE_SPACE ? length - written : OVERFLOW_NODE_SPACE;
+    reuse_page          = page_num == reuse_page ? *overflow_node_next_page(node) : 0;
+
+    memset(node, 0, PAGE_SIZE);
+    set_node_type(node, NODE_OVERFLOW);
+    *overflow_node_length(node) = chunk;
+    memcpy(node + OVERFLOW_NODE_HEADER_SIZE, value + written, chunk);
+    if (previous == NULL)
+    {
+      first_page = page_num;
+    }
+    else
+    {
+      *overflow_node_next_page(previous) = page_num;
+    }
+    previous  = node;
+    written  += chunk;
+    pager->stats.overflow_pages_written += 1;
+  }
+  memcpy(slot + OVERFLOW_SLOT_PAGE_OFFSET, &first_page, sizeof(uint32_t));
+}
+
+/* Reads the whole value of an overflow slot into buffer as a C string */
+char*
+overflow_load(
+  pager_t*        pager,
+  const uint8_t*  slot,
+  char*           buffer
+)
+{
+  uint32_t  length    = overflow_slot_length(slot);
+  uint32_t  page_num  = overflow_slot_page(slot);
+  uint32_t  read      = length < OVERFLOW_SLOT_PREFIX_SIZE ? length : OVERFLOW_SLOT_PREFIX_SIZE;
+
+  memcpy(buffer, slot + OVERFLOW_SLOT_PREFIX_OFFSET, read);
+  while (read < length)
+  {
+    void* node = page_num == 0 ? NULL : get_page(pager, page_num);
+    if (node == NULL || get_node_type(node) != NODE_OVERFLOW || *overflow_node_length(node) > length - read)
+    {
+      printf("Overflow page %u does not continue the text. Corrupt file.\n", page_num);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(buffer + read, node + OVERFLOW_NODE_HEADER_SIZE, *overflow_node_length(node));
+    read     += *overflow_node_length(node);
+    page_num  = *overflow_node_next_page(node);
+    pager->stats.overflow_pages_read += 1;
+  }
+  buffer[length] = '\0';
+  return buffer;
+}
+
+/*
+ Text columns are stored NUL padded (see serialize_values()),
+ so they can be handed out as C strings without copying. Overflow text
+ shorter than the slot's prefix is too; longer values are read back into
+ the table's buffer for the column, valid until the column is read again.
+*/
+const char*
+row_view_text(
+  row_view_t* view,
+  uint32_t    column
+)
+{
+  const uint8_t*  slot        = row_view_column(view, column);
+  column_t*       definition  = &(view->schema->columns[column]);
+  if (definition->type != COLUMN_TYPE_OVERFLOW_TEXT)
+  {
+    return (const char*)slot;
+  }
+  if (overflow_slot_length(slot) < OVERFLOW_SLOT_PREFIX_SIZE)
+  {
+    return (const char*)slot + OVERFLOW_SLOT_PREFIX_OFFSET;
+  }
+  char** buffer = &(view->table->overflow_values[column]);
+  if (*buffer == NULL)
+  {
+    *buffer = malloc(definition->max_size);
+  }
+  return overflow_load(view->table->pager, slot, *buffer);
+}
+
+input_buffer_t* 
+new_input_buffer()
+ {
+  input_buffer_t* input_buffer = malloc(sizeof(input_buffer_t));
+  input_buffer->buffer          = NULL;
+  input_buffer->buffer_length   = 0;
+  input_buffer->input_length    = 0;
+
+  return input_buffer;
+}
+
+void 
+print_prompt() 
+{ 
+    printf("db > "); 
+}
+
+void 
+read_input(
+    input_buffer_t* input_buffer
+)
+ {
+  /*
+    ssize_t getline(char **lineptr, size_t *n, FILE *stream);
+  */
+  ssize_t bytes_read =
+      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+  if (bytes_read <= 0) 
+  {
+    printf("Error reading input\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Ignore trailing newline
+  input_buffer->input_length            = bytes_read - 1;
+  input_buffer->buffer[bytes_read - 1]  = 0;
+}
+
+void 
+close_input_buffer(
+    input_buffer_t* input_buffer
+) 
+{
+    free(input_buffer->buffer);
+    free(input_buffer);
+}
+
+void 
+print_constants()
+{
+  printf("ROW_SIZE: %d\n", ROW_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+}
+
+// void 
+// print_leaf_node(
+//   void* node
+// ) 
+// {
+//   uint32_t num_cells = *leaf_node_num_cells(node);
+//   printf("leaf (size %d)\n", num_cells);
+//   for (uint32_t i = 0; i < num_cells; i++) 
+//   {
+//     uint32_t key = *leaf_node_key(node, i);
+//     printf("  - %d : %d\n", i, key);
+//   }
+// }
+
+void 
+indent(
+  uint32_t level
+) 
+{
+  for (uint32_t i = 0; i < level; i++) 
+  {
+    printf("  ");
+  }
+}
+
+void 
+print_tree(
+  pager_t* pager, 
+  uint32_t page_num, 
+  uint32_t indentation_level
+) 
+{
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys;
+  uint32_t child;
+
+  switch (get_node_type(node)) 
+  {
+    case (NODE_LEAF):
+      num_keys = *leaf_node_num_cells(node);
+      indent(indentation_level);
+      printf("- leaf (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) 
+      {
+        indent(indentation_level + 1);
+        printf("- %d\n", *leaf_node_key(node, i));
+      }
+      break;
+    case (NODE_INTERNAL):
+      num_keys = *internal_node_num_keys(node);
+      indent(indentation_level);
+      printf("- internal (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) 
+      {
+        child = *internal_node_child(node, i);
+        print_tree(pager, child, indentation_level + 1);
+
+        indent(indentation_level + 1);
+        printf("- key %d\n", *internal_node_key(node, i));
+      }
+      child = *internal_node_right_child(node);
+      print_tree(pager, child, indentation_level + 1);
+      break;
+    case (NODE_OVERFLOW):
+      break;
+  }
+}
+
+void
+db_stats_snapshot(
+  database_t* database,
+  db_stats_t* stats
+)
+{
+  memcpy(stats, &(database->pager->stats), sizeof(db_stats_t));
+}
+
+void
+db_stats_reset(
+  database_t* database
+)
+{
+  memset(&(database->pager->stats), 0, sizeof(db_stats_t));
+}
+
+/* Levels from the root down to the leaves, 1 for a lone root leaf */
+uint32_t
+table_height(
+  table_t*  table
+)
+{
+  uint32_t  height  = 1;
+  void*     node    = get_page(table->pager, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    node    = get_page(table->pager, *internal_node_child(node, 0));
+    height += 1;
+  }
+  return height;
+}
+
+/* Upper bound of the bucket holding the given fraction of the samples */
+uint64_t
+latency_percentile(
+  uint64_t* buckets,
+  uint64_t  count,
+  double    fraction
+)
+{
+  uint64_t target = (uint64_t)(fraction * count + 0.5);
+  uint64_t seen   = 0;
+  for (uint32_t i = 0; i < STATS_LATENCY_BUCKETS; i++)
+  {
+    seen += buckets[i];
+    if (seen >= target && seen > 0)
+    {
+      return 2ull << i;
+    }
+  }
+  return 0;
+}
+
+void
+print_stats(
+  database_t* database
+)
+{
+  static const char* statement_names[STATEMENT_TYPE_COUNT] =
+  {
+    "insert", "select", "create_index", "create_table", "copy_from", "copy_to", "update"
+  };
+  db_stats_t stats;
+  db_stats_snapshot(database, &stats);
+
+  printf("cache_hits: %llu\n", (unsigned long long)stats.cache_hits);
+  printf("cache_misses: %llu\n", (unsigned long long)stats.cache_misses);
+  printf("cache_evictions: %llu\n", (unsigned long long)stats.cache_evictions);
+  printf("pages_read: %llu\n", (unsigned long long)stats.pages_read);
+  printf("pages_written: %llu\n", (unsigned long long)stats.pages_written);
+  printf("bytes_read: %llu\n", (unsigned long long)stats.bytes_read);
+  printf("bytes_written: %llu\n", (unsigned long long)stats.bytes_written);
+  printf("leaf_splits: %llu\n", (unsigned long long)stats.leaf_splits);
+  printf("internal_splits: %llu\n", (unsigned long long)stats.internal_splits);
+  printf("cursors_allocated: %llu\n", (unsigned long long)stats.cursors_allocated);
+  printf("fast_appends: %llu\n", (unsigned long long)stats.fast_appends);
+  printf("buffered_inserts: %llu\n", (unsigned long long)stats.buffered_inserts);
+  printf("rows_updated: %llu\n", (unsigned long long)stats.rows_updated);
+  printf("buffer_flushes: %llu\n", (unsigned long long)stats.buffer_flushes);
+  printf("bloom_skips: %llu\n", (unsigned long long)stats.bloom_skips);
+  printf("bloom_rebuilds: %llu\n", (unsigned long long)stats.bloom_rebuilds);
+  printf("overflow_pages_read: %llu\n", (unsigned long long)stats.overflow_pages_read);
+  printf("overflow_pages_written: %llu\n", (unsigned long long)stats.overflow_pages_written);
+  printf("pages_unchanged: %llu\n", (unsigned long long)stats.pages_unchanged);
+  printf("eviction_writes: %llu\n", (unsigned long long)stats.eviction_writes);
+  printf("writer_pages_written: %llu\n", (unsigned long long)stats.writer_pages_written);
+  printf("checkpoints: %llu\n", (unsigned long long)stats.checkpoints);
+  printf("warm_pages_loaded: %llu\n", (unsigned long long)stats.warm_pages_loaded);
+  printf("rank_seeks: %llu\n", (unsigned long long)stats.rank_seeks);
+  printf("sorts: %llu\n", (unsigned long long)stats.sorts);
+  printf("top_k_sorts: %llu\n", (unsigned long long)stats.top_k_sorts);
+  printf("sort_runs: %llu\n", (unsigned long long)stats.sort_runs);
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    printf("tree_height %s: %d\n", database->tables[i]->name, table_height(database->tables[i]));
+  }
+
+  for (uint32_t type = 0; type < STATEMENT_TYPE_COUNT; type++)
+  {
+    uint64_t count = stats.statements[type];
+    if (count == 0)
+    {
+      continue;
+    }
+    uint64_t* buckets = stats.latency_buckets[type];
+    printf("%s: count %llu, mean_ns %llu, p50_ns < %llu, p99_ns < %llu\n",
+           statement_names[type], (unsigned long long)count,
+           (unsigned long long)(stats.statement_ns[type] / count),
+           (unsigned long long)latency_percentile(buckets, count, 0.50),
+           (unsigned long long)latency_percentile(buckets, count, 0.99));
+    for (uint32_t i = 0; i < STATS_LATENCY_BUCKETS; i++)
+    {
+      if (buckets[i] != 0)
+      {
+        printf("  [%llu, %llu) ns: %llu\n", (unsigned long long)(1ull << i),
+               (unsigned long long)(2ull << i), (unsigned long long)buckets[i]);
+      }
+    }
+  }
+}
+
+meta_command_result_e 
+do_meta_command(
+  input_buffer_t* input_buffer,
+  database_t*     database
+) 
+{
+  if (strcmp(input_buffer->buffer, ".exit") == 0) 
+  {
+    // Held by process_input(), the page writer may be waiting for it before it can stop
+    pthread_mutex_unlock(&(database->lock));
+    db_close(database);
+    exit(EXIT_SUCCESS);
+  } 
+  else if(strcmp(input_buffer->buffer, ".btree") == 0 ||
+          strncmp(input_buffer->buffer, ".btree ", 7) == 0)
+  {
+    // ".btree" prints the default table, ".btree <table>" any other
+    const char* name  = input_buffer->buffer[6] == ' ' ? input_buffer->buffer + 7 : DEFAULT_TABLE_NAME;
+    table_t*    table = database_find_table(database, name);
+    if (table == NULL)
+    {
+      printf("Error: Table not found.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    table_flush_write_buffer(table);
+    printf("Tree:\n");
+//     print_leaf_node(get_page(table->pager, 0));
+    print_tree(table->pager, table->root_page_num, 0);
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strcmp(input_buffer->buffer, ".tables") == 0)
+  {
+    print_tables(database);
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strcmp(input_buffer->buffer, ".stats") == 0)
+  {
+    // tree_height reads pages, so the counters printed come before it
+    printf("Stats:\n");
+    print_stats(database);
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strncmp(input_buffer->buffer, ".memtable ", 10) == 0)
+  {
+    // ".memtable <rows>" buffers inserts per table, ".memtable off" drains and stops
+    const char* argument = input_buffer->buffer + 10;
+    int         rows     = strcmp(argument, "off") == 0 ? 0 : atoi(argument);
+    if (rows < 0 || (rows == 0 && strcmp(argument, "off") != 0))
+    {
+      printf("Usage: .memtable <rows>|off\n");
+      return META_COMMAND_SUCCESS;
+    }
+    database_set_write_buffer(database, rows);
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strncmp(input_buffer->buffer, ".sort_memory ", 13) == 0)
+  {
+    // ".sort_memory <bytes>" bounds the rows an order by keeps in memory before spilling runs
+    long bytes = atol(input_buffer->buffer + 13);
+    if (bytes <= 0 || bytes > UINT32_MAX)
+    {
+      printf("Usage: .sort_memory <bytes>\n");
+      return META_COMMAND_SUCCESS;
+    }
+    database->sort_memory = (uint32_t)bytes;
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strcmp(input_buffer->buffer, ".format text") == 0 ||
+          strcmp(input_buffer->buffer, ".format binary") == 0)
+  {
+    // Row results only, aggregates and status lines stay text
+    database->result_format = input_buffer->buffer[8] == 'b' ? RESULT_FORMAT_BINARY : RESULT_FORMAT_TEXT;
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strcmp(input_buffer->buffer, ".vacuum") == 0 ||
+          strncmp(input_buffer->buffer, ".vacuum ", 8) == 0)
+  {
+    // ".vacuum" packs leaves to VACUUM_DEFAULT_FILL percent, ".vacuum <percent>" to any other
+    int       fill        = input_buffer->buffer[7] == ' ' ? atoi(input_buffer->buffer + 8) : VACUUM_DEFAULT_FILL;
+    uint32_t  old_pages   = database->pager->num_pages;
+    if (fill < 1 || fill > 100)
+    {
+      printf("Usage: .vacuum [fill percent 1-100]\n");
+      return META_COMMAND_SUCCESS;
+    }
+    if (database_vacuum(database, fill, database->pager->page_map != NULL) != EXECUTE_SUCCESS)
+    {
+      printf("Error: Could not write file.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    printf("Vacuumed %u pages into %u.\n", old_pages, database->pager->num_pages);
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strncmp(input_buffer->buffer, ".compress", 9) == 0)
+  {
+    // Rewrites the file like .vacuum, with pages compressed or back to one per PAGE_SIZE bytes
+    bool on   = strcmp(input_buffer->buffer, ".compress on") == 0;
+    bool off  = strcmp(input_buffer->buffer, ".compress off") == 0;
+    if (!on && !off)
+    {
+      printf("Usage: .compress on|off\n");
+      return META_COMMAND_SUCCESS;
+    }
+    if (database_vacuum(database, VACUUM_DEFAULT_FILL, on) != EXECUTE_SUCCESS)
+    {
+      printf("Error: Could not write file.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    printf("Stored %u pages in %llu bytes.\n", database->pager->num_pages,
+           (unsigned long long)pager_file_bytes(database->pager));
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strncmp(input_buffer->buffer, ".layout", 7) == 0)
+  {
+    // ".layout <table> rows|pax" rewrites the file like .vacuum with the table's leaves in that layout
+    char      name[TABLE_NAME_SIZE];
+    char      layout[8];
+    table_t*  table = NULL;
+    if (sscanf(input_buffer->buffer, ".layout %15s %7s", name, layout) != 2 ||
+        (strcmp(layout, "rows") != 0 && strcmp(layout, "pax") != 0))
+    {
+      printf("Usage: .layout <table> rows|pax\n");
+      return META_COMMAND_SUCCESS;
+    }
+    table = database_find_table(database, name);
+    if (table == NULL)
+    {
+      printf("Error: Table not found.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    leaf_layout_e old_layout = table->leaf_layout;
+    table->leaf_layout = layout[0] == 'p' ? LEAF_LAYOUT_PAX : LEAF_LAYOUT_ROWS;
+    // Splits need room for three cells, as in row leaves
+    if (table->leaf_layout == LEAF_LAYOUT_PAX &&
+        (PAGE_CHECKSUM_OFFSET - LEAF_NODE_PAX_HEADER_SIZE) / table->schema.row_size < 3)
+    {
+      table->leaf_layout = old_layout;
+      printf("Error: Rows too wide for PAX leaves.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    if (database_vacuum(database, VACUUM_DEFAULT_FILL, database->pager->page_map != NULL) != EXECUTE_SUCCESS)
+    {
+      table->leaf_layout = old_layout;
+      printf("Error: Could not write file.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    printf("Table %s uses %s leaves.\n", table->name, layout);
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strcmp(input_buffer->buffer, ".check") == 0)
+  {
+    database_check(database);
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strcmp(input_buffer->buffer, ".stats reset") == 0)
+  {
+    db_stats_reset(database);
+    return META_COMMAND_SUCCESS;
+  }
+  else if(strcmp(input_buffer->buffer , ".constants") == 0)
+  {
+    printf("Constants:\n");
+    print_constants();
+    return META_COMMAND_SUCCESS;
+  }
+  else 
+  {
+    return META_COMMAND_UNRECONGNIZED_COMMAND;
+  }
+}
+
+/*
+ insert <id> <username> <email>            into the default table
+ insert into <table> <value> <value> ...   into any table
+ Values are checked against the schema at execution.
+*/
+prepare_result_e 
+prepare_insert(
+  input_buffer_t* input_buffer, 
+  statement_t*    statement
+) 
+{
+  statement->type       = STATEMENT_INSERT;
+  statement->table_name = NULL;
+  statement->num_values = 0;
+  statement->upsert     = false;
+
+  strtok(input_buffer->buffer, " ");
+  char* token = strtok(NULL, " ");
+
+  if (token != NULL && strcmp(token, "into") == 0)
+  {
+    statement->table_name = strtok(NULL, " ");
+    if (statement->table_name == NULL)
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    token = strtok(NULL, " ");
+  }
+
+  // Room for the values and an "on conflict do update" after them
+  char*     tokens[TABLE_MAX_COLUMNS + 4];
+  uint32_t  num_tokens = 0;
+  while (token != NULL)
+  {
+    if (num_tokens == TABLE_MAX_COLUMNS + 4)
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    tokens[num_tokens++] = token;
+    token = strtok(NULL, " ");
+  }
+
+  // The clause only counts at the end of the line, "on" is a value anywhere else
+  const char* clause[] = { "on", "conflict", "do", "update" };
+  if (num_tokens > 4)
+  {
+    statement->upsert = true;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+      statement->upsert = statement->upsert && strcmp(tokens[num_tokens - 4 + i], clause[i]) == 0;
+    }
+    if (statement->upsert)
+    {
+      num_tokens -= 4;
+    }
+  }
+  if (num_tokens > TABLE_MAX_COLUMNS)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  for (uint32_t i = 0; i < num_tokens; i++)
+  {
+    statement->values[statement->num_values++] = tokens[i];
+  }
+
+  if (statement->num_values == 0) 
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  // The first column of every table is the int primary key
+  int id = atoi(statement->values[0]);
+  if(id < 0)
+  {
+    return PREPARE_NEGATIVE_ID;
+  }
+
+  return PREPARE_SUCCESS;
+}
+
+/*
+ Parses the strtok'd input after "where", the clauses that may follow are left to the caller:
+   <column> = <value>
+   <column> like <prefix>%
+*/
+prepare_result_e
+prepare_where(
+  where_clause_t* where
+)
+{
+  char* column_name = strtok(NULL, " ");
+  char* op          = strtok(NULL, " ");
+  char* value       = strtok(NULL, " ");
+
+  if (column_name == NULL || op == NULL || value == NULL)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  where->column_name = column_name;
+  where->value       = value;
+
+  if (strcmp(op, "=") == 0)
+  {
+    where->op = WHERE_EQUAL;
+  }
+  else if (strcmp(op, "like") == 0 && value[strlen(value) - 1] == '%')
+  {
+    where->op = WHERE_PREFIX;
+    value[strlen(value) - 1] = '\0';
+  }
+  else
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+/* Digits only, no sign, within uint32_t */
+bool
+parse_count(
+  const char* token,
+  uint32_t*   value
+)
+{
+  if (token == NULL || *token == '\0' || strlen(token) > 10 || strspn(token, "0123456789") != strlen(token))
+  {
+    return false;
+  }
+  unsigned long long number = strtoull(token, NULL, 10);
+  *value = number;
+  return number < UINT32_MAX;
+}
+
+/*
+ Parses the clauses after a select's where, token is the first one:
+   [order by <column> [asc|desc]] [limit <n>] [offset <m>]
+*/
+prepare_result_e
+prepare_order_limit(
+  statement_t*    statement,
+  char*           token
+)
+{
+  if (token != NULL && strcmp(token, "order") == 0)
+  {
+    char* by                = strtok(NULL, " ");
+    statement->order_column = strtok(NULL, " ");
+    if (by == NULL || strcmp(by, "by") != 0 || statement->order_column == NULL)
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    token = strtok(NULL, " ");
+    if (token != NULL && (strcmp(token, "asc") == 0 || strcmp(token, "desc") == 0))
+    {
+      statement->order_descending = token[0] == 'd';
+      token                       = strtok(NULL, " ");
+    }
+  }
+  if (token != NULL && strcmp(token, "limit") == 0)
+  {
+    if (!parse_count(strtok(NULL, " "), &(statement->limit)))
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    token = strtok(NULL, " ");
+  }
+  if (token != NULL && strcmp(token, "offset") == 0)
+  {
+    if (!parse_count(strtok(NULL, " "), &(statement->offset)))
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    token = strtok(NULL, " ");
+  }
+  return token == NULL ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+/*
+ create index on <column>           on the default table
+ create index on <table> <column>
+*/
+prepare_result_e
+prepare_create_index(
+  statement_t*    statement
+)
+{
+  statement->type = STATEMENT_CREATE_INDEX;
+
+  char* on      = strtok(NULL, " ");
+  char* first   = strtok(NULL, " ");
+  char* second  = strtok(NULL, " ");
+
+  if (on == NULL || strcmp(on, "on") != 0 || first == NULL || strtok(NULL, " ") != NULL)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (second == NULL)
+  {
+    statement->table_name   = NULL;
+    statement->index_column = first;
+  }
+  else
+  {
+    statement->table_name   = first;
+    statement->index_column = second;
+  }
+  return PREPARE_SUCCESS;
+}
+
+/*
+ create table <name> (<column> int, <column> text(<size>), ...)
+ Text wider than COLUMN_TEXT_MAX_SIZE is stored as overflow text.
+ The first column must be an int and becomes the primary key.
+*/
+prepare_result_e
+prepare_create_table(
+  statement_t*    statement
+)
+{
+  statement->type               = STATEMENT_CREATE_TABLE;
+  statement->table_name         = strtok(NULL, " (");
+  statement->schema.num_columns = 0;
+  statement->schema.row_size    = 0;
+
+  if (statement->table_name == NULL)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strlen(statement->table_name) >= TABLE_NAME_SIZE)
+  {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  char* name;
+  while ((name = strtok(NULL, " ,()")) != NULL)
+  {
+    char*         type_name = strtok(NULL, " ,()");
+    column_type_e type;
+    uint32_t      size;
+
+    if (type_name == NULL || statement->schema.num_columns == TABLE_MAX_COLUMNS)
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (strlen(name) >= COLUMN_NAME_SIZE)
+    {
+      return PREPARE_STRING_TOO_LONG;
+    }
+    if (strcmp(type_name, "int") == 0)
+    {
+      type = COLUMN_TYPE_INT;
+      size = sizeof(uint32_t);
+    }
+    else if (strcmp(type_name, "text") == 0)
+    {
+      char* length = strtok(NULL, " ,()");
+      if (length == NULL || atoi(length) <= 0 || atoi(length) >= COLUMN_OVERFLOW_MAX_SIZE)
+      {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      // Wider than COLUMN_TEXT_MAX_SIZE, long values go to overflow pages
+      type = atoi(length) > COLUMN_TEXT_MAX_SIZE ? COLUMN_TYPE_OVERFLOW_TEXT : COLUMN_TYPE_TEXT;
+      size = atoi(length) + 1;
+    }
+    else
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    schema_add_column(&(statement->schema), name, type, size);
+  }
+
+  if (statement->schema.num_columns == 0 ||
+      statement->schema.columns[0].type != COLUMN_TYPE_INT)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+prepare_result_e
+prepare_create(
+  input_buffer_t* input_buffer,
+  statement_t*    statement
+)
+{
+  strtok(input_buffer->buffer, " ");
+  char* object = strtok(NULL, " ");
+
+  if (object != NULL && strcmp(object, "index") == 0)
+  {
+    return prepare_create_index(statement);
+  }
+  if (object != NULL && strcmp(object, "table") == 0)
+  {
+    return prepare_create_table(statement);
+  }
+  return PREPARE_SYNTAX_ERROR;
+}
+
+/*
+ select [count(*) | min(<column>) | max(...) | sum(...) | avg(...)]
+        [from <table>] [where ...]
+*/
+prepare_result_e
+prepare_select(
+  input_buffer_t* input_buffer,
+  statement_t*    statement
+)
+{
+  static const struct
+  {
+    const char*       prefix;
+    aggregate_type_e  type;
+  } aggregates[] = {
+    { "count(", AGGREGATE_COUNT },
+    { "min(",   AGGREGATE_MIN   },
+    { "max(",   AGGREGATE_MAX   },
+    { "sum(",   AGGREGATE_SUM   },
+    { "avg(",   AGGREGATE_AVG   },
+  };
+
+  statement->type             = STATEMENT_SELECT;
+  statement->table_name       = NULL;
+  statement->aggregate        = AGGREGATE_NONE;
+  statement->aggregate_column = NULL;
+  statement->where.op         = WHERE_NONE;
+  statement->order_column     = NULL;
+  statement->order_descending = false;
+  statement->limit            = UINT32_MAX;
+  statement->offset           = 0;
+
+  strtok(input_buffer->buffer, " ");
+  char* token       = strtok(NULL, " ");
+
+  bool  clause      = token != NULL &&
+                      (strcmp(token, "where") == 0 || strcmp(token, "from") == 0 ||
+                       strcmp(token, "order") == 0 || strcmp(token, "limit") == 0 ||
+                       strcmp(token, "offset") == 0);
+
+  if (token != NULL && !clause)
+  {
+    size_t length = strlen(token);
+    for (uint32_t i = 0; i < sizeof(aggregates) / sizeof(aggregates[0]); i++)
+    {
+      size_t prefix_length = strlen(aggregates[i].prefix);
+      if (strncmp(token, aggregates[i].prefix, prefix_length) == 0 &&
+          length > prefix_length + 1 && token[length - 1] == ')')
+      {
+        statement->aggregate        = aggregates[i].type;
+        statement->aggregate_column = token + prefix_length;
+        token[length - 1]           = '\0';
+        break;
+      }
+    }
+    if (statement->aggregate == AGGREGATE_NONE ||
+        (statement->aggregate == AGGREGATE_COUNT) != (strcmp(statement->aggregate_column, "*") == 0))
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    token = strtok(NULL, " ");
+  }
+
+  if (token != NULL && strcmp(token, "from") == 0)
+  {
+    statement->table_name = strtok(NULL, " ");
+    if (statement->table_name == NULL)
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    token = strtok(NULL, " ");
+  }
+
+  if (token != NULL && strcmp(token, "where") == 0)
+  {
+    prepare_result_e result = prepare_where(&(statement->where));
+    if (result != PREPARE_SUCCESS)
+    {
+      return result;
+    }
+    token = strtok(NULL, " ");
+  }
+  if (token != NULL && statement->aggregate != AGGREGATE_NONE)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return prepare_order_limit(statement, token);
+}
+
+/*
+ copy <table> from '<file>'
+ copy <table> to '<file>' [csv|binary]
+ The file name is quoted and may contain spaces.
+*/
+prepare_result_e
+prepare_copy(
+  input_buffer_t* input_buffer,
+  statement_t*    statement
+)
+{
+  strtok(input_buffer->buffer, " ");
+  char* table     = strtok(NULL, " ");
+  char* direction = strtok(NULL, " ");
+  char* path      = strtok(NULL, "");
+
+  if (table == NULL || direction == NULL || path == NULL)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  while (*path == ' ')
+  {
+    path++;
+  }
+  char* quote = path[0] == '\'' ? strchr(path + 1, '\'') : NULL;
+  if (quote == NULL || quote == path + 1)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  *quote        = '\0';
+  char* format  = strtok(quote + 1, " ");
+  if (strtok(NULL, " ") != NULL)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  if (strcmp(direction, "from") == 0 && format == NULL)
+  {
+    statement->type = STATEMENT_COPY_FROM;
+  }
+  else if (strcmp(direction, "to") == 0 && (format == NULL || strcmp(format, "csv") == 0))
+  {
+    statement->type         = STATEMENT_COPY_TO;
+    statement->copy_format  = RESULT_FORMAT_CSV;
+  }
+  else if (strcmp(direction, "to") == 0 && strcmp(format, "binary") == 0)
+  {
+    statement->type         = STATEMENT_COPY_TO;
+    statement->copy_format  = RESULT_FORMAT_BINARY;
+  }
+  else
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  statement->table_name = table;
+  statement->copy_path  = path + 1;
+  return PREPARE_SUCCESS;
+}
+
+/*
+ update [<table>] set <column> = <value>[,] [<column> = <value> ...] where <key column> = <id>
+ The table defaults to the users table; the where clause is checked to name the key at execution.
+*/
+prepare_result_e
+prepare_update(
+  input_buffer_t* input_buffer,
+  statement_t*    statement
+)
+{
+  statement->type       = STATEMENT_UPDATE;
+  statement->table_name = NULL;
+  statement->num_values = 0;
+
+  strtok(input_buffer->buffer, " ");
+  char* token = strtok(NULL, " ");
+  if (token != NULL && strcmp(token, "set") != 0)
+  {
+    statement->table_name = token;
+    token                 = strtok(NULL, " ");
+  }
+  if (token == NULL || strcmp(token, "set") != 0)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  token = strtok(NULL, " ");
+  while (token != NULL && strcmp(token, "where") != 0)
+  {
+    char* op    = strtok(NULL, " ");
+    char* value = strtok(NULL, " ");
+    if (op == NULL || value == NULL || strcmp(op, "=") != 0 || statement->num_values == TABLE_MAX_COLUMNS)
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    // Assignments may be separated by commas
+    size_t length = strlen(value);
+    if (value[length - 1] == ',')
+    {
+      value[length - 1] = '\0';
+    }
+    statement->update_columns[statement->num_values]  = token;
+    statement->values[statement->num_values++]        = value;
+    token = strtok(NULL, " ");
+  }
+  if (token == NULL || statement->num_values == 0 || prepare_where(&(statement->where)) != PREPARE_SUCCESS ||
+      strtok(NULL, " ") != NULL)
+  {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (atoi(statement->where.value) < 0)
+  {
+    return PREPARE_NEGATIVE_ID;
+  }
+  return PREPARE_SUCCESS;
+}
+
+prepare_result_e 
+prepare_statement(
+  input_buffer_t*   input_buffer,
+  statement_t*      statement
+) 
+{
+  statement->explain  = false;
+  statement->parse_ns = 0;
+
+  if (strncmp(input_buffer->buffer, "explain analyze ", 16) == 0)
+  {
+    // Parse the statement itself, the report is printed after it runs
+    uint64_t start = monotonic_ns();
+    memmove(input_buffer->buffer, input_buffer->buffer + 16, strlen(input_buffer->buffer + 16) + 1);
+    prepare_result_e result = prepare_statement(input_buffer, statement);
+    statement->explain  = true;
+    statement->parse_ns = monotonic_ns() - start;
+    return result;
+  }
+  if (strncmp(input_buffer->buffer, "insert", 6) == 0) 
+  {
+    return prepare_insert(input_buffer, statement);
+  }
+  if (strcmp(input_buffer->buffer, "select") == 0 ||
+      strncmp(input_buffer->buffer, "select ", 7) == 0)
+  {
+    return prepare_select(input_buffer, statement);
+  }
+  if (strncmp(input_buffer->buffer, "create ", 7) == 0)
+  {
+    return prepare_create(input_buffer, statement);
+  }
+  if (strncmp(input_buffer->buffer, "copy ", 5) == 0)
+  {
+    return prepare_copy(input_buffer, statement);
+  }
+  if (strncmp(input_buffer->buffer, "update ", 7) == 0)
+  {
+    return prepare_update(input_buffer, statement);
+  }
+
+  return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+/*
+Until we start recycling free pages, new pages will always
+go onto the end of the database file
+*/
+uint32_t
+get_unused_page_num(
+  pager_t*  pager
+)
+{
+  return pager->num_pages;
+}
+
+uint32_t*
+internal_node_num_keys(
+  void*   node
+)
+{
+  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+uint32_t*
+internal_node_right_child(
+  void*   node
+)
+{
+  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+uint32_t*
+internal_node_cell(
+  void*     node,
+  uint32_t  cell_num
+)
+{
+  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+
+uint32_t*
+internal_node_child(
+  void*     node,
+  uint32_t  child_num
+)
+{
+  uint32_t  num_keys = *internal_node_num_keys(node);
+  if(child_num > num_keys)
+  {
+    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+    exit(EXIT_FAILURE);
+  }
+  else if(child_num == num_keys)
+  {
+    return internal_node_right_child(node);
+  }
+  else
+  {
+    return internal_node_cell(node, child_num);
+  }
+}
+
+uint32_t*
+internal_node_key(
+  void*     node,
+  uint32_t  key_num
+)
+{
+  return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint32_t*
+internal_node_row_count(
+  void*   node
+)
+{
+  return node + INTERNAL_NODE_ROW_COUNT_OFFSET;
+}
+
+/*
+ The keys of an internal node only bound its left children,
+ so the max key of a subtree lives in its rightmost leaf.
+*/
+uint32_t
+get_node_max_key(
+  pager_t*  pager,
+  void*     node
+)
+{
+  if(get_node_type(node) == NODE_LEAF)
+  {
+    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+  }
+  void* right_child = get_page(pager, *internal_node_right_child(node));
+  return get_node_max_key(pager, right_child);
+}
+
+uint32_t
+node_row_count(
+  void*   node
+)
+{
+  switch (get_node_type(node))
+  {
+  case NODE_INTERNAL:
+    return *internal_node_row_count(node);
+  case NODE_LEAF:
+    return *leaf_node_num_cells(node);
+  default:
+    // Only leaves and internal nodes make up a tree
+    printf("Tree page is not a leaf or internal node. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Recompute an internal node's row count from its children */
+void
+internal_node_recount(
+  pager_t*  pager,
+  uint32_t  page_num
+)
+{
+  void*     node      = get_page(pager, page_num);
+  uint32_t  num_keys  = *internal_node_num_keys(node);
+  uint32_t  count     = 0;
+
+  for (uint32_t i = 0; i <= num_keys; i++)
+  {
+    count += node_row_count(get_page(pager, *internal_node_child(node, i)));
+  }
+  *internal_node_row_count(node) = count;
+}
+
+/* Account for one row added below page_num in every ancestor */
+void
+add_ancestor_row_counts(
+  pager_t*  pager,
+  uint32_t  page_num,
+  uint32_t  count
+)
+{
+  void* node = get_page(pager, page_num);
+  while (!is_node_root(node))
+  {
+    uint32_t parent_page_num = *node_parent(node);
+    node = get_page(pager, parent_page_num);
+    *internal_node_row_count(node) += count;
+  }
+}
+
+void
+increment_ancestor_row_counts(
+  pager_t*  pager,
+  uint32_t  page_num
+)
+{
+  add_ancestor_row_counts(pager, page_num, 1);
+}
+
+void
+create_new_root(
+  table_t*      table,
+  uint32_t      right_child_page_num
+)
+{
+  /*
+  Handle splitting the root.
+  Old root copied to new page, becomes left child.
+  Address of right child passed in.
+  Re-initialize root page to contain the new root node.
+  New root node points to two children.
+  */
+  void*     root                = get_page(table->pager, table->root_page_num);
+  void*     right_child         = get_page(table->pager, right_child_page_num);
+  uint32_t  left_child_page_num = get_unused_page_num(table->pager);
+  void*     left_child          = get_page(table->pager, left_child_page_num);
+
+  if(get_node_type(root) == NODE_INTERNAL)
+  {
+    initialize_internal_node(right_child);
+    initialize_internal_node(left_child);
+  }
+
+  /* Left child has data copied from old root */
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+
+  if(get_node_type(left_child) == NODE_INTERNAL)
+  {
+    /* Children of the old root now hang off the left child */
+    for (uint32_t i = 0; i <= *internal_node_num_keys(left_child); i++)
+    {
+      void* child = get_page(table->pager, *internal_node_child(left_child, i));
+      *node_parent(child) = left_child_page_num;
+    }
+  }
+
+  /* Root node is a new internal node with one key and two children */
+  initialize_internal_node(root);
+  set_node_root(root, true);
+
+  *internal_node_num_keys(root)    = 1;
+  *internal_node_child(root, 0)    = left_child_page_num;
+  uint32_t  left_child_max_key     = get_node_max_key(table->pager, left_child);
+  *internal_node_key(root, 0)      = left_child_max_key;
+  *internal_node_right_child(root) = right_child_page_num;
+  *node_parent(left_child)         = table->root_page_num;
+  *node_parent(right_child)        = table->root_page_num; 
+  *internal_node_row_count(root)   = node_row_count(left_child) + node_row_count(right_child);
+}
+
+bool
+is_node_root(
+  void*   node
+)
+{
+  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+  return  (bool)value;
+}
+
+void
+set_node_root(
+  void*   node,
+  bool    is_root
+)
+{
+  uint8_t      value                    = is_root;
+  *((uint8_t*) (node + IS_ROOT_OFFSET)) = value;
+}
+
+void
+update_internal_node_key(
+  void*       node,
+  uint32_t    old_key,
+  uint32_t    new_key
+)
+{
+  uint32_t old_child_index = internal_node_find_child(node ,old_key);
+
+  /* The right child has no key of its own */
+  if(old_child_index < *internal_node_num_keys(node))
+  {
+    *internal_node_key(node, old_child_index) = new_key;
+  }
+}
+
+void
+internal_node_insert(
+  table_t*    table,
+  uint32_t    parent_page_num,
+  uint32_t    child_page_num
+)
+{
+  void*     parent            = get_page(table->pager, parent_page_num);
+  void*     child             = get_page(table->pager, child_page_num);
+  uint32_t  child_max_key     = get_node_max_key(table->pager, child);
+  uint32_t  index             = internal_node_find_child(parent, child_max_key);
+  uint32_t  original_num_keys = *internal_node_num_keys(parent);
+
+  if(original_num_keys >= INTERNAL_NODE_MAX_CELLS)
+  {
+    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+    return;
+  }
+
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  /*
+  An internal node with a right child of INVALID_PAGE_NUM is empty
+  */
+  if(right_child_page_num == INVALID_PAGE_NUM)
+  {
+    *internal_node_right_child(parent) = child_page_num;
+    return;
+  }
+
+  void*    right_child          = get_page(table->pager, right_child_page_num);
+  /*
+  If we are already at the max number of cells for a node, we cannot increment
+  before splitting. Incrementing without inserting a new key/child pair
+  and immediately calling internal_node_split_and_insert has the effect
+  of creating a new key at (max_cells + 1) with an uninitialized value
+  */
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  if(child_max_key > get_node_max_key(table->pager, right_child))
+  {
+    //replace right child
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    *internal_node_key(parent, original_num_keys) = get_node_max_key(table->pager, right_child);
+    *internal_node_right_child(parent) = child_page_num;
+  }
+  else
+  {
+    /* Make room for the new cell */
+    for (uint32_t i = original_num_keys; i > index; i--) 
+    {
+      void* destination = internal_node_cell(parent, i);
+      void* source      = internal_node_cell(parent, i - 1);
+      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+    }
+    *internal_node_child(parent, index) = child_page_num;
+    *internal_node_key(parent, index)   = child_max_key;
+  }
+}
+
+void
+internal_node_split_and_insert(
+  table_t*    table,
+  uint32_t    parent_page_num,
+  uint32_t    child_page_num
+)
+{
+  /*
+  Move the upper half of the children into a new internal node,
+  insert the child on whichever side it belongs,
+  then insert the new node into the grandparent (or a new root).
+  */
+  table->pager->stats.internal_splits += 1;
+  uint32_t  old_page_num    = parent_page_num;
+  void*     old_node        = get_page(table->pager, parent_page_num);
+  uint32_t  old_max         = get_node_max_key(table->pager, old_node);
+
+  void*     child           = get_page(table->pager, child_page_num);
+  uint32_t  child_max       = get_node_max_key(table->pager, child);
+
+  uint32_t  new_page_num    = get_unused_page_num(table->pager);
+  bool      splitting_root  = is_node_root(old_node);
+
+  void*     parent;
+  void*     new_node;
+  if(splitting_root)
+  {
+    create_new_root(table, new_page_num);
+    parent        = get_page(table->pager, table->root_page_num);
+    /*
+    If we are splitting the root, we need to update old_node to point
+    to the new root's left child, new_page_num will already point to
+    the new root's right child
+    */
+    old_page_num  = *internal_node_child(parent, 0);
+    old_node      = get_page(table->pager, old_page_num);
+  }
+  else
+  {
+    parent        = get_page(table->pager, *node_parent(old_node));
+    new_node      = get_page(table->pager, new_page_num);
+    initialize_internal_node(new_node);
+  }
+
+  uint32_t* old_num_keys  = internal_node_num_keys(old_node);
+
+  /* First put the right child into the new node and set the old right child to invalid */
+  uint32_t  cur_page_num  = *internal_node_right_child(old_node);
+  void*     cur           = get_page(table->pager, cur_page_num);
+
+  internal_node_insert(table, new_page_num, cur_page_num);
+  *node_parent(cur)                     = new_page_num;
+  *internal_node_right_child(old_node)  = INVALID_PAGE_NUM;
+
+  /* For each key until the middle key, move the key and the child to the new node */
+  for (int32_t i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2; i--)
+  {
+    cur_page_num = *internal_node_child(old_node, i);
+    cur          = get_page(table->pager, cur_page_num);
+
+    internal_node_insert(table, new_page_num, cur_page_num);
+    *node_parent(cur) = new_page_num;
+
+    (*old_num_keys)--;
+  }
+
+  /*
+  Set child before middle key, which is now the highest key, to be node's right child,
+  and decrement number of keys
+  */
+  *internal_node_right_child(old_node) = *internal_node_child(old_node, *old_num_keys - 1);
+  (*old_num_keys)--;
+
+  /*
+  Determine which of the two nodes after the split should contain the child to be inserted,
+  and insert the child
+  */
+  uint32_t  max_after_split       = get_node_max_key(table->pager, old_node);
+  uint32_t  destination_page_num  = child_max < max_after_split ? old_page_num : new_page_num;
+
+  internal_node_insert(table, destination_page_num, child_page_num);
+  *node_parent(child) = destination_page_num;
+
+  update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
+
+  /* The grandparent already accounts for these rows, only the halves need fixing */
+  internal_node_recount(table->pager, old_page_num);
+  internal_node_recount(table->pager, new_page_num);
+
+  if(!splitting_root)
+  {
+    /*
+    Set the parent before inserting: if the grandparent splits too,
+    it re-parents new_node itself and must not be overwritten afterwards.
+    */
+    *node_parent(new_node) = *node_parent(old_node);
+    internal_node_insert(table, *node_parent(old_node), new_page_num);
+  }
+}
+
+void
+leaf_node_split_and_insert(
+  cursor_t*     cursor,
+  uint32_t      key,
+  void*         value
+)
+{
+  /*
+  Create a new node and move half the cells over.
+  Insert the new value in one of the two nodes.
+  Update parent or create a new parent.
+  */
+  cursor->table->pager->stats.leaf_splits += 1;
+  void*     old_node      = get_page(cursor->table->pager, cursor->page_num);
+  uint32_t  old_max       = get_node_max_key(cursor->table->pager, old_node);
+  uint32_t  new_page_num  = get_unused_page_num(cursor->table->pager);
+  void*     new_node      = get_page(cursor->table->pager, new_page_num);
+  uint32_t  max_cells     = leaf_node_max_cells(old_node);
+  uint32_t  right_count   = (max_cells + 1) / 2;
+  uint32_t  left_count    = (max_cells + 1) - right_count;
+  /*
+  Appending past the end of the rightmost leaf: keep the old leaf full and
+  start a fresh one, otherwise ascending keys leave every leaf half empty.
+  */
+  if(cursor->cell_num == max_cells && *leaf_node_next_leaf(old_node) == 0)
+  {
+    right_count = 1;
+    left_count  = max_cells;
+  }
+  initialize_leaf_node_like(new_node, old_node);
+  *node_parent(new_node)         = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+  /*
+  All existing keys plus new key should be divided
+  evenly between old (left) and new (right) nodes.
+  Starting from the right, move each key to correct position.
+  */
+  for(int32_t i = max_cells; i >= 0; i--)
+  {
+    void* destination_node;
+    if(i >= left_count)
+    {
+      destination_node = new_node;
+    }
+    else
+    {
+      destination_node = old_node;
+    }
+    uint32_t index_within_node = (i >= left_count) ? i - left_count : i;
+
+    if(i == cursor->cell_num)
+    {
+      //serialize_row(value, destination);
+      leaf_node_write_row(destination_node, index_within_node, key, value);
+    }
+    else if(i > cursor->cell_num)
+    {
+      leaf_node_copy_cell(destination_node, index_within_node, old_node, i - 1);
+    }
+    else
+    {
+      leaf_node_copy_cell(destination_node, index_within_node, old_node, i);
+    }
+  }
+
+  /* Update cell count on both leaf nodes */
+  *(leaf_node_num_cells(old_node)) = left_count;
+  *(leaf_node_num_cells(new_node)) = right_count;
+
+  if(is_node_root(old_node))
+  {
+    return create_new_root(cursor->table, new_page_num);
+  }
+  else
+  {
+    uint32_t parent_page_num  = *node_parent(old_node);
+    uint32_t new_max          = get_node_max_key(cursor->table->pager, old_node);
+    void*    parent           = get_page(cursor->table->pager, parent_page_num);
+
+    update_internal_node_key(parent, old_max, new_max);
+    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    return;
+  }
+}
+
+void 
+leaf_node_insert(
+  cursor_t* cursor, 
+  uint32_t  key, 
+  void*     value
+) 
+{
+  void*    node       = get_page(cursor->table->pager, cursor->page_num);
+  uint32_t num_cells  = *leaf_node_num_cells(node);
+  if (num_cells >= leaf_node_max_cells(node)) 
+  {
+    // Node full
+    // printf("Need to implement splitting a leaf node.\n");
+    // exit(EXIT_FAILURE);
+    leaf_node_split_and_insert(cursor, key, value);
+    return;
+  }
+
+  if (cursor->cell_num < num_cells) 
+  {
+    // Make room for new cell
+    for (uint32_t i = num_cells; i > cursor->cell_num; i--) 
+    {
+      leaf_node_copy_cell(node, i, node, i - 1);
+    }
+  }
+
+  *(leaf_node_num_cells(node)) += 1;
+  leaf_node_write_row(node, cursor->cell_num, key, value);
+}
+
+/*
+ * Secondary index B+trees.
+ * Same page header as the primary tree, but the keys are
+ * fixed-width strings followed by the row id.
+ */
+uint32_t
+index_entry_size(
+  index_t*  index
+)
+{
+  return index->key_size + INDEX_NODE_ID_SIZE;
+}
+
+uint32_t
+index_leaf_max_cells(
+  index_t*  index
+)
+{
+  return LEAF_NODE_SPACE_FOR_CELLS / index_entry_size(index);
+}
+
+uint32_t
+index_internal_max_cells(
+  index_t*  index
+)
+{
+  return (PAGE_CHECKSUM_OFFSET - INTERNAL_NODE_HEADER_SIZE) /
+         (INTERNAL_NODE_CHILD_SIZE + index_entry_size(index));
+}
+
+void*
+index_leaf_entry(
+  index_t*  index,
+  void*     node,
+  uint32_t  cell_num
+)
+{
+  return node + LEAF_NODE_HEADER_SIZE + cell_num * index_entry_size(index);
+}
+
+void*
+index_internal_cell(
+  index_t*  index,
+  void*     node,
+  uint32_t  cell_num
+)
+{
+  return node + INTERNAL_NODE_HEADER_SIZE +
+         cell_num * (INTERNAL_NODE_CHILD_SIZE + index_entry_size(index));
+}
+
+uint32_t*
+index_internal_child(
+  index_t*  index,
+  void*     node,
+  uint32_t  child_num
+)
+{
+  if(child_num == *internal_node_num_keys(node))
+  {
+    return internal_node_right_child(node);
+  }
+  return index_internal_cell(index, node, child_num);
+}
+
+void*
+index_internal_entry(
+  index_t*  index,
+  void*     node,
+  uint32_t  key_num
+)
+{
+  return index_internal_cell(index, node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint32_t
+index_entry_id(
+  index_t*    index,
+  const void* entry
+)
+{
+  uint32_t id;
+  memcpy(&id, entry + index->key_size, INDEX_NODE_ID_SIZE);
+  return id;
+}
+
+void
+index_make_entry(
+  index_t*    index,
+  const char* key,
+  uint32_t    id,
+  void*       entry
+)
+{
+  strncpy(entry, key, index->key_size);
+  memcpy(entry + index->key_size, &id, INDEX_NODE_ID_SIZE);
+}
+
+int
+index_entry_compare(
+  index_t*    index,
+  const void* a,
+  const void* b
+)
+{
+  int result = strncmp(a, b, index->key_size);
+  if(result != 0)
+  {
+    return result;
+  }
+  uint32_t a_id = index_entry_id(index, a);
+  uint32_t b_id = index_entry_id(index, b);
+  return (a_id > b_id) - (a_id < b_id);
+}
+
+/* String-key variant of leaf_node_find(), returns the first cell >= entry */
+uint32_t
+index_leaf_node_find(
+  index_t*    index,
+  void*       node,
+  const void* entry
+)
+{
+  uint32_t  min_index           = 0;
+  uint32_t  one_past_max_index  = *leaf_node_num_cells(node);
+
+  while (one_past_max_index != min_index)
+  {
+    uint32_t index_at = (min_index + one_past_max_index) / 2;
+    if(index_entry_compare(index, index_leaf_entry(index, node, index_at), entry) >= 0)
+    {
+      one_past_max_index = index_at;
+    }
+    else
+    {
+      min_index = index_at + 1;
+    }
+  }
+  return min_index;
+}
+
+/* String-key variant of internal_node_find_child() */
+uint32_t
+index_internal_node_find_child(
+  index_t*    index,
+  void*       node,
+  const void* entry
+)
+{
+  uint32_t  min_index = 0;
+  uint32_t  max_index = *internal_node_num_keys(node);
+
+  while (min_index != max_index)
+  {
+    uint32_t index_at = (min_index + max_index) / 2;
+    if(index_entry_compare(index, index_internal_entry(index, node, index_at), entry) >= 0)
+    {
+      max_index = index_at;
+    }
+    else
+    {
+      min_index = index_at + 1;
+    }
+  }
+  return min_index;
+}
+
+/*
+ Position a cursor on the first index entry >= entry.
+ The cursor walks the index leaf chain with cursor_advance().
+*/
+cursor_t*
+index_find(
+  table_t*    table,
+  index_t*    index,
+  const void* entry
+)
+{
+  uint32_t  page_num  = index->root_page_num;
+  void*     node      = get_page(table->pager, page_num);
+
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    uint32_t child_index = index_internal_node_find_child(index, node, entry);
+    page_num = *index_internal_child(index, node, child_index);
+    node     = get_page(table->pager, page_num);
+  }
+
+  cursor_t* cursor      = malloc(sizeof(cursor_t));
+  table->pager->stats.cursors_allocated += 1;
+  cursor->table         = table;
+  cursor->page_num      = page_num;
+  cursor->cell_num      = index_leaf_node_find(index, node, entry);
+  cursor->end_of_table  = false;
+
+  while(cursor->cell_num >= *leaf_node_num_cells(node))
+  {
+    /* Every entry in this leaf is smaller, or there is none, continue in the next one */
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if(next_page_num == 0)
+    {
+      cursor->end_of_table = true;
+      break;
+    }
+    cursor->page_num = next_page_num;
+    cursor->cell_num = 0;
+    node             = get_page(table->pager, next_page_num);
+  }
+  return cursor;
+}
+
+/*
+ Insert entry below page_num.
+ Returns true if the node split; the caller then has to link
+ new_page_num to the right of page_num with separator split_entry.
+*/
+bool
+index_node_insert(
+  table_t*    table,
+  index_t*    index,
+  uint32_t    page_num,
+  const void* entry,
+  void*       split_entry,
+  uint32_t*   new_page_num
+)
+{
+  uint8_t   cells[2 * PAGE_SIZE];
+  void*     node        = get_page(table->pager, page_num);
+  uint32_t  entry_size  = index_entry_size(index);
+
+  if(get_node_type(node) == NODE_LEAF)
+  {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t cell_num  = index_leaf_node_find(index, node, entry);
+
+    if(num_cells < index_leaf_max_cells(index))
+    {
+      memmove(index_leaf_entry(index, node, cell_num + 1),
+              index_leaf_entry(index, node, cell_num),
+              (num_cells - cell_num) * entry_size);
+      memcpy(index_leaf_entry(index, node, cell_num), entry, entry_size);
+      *leaf_node_num_cells(node) = num_cells + 1;
+      return false;
+    }
+
+    /* Full: stage all cells plus the new one, then divide them evenly */
+    memcpy(cells, index_leaf_entry(index, node, 0), cell_num * entry_size);
+    memcpy(cells + cell_num * entry_size, entry, entry_size);
+    memcpy(cells + (cell_num + 1) * entry_size,
+           index_leaf_entry(index, node, cell_num),
+           (num_cells - cell_num) * entry_size);
+
+    uint32_t  total       = num_cells + 1;
+    uint32_t  left_count  = total / 2;
+    table->pager->stats.leaf_splits += 1;
+    *new_page_num         = get_unused_page_num(table->pager);
+    void*     new_node    = get_page(table->pager, *new_page_num);
+    initialize_leaf_node(new_node, 0);
+
+    memcpy(index_leaf_entry(index, node, 0), cells, left_count * entry_size);
+    memcpy(index_leaf_entry(index, new_node, 0), cells + left_count * entry_size,
+           (total - left_count) * entry_size);
+    *leaf_node_num_cells(node)     = left_count;
+    *leaf_node_num_cells(new_node) = total - left_count;
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(node);
+    *leaf_node_next_leaf(node)     = *new_page_num;
+
+    memcpy(split_entry, index_leaf_entry(index, node, left_count - 1), entry_size);
+    return true;
+  }
+
+  uint8_t   child_split_entry[INDEX_NODE_ID_SIZE + COLUMN_TEXT_MAX_SIZE + 1];
+  uint32_t  child_new_page_num;
+  uint32_t  child_index = index_internal_node_find_child(index, node, entry);
+  uint32_t  child_page  = *index_internal_child(index, node, child_index);
+
+  if(!index_node_insert(table, index, child_page, entry,
+                        child_split_entry, &child_new_page_num))
+  {
+    return false;
+  }
+
+  /* Re-fetch, the recursive call may have touched other pages */
+  node = get_page(table->pager, page_num);
+
+  /*
+  The child kept the lower half: give it the separator in a new cell
+  at child_index and let the slot after it point at the new sibling.
+  */
+  uint32_t  num_keys  = *internal_node_num_keys(node);
+  uint32_t  cell_size = INTERNAL_NODE_CHILD_SIZE + entry_size;
+
+  memcpy(cells, index_internal_cell(index, node, 0), num_keys * cell_size);
+  memmove(cells + (child_index + 1) * cell_size, cells + child_index * cell_size,
+          (num_keys - child_index) * cell_size);
+  memcpy(cells + child_index * cell_size, &child_page, INTERNAL_NODE_CHILD_SIZE);
+  memcpy(cells + child_index * cell_size + INTERNAL_NODE_CHILD_SIZE,
+         child_split_entry, entry_size);
+
+  uint32_t  total       = num_keys + 1;
+  uint32_t  right_child = *internal_node_right_child(node);
+  if(child_index + 1 == total)
+  {
+    right_child = child_new_page_num;
+  }
+  else
+  {
+    memcpy(cells + (child_index + 1) * cell_size, &child_new_page_num, INTERNAL_NODE_CHILD_SIZE);
+  }
+
+  if(total <= index_internal_max_cells(index))
+  {
+    memcpy(index_internal_cell(index, node, 0), cells, total * cell_size);
+    *internal_node_num_keys(node)    = total;
+    *internal_node_right_child(node) = right_child;
+    return false;
+  }
+
+  /* Split: the middle key moves up, its child becomes the left right child */
+  uint32_t  middle      = total / 2;
+  table->pager->stats.internal_splits += 1;
+  *new_page_num         = get_unused_page_num(table->pager);
+  void*     new_node    = get_page(table->pager, *new_page_num);
+  initialize_internal_node(new_node);
+
+  memcpy(index_internal_cell(index, node, 0), cells, middle * cell_size);
+  *internal_node_num_keys(node) = middle;
+  memcpy(internal_node_right_child(node), cells + middle * cell_size, INTERNAL_NODE_CHILD_SIZE);
+
+  memcpy(index_internal_cell(index, new_node, 0), cells + (middle + 1) * cell_size,
+         (total - middle - 1) * cell_size);
+  *internal_node_num_keys(new_node)    = total - middle - 1;
+  *internal_node_right_child(new_node) = right_child;
+
+  memcpy(split_entry, cells + middle * cell_size + INTERNAL_NODE_CHILD_SIZE, entry_size);
+  return true;
+}
+
+void
+index_insert(
+  table_t*    table,
+  index_t*    index,
+  const char* key,
+  uint32_t    id
+)
+{
+  uint8_t   entry[INDEX_NODE_ID_SIZE + COLUMN_TEXT_MAX_SIZE + 1];
+  uint8_t   split_entry[INDEX_NODE_ID_SIZE + COLUMN_TEXT_MAX_SIZE + 1];
+  uint32_t  new_page_num;
+
+  index_make_entry(index, key, id, entry);
+  if(!index_node_insert(table, index, index->root_page_num, entry, split_entry, &new_page_num))
+  {
+    return;
+  }
+
+  /*
+  Root split: like create_new_root(), the root keeps its page number,
+  its lower half moves to a fresh left child.
+  */
+  void*     root                = get_page(table->pager, index->root_page_num);
+  uint32_t  left_child_page_num = get_unused_page_num(table->pager);
+  void*     left_child          = get_page(table->pager, left_child_page_num);
+
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root)    = 1;
+  *internal_node_right_child(root) = new_page_num;
+  memcpy(index_internal_cell(index, root, 0), &left_child_page_num, INTERNAL_NODE_CHILD_SIZE);
+  memcpy(index_internal_entry(index, root, 0), split_entry, index_entry_size(index));
+}
+
+/*
+ Removes the entry for (key, id). Leaves are not merged, one may be left empty
+ until a vacuum rebuilds the index; cursors pass over empty leaves.
+*/
+void
+index_remove(
+  table_t*    table,
+  index_t*    index,
+  const char* key,
+  uint32_t    id
+)
+{
+  uint8_t   entry[INDEX_NODE_ID_SIZE + COLUMN_TEXT_MAX_SIZE + 1];
+  uint32_t  entry_size = index_entry_size(index);
+
+  index_make_entry(index, key, id, entry);
+  cursor_t* cursor = index_find(table, index, entry);
+  void*     node   = get_page(table->pager, cursor->page_num);
+  if (!(cursor->end_of_table) &&
+      index_entry_compare(index, index_leaf_entry(index, node, cursor->cell_num), entry) == 0)
+  {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    memmove(index_leaf_entry(index, node, cursor->cell_num),
+            index_leaf_entry(index, node, cursor->cell_num + 1),
+            (num_cells - cursor->cell_num - 1) * entry_size);
+    *leaf_node_num_cells(node) = num_cells - 1;
+  }
+  free(cursor);
+}
+
+void
+schema_add_column(
+  schema_t*       schema,
+  const char*     name,
+  column_type_e   type,
+  uint32_t        size
+)
+{
+  column_t* column = &(schema->columns[schema->num_columns]);
+
+  strncpy(column->name, name, COLUMN_NAME_SIZE);
+  column->type      = type;
+  column->size      = type == COLUMN_TYPE_OVERFLOW_TEXT ? OVERFLOW_SLOT_SIZE : size;
+  column->max_size  = size;
+  column->offset    = schema->row_size;
+
+  schema->num_columns += 1;
+  schema->row_size    += column->size;
+}
+
+/* Same layout as row_t, see serialize_row() */
+void
+schema_init_users(
+  schema_t*   schema
+)
+{
+  schema->num_columns = 0;
+  schema->row_size    = 0;
+  schema_add_column(schema, "id", COLUMN_TYPE_INT, ID_SIZE);
+  schema_add_column(schema, "username", COLUMN_TYPE_TEXT, USERNAME_SIZE);
+  schema_add_column(schema, "email", COLUMN_TYPE_TEXT, EMAIL_SIZE);
+}
+
+bool
+schema_find_column(
+  schema_t*   schema,
+  const char* name,
+  uint32_t*   column
+)
+{
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    if (strcmp(schema->columns[i].name, name) == 0)
+    {
+      *column = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+schema_has_overflow(
+  schema_t*   schema
+)
+{
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    if (schema->columns[i].type == COLUMN_TYPE_OVERFLOW_TEXT)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ Build a row in the table's on-page format from text values.
+ Every value is checked before long ones are written to overflow pages of pager.
+*/
+execute_result_e
+serialize_values(
+  schema_t*   schema,
+  pager_t*    pager,
+  char**      values,
+  void*       destination
+)
+{
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    if (schema->columns[i].type != COLUMN_TYPE_INT && strlen(values[i]) >= schema->columns[i].max_size)
+    {
+      return EXECUTE_STRING_TOO_LONG;
+    }
+  }
+  memset(destination, 0, schema->row_size);
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    column_t* column = &(schema->columns[i]);
+    if (column->type == COLUMN_TYPE_INT)
+    {
+      uint32_t value = atoi(values[i]);
+      memcpy(destination + column->offset, &value, sizeof(uint32_t));
+    }
+    else if (column->type == COLUMN_TYPE_OVERFLOW_TEXT)
+    {
+      overflow_store(pager, values[i], strlen(values[i]), destination + column->offset, 0);
+    }
+    else
+    {
+      strncpy(destination + column->offset, values[i], column->size);
+    }
+  }
+  return EXECUTE_SUCCESS;
+}
+
+void
+table_index_row(
+  table_t*    table,
+  index_t*    index,
+  row_view_t* view
+)
+{
+  index_insert(table, index, row_view_text(view, index->column), row_view_id(view));
+}
+
+void
+catalog_save(
+  database_t*   database
+)
+{
+  void* catalog = get_page(database->pager, CATALOG_PAGE_NUM);
+
+  memset(catalog, 0, PAGE_SIZE);
+  memcpy(catalog + CATALOG_MAGIC_OFFSET, &CATALOG_MAGIC, CATALOG_MAGIC_SIZE);
+  memcpy(catalog + CATALOG_NUM_TABLES_OFFSET, &database->num_tables, CATALOG_NUM_TABLES_SIZE);
+  memcpy(catalog + CATALOG_VERSION_OFFSET, &CATALOG_FORMAT_VERSION, sizeof(uint32_t));
+
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    table_t*  table = database->tables[i];
+    void*     entry = catalog + CATALOG_HEADER_SIZE + i * CATALOG_TABLE_ENTRY_SIZE;
+
+    strncpy(entry + CATALOG_TABLE_NAME_OFFSET, table->name, TABLE_NAME_SIZE);
+    memcpy(entry + CATALOG_TABLE_ROOT_PAGE_OFFSET, &table->root_page_num, sizeof(uint32_t));
+    memcpy(entry + CATALOG_TABLE_NUM_COLUMNS_OFFSET, &table->schema.num_columns, sizeof(uint32_t));
+    memcpy(catalog + CATALOG_BLOOM_ROOTS_OFFSET + i * sizeof(uint32_t),
+           &table->bloom_root_page_num, sizeof(uint32_t));
+    *((uint8_t*)catalog + CATALOG_LEAF_LAYOUTS_OFFSET + i) = (uint8_t)table->leaf_layout;
+    for (uint32_t j = 0; j < table->schema.num_columns; j++)
+    {
+      column_t* column        = &(table->schema.columns[j]);
+      void*     column_entry  = entry + CATALOG_TABLE_COLUMNS_OFFSET + j * CATALOG_COLUMN_ENTRY_SIZE;
+      uint32_t  type          = column->type;
+
+      strncpy(column_entry + CATALOG_COLUMN_NAME_OFFSET, column->name, COLUMN_NAME_SIZE);
+      memcpy(column_entry + CATALOG_COLUMN_TYPE_OFFSET, &type, sizeof(uint32_t));
+      memcpy(column_entry + CATALOG_COLUMN_SIZE_OFFSET, &column->max_size, sizeof(uint32_t));
+      memcpy(column_entry + CATALOG_COLUMN_INDEX_ROOT_OFFSET,
+             &table->indexes[j].root_page_num, sizeof(uint32_t));
+    }
+  }
+}
+
+memtable_node_t*
+memtable_node_new(
+  uint32_t  key,
+  uint32_t  level,
+  uint32_t  row_size
+)
+{
+  memtable_node_t* node = malloc(sizeof(memtable_node_t) + level * sizeof(memtable_node_t*) + row_size);
+  node->key   = key;
+  node->level = level;
+  node->row   = (uint8_t*)(node->next + level);
+  for (uint32_t i = 0; i < level; i++)
+  {
+    node->next[i] = NULL;
+  }
+  return node;
+}
+
+memtable_t*
+memtable_new(
+  uint32_t  row_size,
+  uint32_t  max_rows
+)
+{
+  memtable_t* memtable  = malloc(sizeof(memtable_t));
+  memtable->head        = memtable_node_new(0, MEMTABLE_MAX_LEVEL, 0);
+  memtable->level       = 1;
+  memtable->num_rows    = 0;
+  memtable->max_rows    = max_rows;
+  memtable->row_size    = row_size;
+  memtable->rng         = 0x9E3779B97F4A7C15ull;
+  return memtable;
+}
+
+/* Frees the rows, the list head stays */
+void
+memtable_clear(
+  memtable_t* memtable
+)
+{
+  memtable_node_t* node = memtable->head->next[0];
+  while (node != NULL)
+  {
+    memtable_node_t* next = node->next[0];
+    free(node);
+    node = next;
+  }
+  for (uint32_t i = 0; i < MEMTABLE_MAX_LEVEL; i++)
+  {
+    memtable->head->next[i] = NULL;
+  }
+  memtable->level     = 1;
+  memtable->num_rows  = 0;
+}
+
+void
+memtable_free(
+  memtable_t* memtable
+)
+{
+  memtable_clear(memtable);
+  free(memtable->head);
+  free(memtable);
+}
+
+/*
+ Fills update[] with the last node before key on every level
+ and returns the node holding key, or NULL.
+*/
+memtable_node_t*
+memtable_seek(
+  memtable_t*       memtable,
+  uint32_t          key,
+  memtable_node_t** update
+)
+{
+  memtable_node_t* node = memtable->head;
+  for (int32_t i = memtable->level - 1; i >= 0; i--)
+  {
+    while (node->next[i] != NULL && node->next[i]->key < key)
+    {
+      node = node->next[i];
+    }
+    if (update != NULL)
+    {
+      update[i] = node;
+    }
+  }
+  node = node->next[0];
+  return (node != NULL && node->key == key) ? node : NULL;
+}
+
+/* Returns false when the key is already buffered */
+bool
+memtable_insert(
+  memtable_t* memtable,
+  uint32_t    key,
+  const void* row
+)
+{
+  memtable_node_t* update[MEMTABLE_MAX_LEVEL];
+  if (memtable_seek(memtable, key, update) != NULL)
+  {
+    return false;
+  }
+
+  /* Each level up with probability 1/4, xorshift for the coin flips */
+  uint32_t level = 1;
+  memtable->rng ^= memtable->rng << 13;
+  memtable->rng ^= memtable->rng >> 7;
+  memtable->rng ^= memtable->rng << 17;
+  for (uint64_t bits = memtable->rng; level < MEMTABLE_MAX_LEVEL && (bits & 3) == 0; bits >>= 2)
+  {
+    level += 1;
+  }
+  for (uint32_t i = memtable->level; i < level; i++)
+  {
+    update[i] = memtable->head;
+  }
+  if (level > memtable->level)
+  {
+    memtable->level = level;
+  }
+
+  memtable_node_t* node = memtable_node_new(key, level, memtable->row_size);
+  memcpy(node->row, row, memtable->row_size);
+  for (uint32_t i = 0; i < level; i++)
+  {
+    node->next[i]      = update[i]->next[i];
+    update[i]->next[i] = node;
+  }
+  memtable->num_rows += 1;
+  return true;
+}
+
+/*
+ Primary key Bloom filter. The table's bloom root page holds a header and the list
+ of filter pages; the filter is split into 64-byte blocks and each key sets
+ BLOOM_NUM_PROBES bits in one block, so a probe reads a single filter page.
+ The root page never moves, so growing the filter only rewrites the root.
+*/
+uint64_t
+bloom_hash(
+  uint64_t  value
+)
+{
+  // splitmix64 finalizer
+  value += 0x9E3779B97F4A7C15ull;
+  value  = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+  value  = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+  return value ^ (value >> 31);
+}
+
+uint32_t*
+bloom_root_field(
+  void*     root,
+  uint32_t  offset
+)
+{
+  return root + offset;
+}
+
+uint32_t
+bloom_capacity(
+  uint32_t  num_pages
+)
+{
+  return num_pages * BLOOM_BLOCKS_PER_PAGE * BLOOM_BLOCK_SIZE * 8 / BLOOM_BITS_PER_KEY;
+}
+
+uint8_t*
+bloom_block(
+  table_t*  table,
+  uint64_t  hash
+)
+{
+  void*     root        = get_page(table->pager, table->bloom_root_page_num);
+  uint32_t  num_pages   = *bloom_root_field(root, BLOOM_NUM_PAGES_OFFSET);
+  uint32_t  per_page    = BLOOM_BLOCKS_PER_PAGE;
+  uint64_t  block       = hash % ((uint64_t)num_pages * per_page);
+  uint32_t  page_num    = *bloom_root_field(root, BLOOM_PAGES_OFFSET + (block / per_page) * sizeof(uint32_t));
+  return (uint8_t*)get_page(table->pager, page_num) + (block % per_page) * BLOOM_BLOCK_SIZE;
+}
+
+void
+bloom_set(
+  table_t*  table,
+  uint32_t  key
+)
+{
+  uint64_t  hash  = bloom_hash(key);
+  uint8_t*  block = bloom_block(table, hash);
+  uint64_t  bits  = bloom_hash(hash);
+  for (uint32_t i = 0; i < BLOOM_NUM_PROBES; i++, bits >>= 9)
+  {
+    block[(bits & 511) / 8] |= 1 << (bits & 7);
+  }
+}
+
+bool
+bloom_test(
+  table_t*  table,
+  uint32_t  key
+)
+{
+  uint64_t  hash  = bloom_hash(key);
+  uint8_t*  block = bloom_block(table, hash);
+  uint64_t  bits  = bloom_hash(hash);
+  for (uint32_t i = 0; i < BLOOM_NUM_PROBES; i++, bits >>= 9)
+  {
+    if (!(block[(bits & 511) / 8] & (1 << (bits & 7))))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Allocate the root page of a new table's filter, it is filled on first use */
+void
+table_attach_bloom(
+  table_t*  table
+)
+{
+  table->bloom_root_page_num = get_unused_page_num(table->pager);
+  void* root = get_page(table->pager, table->bloom_root_page_num);
+  memset(root, 0, PAGE_SIZE);
+  *bloom_root_field(root, BLOOM_MAGIC_OFFSET) = BLOOM_MAGIC;
+}
+
+/*
+ (Re)build the filter from every key in the tree and the write buffer, sized for
+ twice the current number of keys. Filter pages are reused and never given back.
+*/
+void
+bloom_rebuild(
+  table_t*  table
+)
+{
+  uint32_t  num_keys  = node_row_count(get_page(table->pager, table->root_page_num)) +
+                        (table->memtable ? table->memtable->num_rows : 0);
+  uint32_t  per_page  = bloom_capacity(1);
+  uint32_t  wanted    = (2 * num_keys + per_page - 1) / per_page;
+  if (wanted == 0)
+  {
+    wanted = 1;
+  }
+  if (wanted > BLOOM_MAX_PAGES)
+  {
+    wanted = BLOOM_MAX_PAGES;
+  }
+
+  void*     root      = get_page(table->pager, table->bloom_root_page_num);
+  uint32_t  num_pages = *bloom_root_field(root, BLOOM_NUM_PAGES_OFFSET);
+  if (wanted < num_pages)
+  {
+    wanted = num_pages;
+  }
+  for (uint32_t i = 0; i < wanted; i++)
+  {
+    uint32_t* slot = bloom_root_field(root, BLOOM_PAGES_OFFSET + i * sizeof(uint32_t));
+    if (i >= num_pages)
+    {
+      *slot = get_unused_page_num(table->pager);
+    }
+    memset(get_page(table->pager, *slot), 0, PAGE_SIZE);
+  }
+  *bloom_root_field(root, BLOOM_NUM_PAGES_OFFSET) = wanted;
+  *bloom_root_field(root, BLOOM_NUM_KEYS_OFFSET) = num_keys;
+  table->pager->stats.bloom_rebuilds += 1;
+
+  cursor_t* cursor = table_start(table);
+  while (!(cursor->end_of_table))
+  {
+    bloom_set(table, *leaf_node_key(get_page(table->pager, cursor->page_num), cursor->cell_num));
+    cursor_advance(cursor);
+  }
+  free(cursor);
+  if (table->memtable != NULL)
+  {
+    for (memtable_node_t* node = table->memtable->head->next[0]; node != NULL; node = node->next[0])
+    {
+      bloom_set(table, node->key);
+    }
+  }
+}
+
+/* False only when the key is certainly not in the table */
+bool
+table_may_contain(
+  table_t*  table,
+  uint32_t  key
+)
+{
+  if (table->bloom_root_page_num == 0)
+  {
+    return true;
+  }
+  void* root = get_page(table->pager, table->bloom_root_page_num);
+  if (*bloom_root_field(root, BLOOM_NUM_PAGES_OFFSET) == 0)
+  {
+    bloom_rebuild(table);
+  }
+  if (bloom_test(table, key))
+  {
+    return true;
+  }
+  table->pager->stats.bloom_skips += 1;
+  return false;
+}
+
+/* Record a key just added to the table, growing the filter when it is over capacity */
+void
+table_bloom_add(
+  table_t*  table,
+  uint32_t  key
+)
+{
+  if (table->bloom_root_page_num == 0)
+  {
+    return;
+  }
+  void*     root      = get_page(table->pager, table->bloom_root_page_num);
+  uint32_t  num_pages = *bloom_root_field(root, BLOOM_NUM_PAGES_OFFSET);
+  if (num_pages == 0)
+  {
+    // The rebuild sees the new key in the tree or the buffer
+    bloom_rebuild(table);
+    return;
+  }
+  bloom_set(table, key);
+  uint32_t* num_keys = bloom_root_field(root, BLOOM_NUM_KEYS_OFFSET);
+  *num_keys += 1;
+  if (*num_keys > bloom_capacity(num_pages) && num_pages < BLOOM_MAX_PAGES)
+  {
+    bloom_rebuild(table);
+  }
+}
+
+table_t*
+table_new(
+  database_t*   database,
+  const char*   name,
+  schema_t*     schema
+)
+{
+  table_t* table        = malloc(sizeof(table_t));
+  table->pager          = database->pager;
+  table->root_page_num  = 0;
+  table->rightmost_leaf = INVALID_PAGE_NUM;
+  table->schema         = *schema;
+  table->memtable       = NULL;
+  table->bloom_root_page_num = 0;
+  memset(table->overflow_values, 0, sizeof(table->overflow_values));
+  table->leaf_layout    = LEAF_LAYOUT_ROWS;
+  if (database->memtable_rows > 0)
+  {
+    table->memtable = memtable_new(schema->row_size, database->memtable_rows);
+  }
+  // A catalog entry may fill all of its bytes without a terminator
+  snprintf(table->name, sizeof(table->name), "%.*s", TABLE_NAME_SIZE - 1, name);
+  for (uint32_t i = 0; i < TABLE_MAX_COLUMNS; i++)
+  {
+    table->indexes[i].column        = i;
+    table->indexes[i].key_size      = (i < schema->num_columns) ? schema->columns[i].size : 0;
+    table->indexes[i].root_page_num = 0;
+  }
+  database->tables[database->num_tables++] = table;
+  return table;
+}
+
+/* Loads the tables, returns the file's format version */
+uint32_t
+catalog_load(
+  database_t*   database
+)
+{
+  uint32_t  magic;
+  uint32_t  version;
+  uint32_t  num_tables;
+  void*     catalog = get_page(database->pager, CATALOG_PAGE_NUM);
+
+  memcpy(&magic, catalog + CATALOG_MAGIC_OFFSET, CATALOG_MAGIC_SIZE);
+  if (magic != CATALOG_MAGIC)
+  {
+    printf("Db file has no valid catalog. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&version, catalog + CATALOG_VERSION_OFFSET, sizeof(uint32_t));
+  if (version > CATALOG_FORMAT_VERSION)
+  {
+    printf("Db file format version %u is newer than this build reads (%u).\n", version, CATALOG_FORMAT_VERSION);
+    exit(EXIT_FAILURE);
+  }
+  if (version >= CATALOG_CHECKSUM_VERSION)
+  {
+    // Page 0 was read before the version was known
+    database->pager->checksums = true;
+    pager_verify_page(database->pager, CATALOG_PAGE_NUM, catalog);
+  }
+  memcpy(&num_tables, catalog + CATALOG_NUM_TABLES_OFFSET, CATALOG_NUM_TABLES_SIZE);
+
+  // Files with checksums have the current layout, saving the catalog stamps the version
+  bool needs_save = version != CATALOG_FORMAT_VERSION;
+  for (uint32_t i = 0; i < num_tables; i++)
+  {
+    void*     entry = catalog + CATALOG_HEADER_SIZE + i * CATALOG_TABLE_ENTRY_SIZE;
+    char      name[TABLE_NAME_SIZE];
+    uint32_t  num_columns;
+    schema_t  schema = { 0 };
+    uint32_t  index_roots[TABLE_MAX_COLUMNS];
+
+    memcpy(name, entry + CATALOG_TABLE_NAME_OFFSET, TABLE_NAME_SIZE);
+    memcpy(&num_columns, entry + CATALOG_TABLE_NUM_COLUMNS_OFFSET, sizeof(uint32_t));
+    for (uint32_t j = 0; j < num_columns; j++)
+    {
+      void*     column_entry = entry + CATALOG_TABLE_COLUMNS_OFFSET + j * CATALOG_COLUMN_ENTRY_SIZE;
+      char      column_name[COLUMN_NAME_SIZE];
+      uint32_t  type;
+      uint32_t  size;
+
+      memcpy(column_name, column_entry + CATALOG_COLUMN_NAME_OFFSET, COLUMN_NAME_SIZE);
+      memcpy(&type, column_entry + CATALOG_COLUMN_TYPE_OFFSET, sizeof(uint32_t));
+      memcpy(&size, column_entry + CATALOG_COLUMN_SIZE_OFFSET, sizeof(uint32_t));
+      memcpy(&index_roots[j], column_entry + CATALOG_COLUMN_INDEX_ROOT_OFFSET, sizeof(uint32_t));
+      schema_add_column(&schema, column_name, type, size);
+    }
+
+    table_t* table = table_new(database, name, &schema);
+    memcpy(&table->root_page_num, entry + CATALOG_TABLE_ROOT_PAGE_OFFSET, sizeof(uint32_t));
+    for (uint32_t j = 0; j < num_columns; j++)
+    {
+      table->indexes[j].root_page_num = index_roots[j];
+    }
+    catalog = get_page(database->pager, CATALOG_PAGE_NUM);
+    memcpy(&table->bloom_root_page_num, catalog + CATALOG_BLOOM_ROOTS_OFFSET + i * sizeof(uint32_t),
+           sizeof(uint32_t));
+    table->leaf_layout = *((uint8_t*)catalog + CATALOG_LEAF_LAYOUTS_OFFSET + i);
+    if (table->bloom_root_page_num == 0)
+    {
+      // Files written before the filter existed get one, built on first use
+      table_attach_bloom(table);
+      needs_save = true;
+    }
+  }
+  if (needs_save && version >= CATALOG_CHECKSUM_VERSION)
+  {
+    catalog_save(database);
+  }
+  return version;
+}
+
+table_t*
+database_find_table(
+  database_t*   database,
+  const char*   name
+)
+{
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    if (strcmp(database->tables[i]->name, name) == 0)
+    {
+      return database->tables[i];
+    }
+  }
+  return NULL;
+}
+
+void
+print_tables(
+  database_t*   database
+)
+{
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    schema_t* schema = &(database->tables[i]->schema);
+    printf("%s (", database->tables[i]->name);
+    for (uint32_t j = 0; j < schema->num_columns; j++)
+    {
+      column_t* column = &(schema->columns[j]);
+      if (column->type == COLUMN_TYPE_INT)
+      {
+        printf("%s%s int", j ? ", " : "", column->name);
+      }
+      else
+      {
+        printf("%s%s text(%d)", j ? ", " : "", column->name, column->max_size - 1);
+      }
+    }
+    printf(")\n");
+  }
+}
+
+execute_result_e
+execute_create_table(
+  statement_t*  statement,
+  database_t*   database
+)
+{
+  schema_t* schema = &(statement->schema);
+
+  if (database_find_table(database, statement->table_name) != NULL)
+  {
+    return EXECUTE_DUPLICATE_TABLE;
+  }
+  if (database->num_tables == DB_MAX_TABLES)
+  {
+    return EXECUTE_CATALOG_FULL;
+  }
+  /* A split needs at least three cells per leaf */
+  if (LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_KEY_SIZE + schema->row_size) < 3)
+  {
+    return EXECUTE_ROW_TOO_LARGE;
+  }
+
+  table_t* table        = table_new(database, statement->table_name, schema);
+  table->root_page_num  = get_unused_page_num(database->pager);
+  void*    root_node    = get_page(database->pager, table->root_page_num);
+  initialize_table_leaf_node(root_node, schema, table->leaf_layout);
+  set_node_root(root_node, true);
+  table_attach_bloom(table);
+
+  catalog_save(database);
+  return EXECUTE_SUCCESS;
+}
+
+execute_result_e
+execute_create_index(
+  statement_t*  statement,
+  database_t*   database,
+  table_t*      table
+)
+{
+  uint32_t column;
+  table_flush_write_buffer(table);
+  if (!schema_find_column(&(table->schema), statement->index_column, &column))
+  {
+    return EXECUTE_COLUMN_NOT_FOUND;
+  }
+  if (table->schema.columns[column].type != COLUMN_TYPE_TEXT)
+  {
+    return EXECUTE_TYPE_MISMATCH;
+  }
+
+  index_t* index = &(table->indexes[column]);
+  if(index->root_page_num != 0)
+  {
+    return EXECUTE_DUPLICATE_INDEX;
+  }
+
+  index->root_page_num = get_unused_page_num(table->pager);
+  void* root = get_page(table->pager, index->root_page_num);
+  // Index leaves size their cells from the index, not from the header
+  initialize_leaf_node(root, 0);
+  set_node_root(root, true);
+
+  /* Backfill from the existing rows */
+  cursor_t* cursor = table_start(table);
+  while (!(cursor->end_of_table))
+  {
+    row_view_t view = row_view_at(cursor);
+    table_index_row(table, index, &view);
+    cursor_advance(cursor);
+  }
+  free(cursor);
+
+  catalog_save(database);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ Cursor past the last cell of the rightmost leaf, without descending from the root,
+ when the key is larger than every key in the table. NULL when the hint does not apply:
+ the hinted leaf has since split (next_leaf set) or become internal, or the key is not
+ an append.
+*/
+cursor_t*
+table_append_cursor(
+  table_t*  table,
+  uint32_t  key
+)
+{
+  if(table->rightmost_leaf == INVALID_PAGE_NUM)
+  {
+    return NULL;
+  }
+  void*     node      = get_page(table->pager, table->rightmost_leaf);
+  if(get_node_type(node) != NODE_LEAF || *leaf_node_next_leaf(node) != 0)
+  {
+    return NULL;
+  }
+  uint32_t  num_cells = *leaf_node_num_cells(node);
+  if(num_cells == 0 || key <= *leaf_node_key(node, num_cells - 1))
+  {
+    return NULL;
+  }
+
+  cursor_t* cursor      = malloc(sizeof(cursor_t));
+  cursor->table         = table;
+  cursor->page_num      = table->rightmost_leaf;
+  cursor->cell_num      = num_cells;
+  cursor->end_of_table  = true;
+  table->pager->stats.cursors_allocated += 1;
+  table->pager->stats.fast_appends      += 1;
+  return cursor;
+}
+
+/* Insert a serialized row into the B+tree itself */
+execute_result_e
+table_tree_insert(
+  table_t*      table,
+  void*         row
+)
+{
+  pager_release_pages(table->pager);
+
+  row_view_t view = row_view_of(table, row);
+
+  uint32_t  key_to_insert = row_view_id(&view);
+  cursor_t* cursor        = table_append_cursor(table, key_to_insert);
+  if(cursor == NULL)
+  {
+    table->pager->stats.point_seeks += 1;
+    cursor = table_find(table, key_to_insert);
+  }
+  // The leaf the key belongs in, not necessarily the root
+  void*     node          = get_page(table->pager, cursor->page_num);
+  if(*leaf_node_next_leaf(node) == 0)
+  {
+    table->rightmost_leaf = cursor->page_num;
+  }
+  uint32_t  num_cells     = (*leaf_node_num_cells(node));
+  if(cursor->cell_num < num_cells)
+  {
+    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+    if(key_at_index == key_to_insert)
+    {
+      free(cursor);
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+  increment_ancestor_row_counts(table->pager, cursor->page_num);
+  leaf_node_insert(cursor, key_to_insert, row);
+  free(cursor);
+
+  for (uint32_t i = 0; i < table->schema.num_columns; i++)
+  {
+    if(table->indexes[i].root_page_num != 0)
+    {
+      table_index_row(table, &(table->indexes[i]), &view);
+    }
+  }
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ Merge sorted rows, rows[0] first, into the leaf the first one belongs in,
+ with one descent and one pass over the leaf, as long as they fit without a split.
+ A later row belongs in the same leaf while its key is below the leaf's last key, or
+ always for the rightmost leaf. None of the keys may be in the tree already.
+ Returns how many rows were merged.
+*/
+uint32_t
+table_merge_into_leaf(
+  table_t*  table,
+  void**    rows,
+  uint32_t  count
+)
+{
+  pager_release_pages(table->pager);
+
+  row_view_t first  = row_view_of(table, rows[0]);
+  cursor_t*  cursor = table_append_cursor(table, row_view_id(&first));
+  if (cursor == NULL)
+  {
+    table->pager->stats.point_seeks += 1;
+    cursor = table_find(table, row_view_id(&first));
+  }
+  uint32_t  page_num    = cursor->page_num;
+  free(cursor);
+
+  void*     node        = get_page(table->pager, page_num);
+  uint32_t  num_cells   = *leaf_node_num_cells(node);
+  uint32_t  room        = leaf_node_max_cells(node) - num_cells;
+  bool      rightmost   = *leaf_node_next_leaf(node) == 0;
+  uint32_t  last_key    = num_cells > 0 ? *leaf_node_key(node, num_cells - 1) : 0;
+
+  uint32_t  run_keys[PAGE_SIZE / LEAF_NODE_KEY_SIZE];
+  uint32_t  run_length  = 0;
+  while (run_length < count && run_length < room)
+  {
+    row_view_t view = row_view_of(table, rows[run_length]);
+    uint32_t   key  = row_view_id(&view);
+    if (!rightmost && key >= last_key)
+    {
+      break;
+    }
+    run_keys[run_length++] = key;
+  }
+  if (run_length == 0)
+  {
+    // Full leaf, let the regular insert split it
+    table_tree_insert(table, rows[0]);
+    return 1;
+  }
+
+  /* Merge from the back so every cell moves at most once */
+  int32_t   old_cell    = num_cells - 1;
+  int32_t   new_row     = run_length - 1;
+  for (int32_t destination = num_cells + run_length - 1; new_row >= 0; destination--)
+  {
+    if (old_cell >= 0 && *leaf_node_key(node, old_cell) > run_keys[new_row])
+    {
+      leaf_node_copy_cell(node, destination, node, old_cell);
+      old_cell -= 1;
+    }
+    else
+    {
+      leaf_node_write_row(node, destination, run_keys[new_row], rows[new_row]);
+      new_row -= 1;
+    }
+  }
+  *leaf_node_num_cells(node) = num_cells + run_length;
+  add_ancestor_row_counts(table->pager, page_num, run_length);
+  if (rightmost)
+  {
+    table->rightmost_leaf = page_num;
+  }
+
+  for (uint32_t i = 0; i < run_length; i++)
+  {
+    row_view_t view = row_view_of(table, rows[i]);
+    for (uint32_t column = 0; column < table->schema.num_columns; column++)
+    {
+      if (table->indexes[column].root_page_num != 0)
+      {
+        table_index_row(table, &(table->indexes[column]), &view);
+      }
+    }
+  }
+  return run_length;
+}
+
+/* Insert rows sorted by key and absent from the tree, touching each leaf once */
+void
+table_insert_sorted(
+  table_t*  table,
+  void**    rows,
+  uint32_t  count
+)
+{
+  uint32_t merged = 0;
+  while (merged < count)
+  {
+    merged += table_merge_into_leaf(table, rows + merged, count - merged);
+  }
+}
+
+/* Drain the write buffer into the tree in key order */
+void
+table_flush_write_buffer(
+  table_t*  table
+)
+{
+  if (table->memtable == NULL || table->memtable->num_rows == 0)
+  {
+    return;
+  }
+  void**            rows  = malloc(table->memtable->num_rows * sizeof(void*));
+  uint32_t          count = 0;
+  memtable_node_t*  node  = table->memtable->head->next[0];
+  while (node != NULL)
+  {
+    rows[count++] = node->row;
+    node          = node->next[0];
+  }
+  table_insert_sorted(table, rows, count);
+  free(rows);
+  memtable_clear(table->memtable);
+  table->pager->stats.buffer_flushes += 1;
+}
+
+/* Turns write buffering on (rows > 0) or off for every table, draining what is buffered */
+void
+database_set_write_buffer(
+  database_t* database,
+  uint32_t    rows
+)
+{
+  database->memtable_rows = rows;
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    table_t* table = database->tables[i];
+    if (table->memtable != NULL)
+    {
+      table_flush_write_buffer(table);
+      memtable_free(table->memtable);
+      table->memtable = NULL;
+    }
+    if (rows > 0)
+    {
+      table->memtable = memtable_new(table->schema.row_size, rows);
+    }
+  }
+}
+
+/*
+ * VACUUM: every table is copied into a new file next to the database, leaves
+ * packed and laid out in key order on consecutive pages, with the internal levels
+ * built bottom up after them. The new file is synced and renamed over the old one,
+ * then replaces the pager underneath the open tables.
+ */
+typedef struct vacuum_child_struct
+{
+  uint32_t  page_num;
+  uint32_t  max_key;
+  uint32_t  num_rows;
+} vacuum_child_t;
+
+/* Internal levels over children, fanned out as evenly as possible, returns the root */
+uint32_t
+vacuum_build_internal(
+  pager_t*        pager,
+  vacuum_child_t* children,
+  uint32_t        count
+)
+{
+  while (count > 1)
+  {
+    // ceil(count / fan-out) nodes never leave one with a single child
+    uint32_t max_children = INTERNAL_NODE_MAX_CELLS + 1;
+    uint32_t num_nodes    = (count + max_children - 1) / max_children;
+    for (uint32_t n = 0; n < num_nodes; n++)
+    {
+      uint32_t  first     = (uint64_t)count * n / num_nodes;
+      uint32_t  last      = (uint64_t)count * (n + 1) / num_nodes;
+      uint32_t  page_num  = get_unused_page_num(pager);
+      void*     node      = get_page(pager, page_num);
+      uint32_t  num_rows  = 0;
+
+      initialize_internal_node(node);
+      *internal_node_num_keys(node) = last - first - 1;
+      for (uint32_t i = first; i < last; i++)
+      {
+        if (i + 1 < last)
+        {
+          *internal_node_child(node, i - first) = children[i].page_num;
+          *internal_node_key(node, i - first)   = children[i].max_key;
+        }
+        else
+        {
+          *internal_node_right_child(node) = children[i].page_num;
+        }
+        *node_parent(get_page(pager, children[i].page_num)) = page_num;
+        num_rows += children[i].num_rows;
+      }
+      *internal_node_row_count(node) = num_rows;
+
+      vacuum_child_t parent = { page_num, children[last - 1].max_key, num_rows };
+      children[n]           = parent;
+      pager_release_pages(pager);
+    }
+    count = num_nodes;
+  }
+  return children[0].page_num;
+}
+
+/* Copies the overflow text of a cell just moved into the new file, the slots point into the old one */
+void
+vacuum_move_overflow(
+  table_t*  source,
+  pager_t*  pager,
+  void*     leaf,
+  uint32_t  cell_num
+)
+{
+  uint8_t     row[PAGE_SIZE];
+  schema_t*   schema  = &(source->schema);
+  leaf_node_read_row(leaf, cell_num, row);
+  row_view_t  view    = row_view_of(source, row);
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    uint8_t* slot = row + schema->columns[i].offset;
+    if (schema->columns[i].type == COLUMN_TYPE_OVERFLOW_TEXT && overflow_slot_page(slot) != 0)
+    {
+      overflow_store(pager, row_view_text(&view, i), overflow_slot_length(slot), slot, 0);
+    }
+  }
+  leaf_node_write_row(leaf, cell_num, *leaf_node_key(leaf, cell_num), row);
+}
+
+/* The source table's rows as a packed tree in pager, returns the root page */
+uint32_t
+vacuum_build_tree(
+  table_t*  source,
+  pager_t*  pager,
+  uint32_t  fill_percent
+)
+{
+  uint32_t        capacity  = 64;
+  uint32_t        count     = 0;
+  vacuum_child_t* leaves    = malloc(capacity * sizeof(vacuum_child_t));
+  void*           leaf      = NULL;
+  uint32_t        fill      = 0;
+
+  cursor_t* cursor = table_start(source);
+  while (leaf == NULL || !(cursor->end_of_table))
+  {
+    if (leaf == NULL || *leaf_node_num_cells(leaf) == fill)
+    {
+      uint32_t page_num = get_unused_page_num(pager);
+      if (leaf != NULL)
+      {
+        *leaf_node_next_leaf(leaf) = page_num;
+      }
+      pager_release_pages(pager);
+      leaf = get_page(pager, page_num);
+      initialize_table_leaf_node(leaf, &(source->schema), source->leaf_layout);
+      fill = leaf_node_max_cells(leaf) * fill_percent / 100;
+      fill = fill > 0 ? fill : 1;
+      if (count == capacity)
+      {
+        capacity *= 2;
+        leaves    = realloc(leaves, capacity * sizeof(vacuum_child_t));
+      }
+      vacuum_child_t child  = { page_num, 0, 0 };
+      leaves[count++]       = child;
+      if (cursor->end_of_table)
+      {
+        break;  // the empty table's only leaf
+      }
+    }
+
+    void*     node        = get_page(source->pager, cursor->page_num);
+    uint32_t  num_cells   = *leaf_node_num_cells(leaf);
+    leaf_node_copy_cell(leaf, num_cells, node, cursor->cell_num);
+    if (schema_has_overflow(&(source->schema)))
+    {
+      vacuum_move_overflow(source, pager, leaf, num_cells);
+    }
+    *leaf_node_num_cells(leaf)  = num_cells + 1;
+    leaves[count - 1].max_key   = *leaf_node_key(node, cursor->cell_num);
+    leaves[count - 1].num_rows += 1;
+    cursor_advance(cursor);
+  }
+  free(cursor);
+
+  uint32_t root_page_num = vacuum_build_internal(pager, leaves, count);
+  set_node_root(get_page(pager, root_page_num), true);
+  free(leaves);
+  return root_page_num;
+}
+
+/* fsync the directory holding path, so a rename in it is durable */
+void
+vacuum_sync_directory(
+  const char* path
+)
+{
+  char        directory[PATH_MAX];
+  const char* slash = strrchr(path, '/');
+  if (slash == NULL)
+  {
+    strcpy(directory, ".");
+  }
+  else
+  {
+    snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path + 1), path);
+  }
+  int fd = open(directory, O_RDONLY);
+  if (fd != -1)
+  {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/*
+ Rewrites the database file with every table's leaves fill_percent full and in key
+ order, atomically: until the rename the old file is untouched. Indexes are rebuilt
+ after the tables and the Bloom filters after those, sized for the rows copied.
+*/
+execute_result_e
+database_vacuum(
+  database_t* database,
+  uint32_t    fill_percent,
+  bool        compressed
+)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.vacuum", database->filename);
+  unlink(path);
+
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    table_flush_write_buffer(database->tables[i]);
+  }
+
+  pager_t*    pager   = pager_open(path);
+  table_t*    tables  = malloc(database->num_tables * sizeof(table_t));
+  if (compressed)
+  {
+    pager->page_map   = page_map_new();
+  }
+  database_t  rebuilt = *database;
+  rebuilt.pager       = pager;
+
+  // Page 0 stays the catalog
+  get_page(pager, CATALOG_PAGE_NUM);
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    table_t* table          = &tables[i];
+    *table                  = *(database->tables[i]);
+    table->pager            = pager;
+    table->memtable         = NULL;
+    table->rightmost_leaf   = INVALID_PAGE_NUM;
+    memset(table->overflow_values, 0, sizeof(table->overflow_values));
+    table->root_page_num    = vacuum_build_tree(database->tables[i], pager, fill_percent);
+    rebuilt.tables[i]       = table;
+  }
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    table_t* table = &tables[i];
+    for (uint32_t j = 0; j < table->schema.num_columns; j++)
+    {
+      index_t* index = &(table->indexes[j]);
+      if (index->root_page_num == 0)
+      {
+        continue;
+      }
+      pager_release_pages(pager);
+      index->root_page_num = get_unused_page_num(pager);
+      void* root = get_page(pager, index->root_page_num);
+      initialize_leaf_node(root, 0);
+      set_node_root(root, true);
+
+      cursor_t* cursor = table_start(table);
+      while (!(cursor->end_of_table))
+      {
+        row_view_t view = row_view_at(cursor);
+        table_index_row(table, index, &view);
+        cursor_advance(cursor);
+      }
+      free(cursor);
+    }
+    table_attach_bloom(table);
+    bloom_rebuild(table);
+  }
+  catalog_save(&rebuilt);
+
+  bool failed = false;
+  pager_flush_all(pager);
+  if (fsync(pager->file_descriptor) == -1 || rename(path, database->filename) == -1)
+  {
+    failed = true;
+  }
+
+  // The pager not kept is dropped without writing any of its pages
+  pager_t* kept     = failed ? database->pager : pager;
+  pager_t* dropped  = failed ? pager : database->pager;
+  if (failed)
+  {
+    unlink(path);
+  }
+  else
+  {
+    vacuum_sync_directory(database->filename);
+    for (uint32_t i = 0; i < database->num_tables; i++)
+    {
+      table_t* table              = database->tables[i];
+      table->root_page_num        = tables[i].root_page_num;
+      table->rightmost_leaf       = INVALID_PAGE_NUM;
+      table->bloom_root_page_num  = tables[i].bloom_root_page_num;
+      memcpy(table->indexes, tables[i].indexes, sizeof(table->indexes));
+    }
+  }
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+  {
+    free(dropped->pages[i]);
+    free(dropped->clean_copies[i]);
+    dropped->pages[i]         = NULL;
+    dropped->clean_copies[i]  = NULL;
+  }
+  close(dropped->file_descriptor);
+  page_map_destroy(dropped->page_map);
+  free(dropped->warm_pages);
+
+  // Tables hold the pager's address, so the new state moves into the old struct
+  db_stats_t stats              = database->pager->stats;
+  stats.pages_written          += pager->stats.pages_written;
+  stats.pages_read             += pager->stats.pages_read;
+  stats.bytes_written          += pager->stats.bytes_written;
+  stats.bytes_read             += pager->stats.bytes_read;
+  stats.overflow_pages_written += pager->stats.overflow_pages_written;
+  *(database->pager)            = *kept;
+  database->pager->stats        = stats;
+  free(pager);
+  free(tables);
+  return failed ? EXECUTE_WRITE_ERROR : EXECUTE_SUCCESS;
+}
+
+/*
+ * CHECK: the file is read back by several threads with pager_read_page(), next to
+ * the pager's cache rather than through it. First every page's checksum, in ranges of pages; then
+ * every table and index tree, a tree per thread at a time, for key order within
+ * and across nodes, root flags, parent pointers, row counts and the leaf chain.
+ */
+typedef struct check_tree_struct
+{
+  table_t*  table;
+  index_t*  index;          // NULL for the table's own tree
+  uint32_t  root_page_num;
+  char      name[TABLE_NAME_SIZE + COLUMN_NAME_SIZE + 1];
+} check_tree_t;
+
+typedef struct check_struct
+{
+  pager_t*          pager;
+  uint32_t          num_pages;
+  uint32_t          num_threads;
+  check_tree_t      trees[DB_MAX_TABLES * (TABLE_MAX_COLUMNS + 1)];
+  uint32_t          num_trees;
+  uint32_t          next_tree;
+  uint64_t          errors;
+  pthread_mutex_t   lock;
+} check_t;
+
+typedef struct check_range_struct
+{
+  check_t*  check;
+  uint32_t  first_page;
+  uint32_t  end_page;
+} check_range_t;
+
+typedef struct check_walk_struct
+{
+  check_t*      check;
+  check_tree_t* tree;
+  bool          seen_leaf;
+  uint32_t      next_leaf;    // next_leaf of the last leaf visited
+  uint8_t*      pages;        // one page buffer per level, CHECK_MAX_DEPTH of them, then one for overflow
+} check_walk_t;
+
+void
+check_error(
+  check_t*    check,
+  const char* format,
+  ...
+)
+{
+  pthread_mutex_lock(&(check->lock));
+  check->errors += 1;
+  if (check->errors <= CHECK_MAX_REPORTED)
+  {
+    va_list arguments;
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+  }
+  pthread_mutex_unlock(&(check->lock));
+}
+
+/* Thread body for checksums, CHECK_READ_PAGES at a time */
+void*
+check_pages(
+  void* argument
+)
+{
+  check_range_t*  range   = argument;
+  check_t*        check   = range->check;
+  uint8_t*        buffer  = malloc(CHECK_READ_PAGES * PAGE_SIZE);
+
+  for (uint32_t page_num = range->first_page; page_num < range->end_page; page_num += CHECK_READ_PAGES)
+  {
+    uint32_t  count = range->end_page - page_num < CHECK_READ_PAGES ? range->end_page - page_num : CHECK_READ_PAGES;
+    bool      readable[CHECK_READ_PAGES];
+    if (check->pager->page_map == NULL)
+    {
+      ssize_t bytes = pread(check->pager->file_descriptor, buffer, (size_t)count * PAGE_SIZE,
+                            pager_page_offset(page_num));
+      for (uint32_t i = 0; i < count; i++)
+      {
+        readable[i] = bytes >= (ssize_t)(i + 1) * PAGE_SIZE;
+      }
+    }
+    else
+    {
+      // Compressed pages have no fixed place in the file, they are read one by one
+      for (uint32_t i = 0; i < count; i++)
+      {
+        readable[i] = pager_read_page(check->pager, page_num + i, buffer + (size_t)i * PAGE_SIZE) == PAGE_SIZE;
+      }
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+      if (!readable[i])
+      {
+        check_error(check, "Page %u: could not be read.\n", page_num + i);
+      }
+      else if (!page_checksum_valid(buffer + (size_t)i * PAGE_SIZE))
+      {
+        check_error(check, "Page %u: checksum mismatch.\n", page_num + i);
+      }
+    }
+  }
+  free(buffer);
+  return NULL;
+}
+
+int
+check_compare(
+  check_tree_t* tree,
+  const void*   a,
+  const void*   b
+)
+{
+  if (tree->index != NULL)
+  {
+    return index_entry_compare(tree->index, a, b);
+  }
+  uint32_t a_key;
+  uint32_t b_key;
+  memcpy(&a_key, a, sizeof(uint32_t));
+  memcpy(&b_key, b, sizeof(uint32_t));
+  return (a_key > b_key) - (a_key < b_key);
+}
+
+/* A key must be above lower and at most upper, NULL bounds are open */
+bool
+check_in_bounds(
+  check_tree_t* tree,
+  const void*   key,
+  const void*   lower,
+  const void*   upper
+)
+{
+  return (lower == NULL || check_compare(tree, key, lower) > 0) &&
+         (upper == NULL || check_compare(tree, key, upper) <= 0);
+}
+
+uint32_t check_node(check_walk_t* walk, uint32_t page_num, uint32_t parent_page_num,
+                    const void* lower, const void* upper, uint32_t depth);
+
+/* Follows the overflow chain of a text slot, its pages must hold the rest of the value */
+void
+check_overflow(
+  check_walk_t*   walk,
+  uint32_t        page_num,
+  uint32_t        cell_num,
+  const uint8_t*  slot
+)
+{
+  check_tree_t* tree      = walk->tree;
+  uint8_t*      node      = walk->pages + (size_t)CHECK_MAX_DEPTH * PAGE_SIZE;
+  uint32_t      length    = overflow_slot_length(slot);
+  uint32_t      next      = overflow_slot_page(slot);
+  uint32_t      stored    = length < OVERFLOW_SLOT_PREFIX_SIZE ? length : OVERFLOW_SLOT_PREFIX_SIZE;
+  uint32_t      hops      = 0;
+  while (next != 0)
+  {
+    if (next == CATALOG_PAGE_NUM || next >= walk->check->num_pages || hops++ == walk->check->num_pages)
+    {
+      check_error(walk->check, "%s: page %u: cell %u has a bad overflow pointer %u.\n", tree->name, page_num,
+                  cell_num, next);
+      return;
+    }
+    ssize_t bytes = pager_read_page(walk->check->pager, next, node);
+    if (bytes != PAGE_SIZE || !page_checksum_valid(node))
+    {
+      return;  // reported by check_pages()
+    }
+    if (get_node_type(node) != NODE_OVERFLOW)
+    {
+      check_error(walk->check, "%s: page %u: cell %u overflows into page %u, not an overflow page.\n",
+                  tree->name, page_num, cell_num, next);
+      return;
+    }
+    stored += *overflow_node_length(node);
+    next    = *overflow_node_next_page(node);
+  }
+  if (stored != length)
+  {
+    check_error(walk->check, "%s: page %u: cell %u holds %u of its %u text bytes.\n", tree->name, page_num,
+                cell_num, stored, length);
+  }
+}
+
+uint32_t
+check_leaf(
+  check_walk_t* walk,
+  uint32_t      page_num,
+  void*         node,
+  const void*   lower,
+  const void*   upper,
+  uint32_t      depth
+)
+{
+  check_tree_t* tree      = walk->tree;
+  uint32_t      num_cells = *leaf_node_num_cells(node);
+  if (tree->index == NULL && *leaf_node_value_size(node) != tree->table->schema.row_size)
+  {
+    check_error(walk->check, "%s: page %u: leaf cells of %u bytes, rows have %u.\n", tree->name, page_num,
+                *leaf_node_value_size(node), tree->table->schema.row_size);
+    return 0;
+  }
+  if (tree->index == NULL && *leaf_node_layout(node) != tree->table->leaf_layout)
+  {
+    check_error(walk->check, "%s: page %u: leaf layout %u, the table uses %u.\n", tree->name, page_num,
+                *leaf_node_layout(node), tree->table->leaf_layout);
+    return 0;
+  }
+  if (tree->index == NULL && leaf_node_is_pax(node))
+  {
+    schema_t* schema = &(tree->table->schema);
+    bool      widths = *leaf_node_pax_num_columns(node) == schema->num_columns;
+    for (uint32_t i = 0; widths && i < schema->num_columns; i++)
+    {
+      widths = *leaf_node_pax_width(node, i) == schema->columns[i].size;
+    }
+    if (!widths)
+    {
+      check_error(walk->check, "%s: page %u: minipage widths do not match the columns.\n", tree->name,
+                  page_num);
+      return 0;
+    }
+  }
+  uint32_t max_cells = tree->index ? index_leaf_max_cells(tree->index) : leaf_node_max_cells(node);
+  // Updates remove index entries without merging leaves, only table leaves are never empty
+  if (num_cells > max_cells || (num_cells == 0 && depth > 0 && tree->index == NULL))
+  {
+    check_error(walk->check, "%s: page %u: leaf has %u cells.\n", tree->name, page_num, num_cells);
+    return 0;
+  }
+  for (uint32_t i = 0; i < num_cells; i++)
+  {
+    const void* key = tree->index ? index_leaf_entry(tree->index, node, i) : (void*)leaf_node_key(node, i);
+    if (!check_in_bounds(tree, key, lower, upper))
+    {
+      check_error(walk->check, "%s: page %u: cell %u is out of key order.\n", tree->name, page_num, i);
+      break;
+    }
+    lower = key;
+  }
+  for (uint32_t i = 0; tree->index == NULL && i < num_cells; i++)
+  {
+    row_view_t view = row_view_at_cell(tree->table, node, i);
+    for (uint32_t j = 0; j < tree->table->schema.num_columns; j++)
+    {
+      if (tree->table->schema.columns[j].type == COLUMN_TYPE_OVERFLOW_TEXT)
+      {
+        check_overflow(walk, page_num, i, row_view_column(&view, j));
+      }
+    }
+  }
+  if (walk->seen_leaf && walk->next_leaf != page_num)
+  {
+    check_error(walk->check, "%s: leaf chain goes to page %u, the next leaf is page %u.\n", tree->name,
+                walk->next_leaf, page_num);
+  }
+  walk->seen_leaf = true;
+  walk->next_leaf = *leaf_node_next_leaf(node);
+  return num_cells;
+}
+
+uint32_t
+check_internal(
+  check_walk_t* walk,
+  uint32_t      page_num,
+  void*         node,
+  const void*   lower,
+  const void*   upper,
+  uint32_t      depth
+)
+{
+  check_tree_t* tree      = walk->tree;
+  uint32_t      num_keys  = *internal_node_num_keys(node);
+  uint32_t      max_keys  = tree->index ? index_internal_max_cells(tree->index) : INTERNAL_NODE_MAX_CELLS;
+  if (num_keys > max_keys)
+  {
+    check_error(walk->check, "%s: page %u: internal node has %u keys.\n", tree->name, page_num, num_keys);
+    return 0;
+  }
+
+  // Child i holds the keys above key i - 1 and up to key i, the right child those above the last key
+  uint32_t num_rows = 0;
+  for (uint32_t i = 0; i <= num_keys; i++)
+  {
+    const void* child_upper = upper;
+    if (i < num_keys)
+    {
+      child_upper = tree->index ? index_internal_entry(tree->index, node, i) : (void*)internal_node_key(node, i);
+      if (!check_in_bounds(tree, child_upper, lower, upper))
+      {
+        check_error(walk->check, "%s: page %u: key %u is out of key order.\n", tree->name, page_num, i);
+        return num_rows;
+      }
+    }
+    uint32_t child = tree->index ? *index_internal_child(tree->index, node, i) : *internal_node_child(node, i);
+    num_rows      += check_node(walk, child, page_num, lower, child_upper, depth + 1);
+    lower          = child_upper;
+  }
+  if (tree->index == NULL && *internal_node_row_count(node) != num_rows)
+  {
+    check_error(walk->check, "%s: page %u: row count is %u, the children hold %u.\n", tree->name, page_num,
+                *internal_node_row_count(node), num_rows);
+  }
+  return num_rows;
+}
+
+/* Checks the subtree at page_num, returns the number of rows found in it */
+uint32_t
+check_node(
+  check_walk_t* walk,
+  uint32_t      page_num,
+  uint32_t      parent_page_num,
+  const void*   lower,
+  const void*   upper,
+  uint32_t      depth
+)
+{
+  check_tree_t* tree = walk->tree;
+  if (depth == CHECK_MAX_DEPTH || page_num == CATALOG_PAGE_NUM || page_num >= walk->check->num_pages)
+  {
+    check_error(walk->check, "%s: page %u: bad child pointer %u.\n", tree->name, parent_page_num, page_num);
+    return 0;
+  }
+  void*   node  = walk->pages + (size_t)depth * PAGE_SIZE;
+  ssize_t bytes = pager_read_page(walk->check->pager, page_num, node);
+  if (bytes != PAGE_SIZE || !page_checksum_valid(node))
+  {
+    return 0;  // reported by check_pages()
+  }
+
+  if (is_node_root(node) != (depth == 0))
+  {
+    check_error(walk->check, "%s: page %u: root flag is %s.\n", tree->name, page_num, depth ? "set" : "clear");
+  }
+  // Index inserts recurse from the root, so index trees keep neither parent pointers nor row counts
+  if (depth > 0 && tree->index == NULL && *node_parent(node) != parent_page_num)
+  {
+    check_error(walk->check, "%s: page %u: parent pointer is %u, the parent is page %u.\n", tree->name,
+                page_num, *node_parent(node), parent_page_num);
+  }
+  switch (get_node_type(node))
+  {
+    case (NODE_LEAF):
+      return check_leaf(walk, page_num, node, lower, upper, depth);
+    case (NODE_INTERNAL):
+      return check_internal(walk, page_num, node, lower, upper, depth);
+    default:
+      check_error(walk->check, "%s: page %u: not a tree node.\n", tree->name, page_num);
+      return 0;
+  }
+}
+
+/* Thread body for the tree walks, takes trees until none are left */
+void*
+check_trees(
+  void* argument
+)
+{
+  check_t*      check = argument;
+  check_walk_t  walk;
+  walk.check  = check;
+  walk.pages  = malloc((size_t)(CHECK_MAX_DEPTH + 1) * PAGE_SIZE);
+
+  while (true)
+  {
+    pthread_mutex_lock(&(check->lock));
+    uint32_t next = check->next_tree++;
+    pthread_mutex_unlock(&(check->lock));
+    if (next >= check->num_trees)
+    {
+      break;
+    }
+    walk.tree       = &(check->trees[next]);
+    walk.seen_leaf  = false;
+    check_node(&walk, walk.tree->root_page_num, 0, NULL, NULL, 0);
+    if (walk.seen_leaf && walk.next_leaf != 0)
+    {
+      check_error(check, "%s: leaf chain goes past the last leaf to page %u.\n", walk.tree->name, walk.next_leaf);
+    }
+  }
+  free(walk.pages);
+  return NULL;
+}
+
+/* Verifies the whole file, prints what is wrong and a summary, returns the number of errors */
+uint64_t
+database_check(
+  database_t* database
+)
+{
+  pager_t*  pager = database->pager;
+  check_t   check;
+  long      cpus  = sysconf(_SC_NPROCESSORS_ONLN);
+
+  // The file is read directly, so it has to hold every change first
+  pager_flush_all(pager);
+  check.pager       = pager;
+  check.num_pages   = pager->num_pages;
+  check.num_threads = cpus > 0 ? cpus : 1;
+  check.num_trees   = 0;
+  check.next_tree   = 0;
+  check.errors      = 0;
+  pthread_mutex_init(&(check.lock), NULL);
+  if (check.num_threads > CHECK_MAX_THREADS)
+  {
+    check.num_threads = CHECK_MAX_THREADS;
+  }
+  if (check.num_threads > check.num_pages / CHECK_READ_PAGES + 1)
+  {
+    check.num_threads = check.num_pages / CHECK_READ_PAGES + 1;
+  }
+
+  for (uint32_t i = 0; i < database->num_tables; i++)
+  {
+    table_t*      table = database->tables[i];
+    check_tree_t* tree  = &(check.trees[check.num_trees++]);
+    tree->table         = table;
+    tree->index         = NULL;
+    tree->root_page_num = table->root_page_num;
+    snprintf(tree->name, sizeof(tree->name), "%s", table->name);
+    for (uint32_t j = 0; j < table->schema.num_columns; j++)
+    {
+      if (table->indexes[j].root_page_num == 0)
+      {
+        continue;
+      }
+      tree                = &(check.trees[check.num_trees++]);
+      tree->table         = table;
+      tree->index         = &(table->indexes[j]);
+      tree->root_page_num = table->indexes[j].root_page_num;
+      snprintf(tree->name, sizeof(tree->name), "%s.%s", table->name, table->schema.columns[j].name);
+    }
+  }
+
+  pthread_t     threads[CHECK_MAX_THREADS];
+  check_range_t ranges[CHECK_MAX_THREADS];
+  for (uint32_t i = 0; i < check.num_threads; i++)
+  {
+    ranges[i].check      = &check;
+    ranges[i].first_page = (uint64_t)check.num_pages * i / check.num_threads;
+    ranges[i].end_page   = (uint64_t)check.num_pages * (i + 1) / check.num_threads;
+    pthread_create(&threads[i], NULL, check_pages, &ranges[i]);
+  }
+  for (uint32_t i = 0; i < check.num_threads; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  for (uint32_t i = 0; i < check.num_threads; i++)
+  {
+    pthread_create(&threads[i], NULL, check_trees, &check);
+  }
+  for (uint32_t i = 0; i < check.num_threads; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&(check.lock));
+
+  printf("Checked %u pages and %u trees with %u threads, %llu errors.\n",
+         check.num_pages, check.num_trees, check.num_threads, (unsigned long long)check.errors);
+  return check.errors;
+}
+
+/*
+ * Serialized row with the given id from the write buffer or the tree, NULL if absent.
+ * Rows of PAX leaves are not stored serialized, so they also come back NULL; use
+ * table_contains to test for a key.
+ */
+void*
+table_get_row(
+  table_t*  table,
+  uint32_t  key
+)
+{
+  if (!table_may_contain(table, key))
+  {
+    return NULL;
+  }
+  if (table->memtable != NULL)
+  {
+    memtable_node_t* buffered = memtable_seek(table->memtable, key, NULL);
+    if (buffered != NULL)
+    {
+      return buffered->row;
+    }
+  }
+
+  cursor_t* cursor = table_find(table, key);
+  void*     node   = get_page(table->pager, cursor->page_num);
+  void*     row    = NULL;
+  if (cursor->cell_num < *leaf_node_num_cells(node) &&
+      *leaf_node_key(node, cursor->cell_num) == key &&
+      !leaf_node_is_pax(node))
+  {
+    row = cursor_value(cursor);
+  }
+  free(cursor);
+  return row;
+}
+
+/* Whether a row with the given id is in the write buffer or the tree, for any leaf layout */
+bool
+table_contains(
+  table_t*  table,
+  uint32_t  key
+)
+{
+  if (!table_may_contain(table, key))
+  {
+    return false;
+  }
+  if (table->memtable != NULL && memtable_seek(table->memtable, key, NULL) != NULL)
+  {
+    return true;
+  }
+
+  cursor_t* cursor = table_find(table, key);
+  void*     node   = get_page(table->pager, cursor->page_num);
+  bool      found  = cursor->cell_num < *leaf_node_num_cells(node) &&
+                     *leaf_node_key(node, cursor->cell_num) == key;
+  free(cursor);
+  return found;
+}
+
+/* Insert a row already serialized in the table's format */
+execute_result_e
+table_insert(
+  table_t*      table,
+  void*         row
+)
+{
+  row_view_t  view  = row_view_of(table, row);
+  uint32_t    key   = row_view_id(&view);
+
+  if (table->memtable == NULL)
+  {
+    execute_result_e result = table_tree_insert(table, row);
+    if (result == EXECUTE_SUCCESS)
+    {
+      table_bloom_add(table, key);
+    }
+    return result;
+  }
+
+  // Keys must stay unique across the tree and the buffer, the filter usually rules the tree out
+  pager_release_pages(table->pager);
+  bool in_tree = false;
+  if (table_may_contain(table, key))
+  {
+    cursor_t* cursor  = table_find(table, key);
+    void*     node    = get_page(table->pager, cursor->page_num);
+    in_tree           = cursor->cell_num < *leaf_node_num_cells(node) &&
+                        *leaf_node_key(node, cursor->cell_num) == key;
+    free(cursor);
+  }
+  if (in_tree || !memtable_insert(table->memtable, key, row))
+  {
+    return EXECUTE_DUPLICATE_KEY;
+  }
+  table->pager->stats.buffered_inserts += 1;
+  table_bloom_add(table, key);
+
+  if (table->memtable->num_rows >= table->memtable->max_rows)
+  {
+    table_flush_write_buffer(table);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ Writes the new values over the row's columns where they are stored, in either leaf
+ layout or in the write buffer. changed[i] tells whether columns[i] took a new value,
+ old[i] then holds its previous text for a text column. Overflow text reuses the pages
+ of the value it replaces. Returns whether any column changed.
+*/
+bool
+row_view_overwrite(
+  row_view_t* view,
+  uint32_t*   columns,
+  char**      values,
+  uint32_t    count,
+  bool*       changed,
+  char        old[][COLUMN_TEXT_MAX_SIZE + 1]
+)
+{
+  bool any = false;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    column_t* column  = &(view->schema->columns[columns[i]]);
+    uint8_t*  slot    = (uint8_t*)row_view_column(view, columns[i]);
+    if (column->type == COLUMN_TYPE_INT)
+    {
+      uint32_t value  = atoi(values[i]);
+      changed[i]      = memcmp(slot, &value, sizeof(uint32_t)) != 0;
+      memcpy(slot, &value, sizeof(uint32_t));
+    }
+    else if (column->type == COLUMN_TYPE_OVERFLOW_TEXT)
+    {
+      changed[i] = strcmp(row_view_text(view, columns[i]), values[i]) != 0;
+      if (changed[i])
+      {
+        overflow_store(view->table->pager, values[i], strlen(values[i]), slot, overflow_slot_page(slot));
+      }
+    }
+    else
+    {
+      changed[i] = strncmp((const char*)slot, values[i], column->size) != 0;
+      memcpy(old[i], slot, column->size);
+      strncpy((char*)slot, values[i], column->size);
+    }
+    any = any || changed[i];
+  }
+  return any;
+}
+
+/*
+ UPDATE in place: one descent with table_find(), then the columns are overwritten in
+ the leaf, so a row costs its leaf page and, for each changed indexed column, moving
+ one index entry. The key column cannot change. A row still in the write buffer is
+ overwritten there and indexed when the buffer drains. *found tells whether the row exists.
+*/
+execute_result_e
+table_update(
+  table_t*  table,
+  uint32_t  key,
+  uint32_t* columns,
+  char**    values,
+  uint32_t  count,
+  bool*     found
+)
+{
+  bool  changed[TABLE_MAX_COLUMNS];
+  char  old[TABLE_MAX_COLUMNS][COLUMN_TEXT_MAX_SIZE + 1];
+
+  *found = false;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    column_t* column = &(table->schema.columns[columns[i]]);
+    if (columns[i] == 0)
+    {
+      return EXECUTE_KEY_UPDATE;
+    }
+    if (column->type != COLUMN_TYPE_INT && strlen(values[i]) >= column->max_size)
+    {
+      return EXECUTE_STRING_TOO_LONG;
+    }
+  }
+  if (!table_may_contain(table, key))
+  {
+    return EXECUTE_SUCCESS;
+  }
+
+  pager_release_pages(table->pager);
+  if (table->memtable != NULL)
+  {
+    memtable_node_t* buffered = memtable_seek(table->memtable, key, NULL);
+    if (buffered != NULL)
+    {
+      row_view_t view = row_view_of(table, buffered->row);
+      *found          = true;
+      table->pager->stats.rows_updated += row_view_overwrite(&view, columns, values, count, changed, old);
+      return EXECUTE_SUCCESS;
+    }
+  }
+
+  table->pager->stats.point_seeks += 1;
+  cursor_t* cursor   = table_find(table, key);
+  void*     node     = get_page(table->pager, cursor->page_num);
+  uint32_t  cell_num = cursor->cell_num;
+  free(cursor);
+  *found             = cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cell_num) == key;
+  if (!*found)
+  {
+    return EXECUTE_SUCCESS;
+  }
+
+  row_view_t view = row_view_at_cell(table, node, cell_num);
+  if (row_view_overwrite(&view, columns, values, count, changed, old))
+  {
+    table->pager->stats.rows_updated += 1;
+  }
+  for (uint32_t i = 0; i < count; i++)
+  {
+    index_t* index = &(table->indexes[columns[i]]);
+    if (changed[i] && index->root_page_num != 0)
+    {
+      index_remove(table, index, old[i], key);
+      index_insert(table, index, values[i], key);
+    }
+  }
+  return EXECUTE_SUCCESS;
+}
+
+execute_result_e 
+execute_insert(
+  statement_t*  statement, 
+  table_t*      table
+) 
+{
+  uint8_t           row[PAGE_SIZE];
+  execute_result_e  result;
+
+  if (statement->num_values != table->schema.num_columns)
+  {
+    return EXECUTE_WRONG_VALUE_COUNT;
+  }
+  if (statement->upsert)
+  {
+    // An existing row takes the other values in place, only a missing one is inserted
+    uint32_t  columns[TABLE_MAX_COLUMNS];
+    bool      found;
+    for (uint32_t i = 1; i < table->schema.num_columns; i++)
+    {
+      columns[i - 1] = i;
+    }
+    result = table_update(table, atoi(statement->values[0]), columns, statement->values + 1,
+                          table->schema.num_columns - 1, &found);
+    if (result != EXECUTE_SUCCESS || found)
+    {
+      return result;
+    }
+  }
+  // A duplicate would leave its overflow pages behind, so it is turned away first
+  else if (schema_has_overflow(&(table->schema)) && table_contains(table, atoi(statement->values[0])))
+  {
+    return EXECUTE_DUPLICATE_KEY;
+  }
+  result = serialize_values(&(table->schema), table->pager, statement->values, row);
+  if (result != EXECUTE_SUCCESS)
+  {
+    return result;
+  }
+  return table_insert(table, row);
+}
+
+/* The where clause must name the row by its key, see table_update() */
+execute_result_e
+execute_update(
+  statement_t*  statement,
+  table_t*      table
+)
+{
+  uint32_t  columns[TABLE_MAX_COLUMNS];
+  uint32_t  key_column;
+  bool      found;
+
+  if (!schema_find_column(&(table->schema), statement->where.column_name, &key_column))
+  {
+    return EXECUTE_COLUMN_NOT_FOUND;
+  }
+  if (key_column != 0 || statement->where.op != WHERE_EQUAL)
+  {
+    return EXECUTE_KEY_REQUIRED;
+  }
+  for (uint32_t i = 0; i < statement->num_values; i++)
+  {
+    if (!schema_find_column(&(table->schema), statement->update_columns[i], &columns[i]))
+    {
+      return EXECUTE_COLUMN_NOT_FOUND;
+    }
+  }
+  return table_update(table, atoi(statement->where.value), columns, statement->values, statement->num_values,
+                      &found);
+}
+
+/*
+ * COPY FROM: a CSV or TSV file is mapped and cut into chunks at line ends. One thread
+ * per chunk validates every line against the schema and radix sorts (id, line) pairs;
+ * the chunks are merged and the lines serialized again, a batch at a time in id order,
+ * for the leaf by leaf insert. Only the pairs are kept, never the whole file as rows.
+ */
+typedef struct copy_entry_struct
+{
+  uint32_t          key;
+  uint32_t          length;
+  const char*       line;
+} copy_entry_t;
+
+typedef struct copy_chunk_struct
+{
+  schema_t*         schema;
+  char              delimiter;
+  const char*       begin;
+  const char*       end;
+  bool              skip_header;  // first chunk, first line is not a row when its id is not a number
+  copy_entry_t*     entries;
+  uint32_t          num_entries;
+  uint32_t          num_lines;
+  execute_result_e  result;
+} copy_chunk_t;
+
+/* Parses one field straight into out, at most size - 1 bytes, returns the byte after it */
+const char*
+copy_parse_field(
+  const char* p,
+  const char* end,
+  char        delimiter,
+  char*       out,
+  uint32_t    size,
+  uint32_t*   length
+)
+{
+  *length = 0;
+  if (p < end && *p == '"')
+  {
+    // Quoted field, "" is a literal quote; fields do not span lines
+    for (p++; p < end; p++)
+    {
+      if (*p == '"')
+      {
+        if (p + 1 == end || p[1] != '"')
+        {
+          p++;
+          break;
+        }
+        p++;
+      }
+      if (*length < size)
+      {
+        out[*length] = *p;
+      }
+      *length += 1;
+    }
+  }
+  for (; p < end && *p != delimiter; p++)
+  {
+    if (*length < size)
+    {
+      out[*length] = *p;
+    }
+    *length += 1;
+  }
+  return p;
+}
+
+bool
+copy_parse_int(
+  const char* text,
+  uint32_t    length,
+  uint32_t*   value
+)
+{
+  bool      negative  = length > 0 && text[0] == '-';
+  uint32_t  i         = negative ? 1 : 0;
+  uint64_t  magnitude = 0;
+  if (i == length || length > 11)
+  {
+    return false;
+  }
+  for (; i < length; i++)
+  {
+    if (text[i] < '0' || text[i] > '9')
+    {
+      return false;
+    }
+    magnitude = magnitude * 10 + (text[i] - '0');
+  }
+  if (magnitude > (negative ? (uint64_t)INT32_MAX + 1 : (uint64_t)INT32_MAX))
+  {
+    return false;
+  }
+  *value = negative ? (uint32_t)(-(int64_t)magnitude) : (uint32_t)magnitude;
+  return true;
+}
+
+/*
+ Serializes one line of the file, checked against the schema like an insert.
+ Without a pager overflow text is only checked, the parsing threads cannot write pages.
+*/
+execute_result_e
+copy_parse_line(
+  schema_t*   schema,
+  pager_t*    pager,
+  char        delimiter,
+  const char* line,
+  const char* end,
+  uint8_t*    row
+)
+{
+  const char* p = line;
+  memset(row, 0, schema->row_size);
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    if (i > 0)
+    {
+      if (p >= end)
+      {
+        return EXECUTE_WRONG_VALUE_COUNT;
+      }
+      p++;  // the delimiter
+    }
+    column_t* column = &(schema->columns[i]);
+    uint32_t  length;
+    if (column->type == COLUMN_TYPE_INT)
+    {
+      char      digits[12];
+      uint32_t  value;
+      p = copy_parse_field(p, end, delimiter, digits, sizeof(digits), &length);
+      if (!copy_parse_int(digits, length, &value))
+      {
+        return EXECUTE_TYPE_MISMATCH;
+      }
+      if (i == 0 && (int32_t)value < 0)
+      {
+        return EXECUTE_NEGATIVE_ID;
+      }
+      memcpy(row + column->offset, &value, sizeof(uint32_t));
+    }
+    else if (column->type == COLUMN_TYPE_OVERFLOW_TEXT)
+    {
+      char* value = pager ? malloc(column->max_size) : NULL;
+      p = copy_parse_field(p, end, delimiter, value, pager ? column->max_size - 1 : 0, &length);
+      if (length >= column->max_size)
+      {
+        free(value);
+        return EXECUTE_STRING_TOO_LONG;
+      }
+      if (pager)
+      {
+        overflow_store(pager, value, length, row + column->offset, 0);
+      }
+      free(value);
+    }
+    else
+    {
+      // The text lands in place, the NUL terminator is the zeroed last byte
+      p = copy_parse_field(p, end, delimiter, (char*)row + column->offset, column->size - 1, &length);
+      if (length >= column->size)
+      {
+        return EXECUTE_STRING_TOO_LONG;
+      }
+    }
+  }
+  return p == end ? EXECUTE_SUCCESS : EXECUTE_WRONG_VALUE_COUNT;
+}
+
+/* LSD radix sort on the key, a byte per pass, passes where every key agrees are skipped */
+void
+copy_sort_entries(
+  copy_entry_t* entries,
+  uint32_t      count
+)
+{
+  copy_entry_t* buffer  = malloc((count + 1) * sizeof(copy_entry_t));
+  copy_entry_t* from    = entries;
+  copy_entry_t* to      = buffer;
+  for (uint32_t shift = 0; shift < 32; shift += 8)
+  {
+    uint32_t counts[256] = { 0 };
+    for (uint32_t i = 0; i < count; i++)
+    {
+      counts[(from[i].key >> shift) & 0xff] += 1;
+    }
+    if (count == 0 || counts[(from[0].key >> shift) & 0xff] == count)
+    {
+      continue;
+    }
+    uint32_t position = 0;
+    for (uint32_t b = 0; b < 256; b++)
+    {
+      uint32_t bucket = counts[b];
+      counts[b]       = position;
+      position       += bucket;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+      to[counts[(from[i].key >> shift) & 0xff]++] = from[i];
+    }
+    copy_entry_t* swap  = from;
+    from                = to;
+    to                  = swap;
+  }
+  if (from != entries)
+  {
+    memcpy(entries, from, count * sizeof(copy_entry_t));
+  }
+  free(buffer);
+}
+
+/* Thread body: check every line of the chunk, stopping at the first bad one, then sort */
+void*
+copy_parse_chunk(
+  void* argument
+)
+{
+  copy_chunk_t* chunk     = argument;
+  uint32_t      capacity  = 1024;
+  uint8_t       row[PAGE_SIZE];
+  chunk->entries          = malloc(capacity * sizeof(copy_entry_t));
+  chunk->result           = EXECUTE_SUCCESS;
+
+  const char* line = chunk->begin;
+  while (line < chunk->end)
+  {
+    const char* newline = memchr(line, '\n', chunk->end - line);
+    const char* end     = newline ? newline : chunk->end;
+    const char* next    = newline ? newline + 1 : chunk->end;
+    chunk->num_lines   += 1;
+    if (end > line && end[-1] == '\r')
+    {
+      end--;
+    }
+    if (end == line)
+    {
+      line = next;
+      continue;
+    }
+    execute_result_e result = copy_parse_line(chunk->schema, NULL, chunk->delimiter, line, end, row);
+    if (result == EXECUTE_TYPE_MISMATCH && chunk->skip_header && chunk->num_lines == 1)
+    {
+      line = next;
+      continue;
+    }
+    if (result != EXECUTE_SUCCESS)
+    {
+      chunk->result = result;
+      return NULL;
+    }
+    if (chunk->num_entries == capacity)
+    {
+      capacity       *= 2;
+      chunk->entries  = realloc(chunk->entries, capacity * sizeof(copy_entry_t));
+    }
+    copy_entry_t* entry = &(chunk->entries[chunk->num_entries++]);
+    memcpy(&(entry->key), row, sizeof(uint32_t));
+    entry->line         = line;
+    entry->length       = end - line;
+    line                = next;
+  }
+  copy_sort_entries(chunk->entries, chunk->num_entries);
+  return NULL;
+}
+
+/*
+ Loads a CSV or TSV file (tab if the first line has one) into the table, all or nothing:
+ a bad line or a duplicate id stops the copy before any row is inserted. *error_line
+ is the 1-based line of a bad row, 0 when the problem is not tied to a line.
+*/
+execute_result_e
+table_copy_from(
+  table_t*    table,
+  const char* path,
+  uint32_t*   rows_copied,
+  uint64_t*   error_line
+)
+{
+  *rows_copied  = 0;
+  *error_line   = 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+  {
+    return EXECUTE_FILE_ERROR;
+  }
+  struct stat file_stat;
+  fstat(fd, &file_stat);
+  size_t      size = file_stat.st_size;
+  const char* data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    return EXECUTE_FILE_ERROR;
+  }
+
+  const char* first_newline = memchr(data, '\n', size);
+  size_t      first_length  = first_newline ? (size_t)(first_newline - data) : size;
+  char        delimiter     = memchr(data, '\t', first_length) ? '\t' : ',';
+
+  long      cpus        = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t  num_chunks  = size / COPY_MIN_CHUNK_SIZE + 1;
+  if (num_chunks > (uint32_t)(cpus > 0 ? cpus : 1))
+  {
+    num_chunks = cpus > 0 ? cpus : 1;
+  }
+  if (num_chunks > COPY_MAX_THREADS)
+  {
+    num_chunks = COPY_MAX_THREADS;
+  }
+
+  copy_chunk_t  chunks[COPY_MAX_THREADS];
+  pthread_t     threads[COPY_MAX_THREADS];
+  const char*   begin = data;
+  for (uint32_t i = 0; i < num_chunks; i++)
+  {
+    const char* end = data + size;
+    if (i + 1 < num_chunks)
+    {
+      const char* cut     = data + size * (i + 1) / num_chunks;
+      const char* newline = cut < begin ? NULL : memchr(cut, '\n', data + size - cut);
+      end                 = cut < begin ? begin : (newline ? newline + 1 : data + size);
+    }
+    memset(&chunks[i], 0, sizeof(copy_chunk_t));
+    chunks[i].schema      = &(table->schema);
+    chunks[i].delimiter   = delimiter;
+    chunks[i].begin       = begin;
+    chunks[i].end         = end;
+    chunks[i].skip_header = i == 0;
+    begin                 = end;
+    pthread_create(&threads[i], NULL, copy_parse_chunk, &chunks[i]);
+  }
+
+  execute_result_e  result  = EXECUTE_SUCCESS;
+  uint64_t          lines   = 0;
+  uint64_t          total   = 0;
+  for (uint32_t i = 0; i < num_chunks; i++)
+  {
+    pthread_join(threads[i], NULL);
+    if (result == EXECUTE_SUCCESS && chunks[i].result != EXECUTE_SUCCESS)
+    {
+      result      = chunks[i].result;
+      *error_line = lines + chunks[i].num_lines;
+    }
+    lines += chunks[i].num_lines;
+    total += chunks[i].num_entries;
+  }
+  if (result == EXECUTE_SUCCESS && total > UINT32_MAX)
+  {
+    result = EXECUTE_TABLE_FULL;
+  }
+
+  // K-way merge of the sorted chunks, ids must be new to the table and the file
+  copy_entry_t* merged                        = NULL;
+  uint32_t      positions[COPY_MAX_THREADS]   = { 0 };
+  if (result == EXECUTE_SUCCESS)
+  {
+    merged = malloc((total + 1) * sizeof(copy_entry_t));
+    for (uint64_t n = 0; n < total; n++)
+    {
+      int32_t best = -1;
+      for (uint32_t i = 0; i < num_chunks; i++)
+      {
+        if (positions[i] < chunks[i].num_entries &&
+            (best < 0 || chunks[i].entries[positions[i]].key < chunks[best].entries[positions[best]].key))
+        {
+          best = i;
+        }
+      }
+      merged[n] = chunks[best].entries[positions[best]++];
+      if (n > 0 && merged[n].key == merged[n - 1].key)
+      {
+        result = EXECUTE_DUPLICATE_KEY;
+        break;
+      }
+      if (table_may_contain(table, merged[n].key))
+      {
+        pager_release_pages(table->pager);
+        if (table_contains(table, merged[n].key))
+        {
+          result = EXECUTE_DUPLICATE_KEY;
+          break;
+        }
+      }
+    }
+  }
+
+  if (result == EXECUTE_SUCCESS)
+  {
+    table_flush_write_buffer(table);
+    uint32_t  row_size  = table->schema.row_size;
+    uint8_t*  batch     = malloc((size_t)COPY_BATCH_ROWS * row_size);
+    void*     rows[COPY_BATCH_ROWS];
+    for (uint64_t n = 0; n < total; n += COPY_BATCH_ROWS)
+    {
+      uint32_t count = total - n < COPY_BATCH_ROWS ? total - n : COPY_BATCH_ROWS;
+      for (uint32_t i = 0; i < count; i++)
+      {
+        copy_entry_t* entry = &merged[n + i];
+        rows[i]             = batch + (size_t)i * row_size;
+        copy_parse_line(&(table->schema), table->pager, delimiter, entry->line, entry->line + entry->length,
+                        rows[i]);
+      }
+      table_insert_sorted(table, rows, count);
+    }
+    for (uint64_t n = 0; n < total; n++)
+    {
+      table_bloom_add(table, merged[n].key);
+    }
+    free(batch);
+    *rows_copied = total;
+  }
+
+  free(merged);
+  for (uint32_t i = 0; i < num_chunks; i++)
+  {
+    free(chunks[i].entries);
+  }
+  if (size)
+  {
+    munmap((void*)data, size);
+  }
+  return result;
+}
+
+execute_result_e
+execute_copy_from(
+  statement_t*  statement,
+  table_t*      table
+)
+{
+  uint32_t          rows_copied;
+  uint64_t          error_line;
+  execute_result_e  result = table_copy_from(table, statement->copy_path, &rows_copied, &error_line);
+  if (result == EXECUTE_SUCCESS)
+  {
+    printf("Copied %u rows.\n", rows_copied);
+  }
+  else if (error_line > 0)
+  {
+    printf("Copy stopped at line %llu.\n", (unsigned long long)error_line);
+  }
+  return result;
+}
+
+void 
+print_row(
+  row_t* row
+) 
+{
+  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+}
+
+void
+print_row_view(
+  FILE*       stream,
+  row_view_t* view
+)
+{
+  fputc('(', stream);
+  for (uint32_t i = 0; i < view->schema->num_columns; i++)
+  {
+    if (view->schema->columns[i].type == COLUMN_TYPE_INT)
+    {
+      fprintf(stream, "%s%d", i ? ", " : "", row_view_int(view, i));
+    }
+    else
+    {
+      fprintf(stream, "%s%s", i ? ", " : "", row_view_text(view, i));
+    }
+  }
+  fputs(")\n", stream);
+}
+
+/* Walk the leftmost path, O(height) */
+uint32_t
+table_min_key(
+  table_t*    table
+)
+{
+  void* node = get_page(table->pager, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    node = get_page(table->pager, *internal_node_child(node, 0));
+  }
+  return *leaf_node_key(node, 0);
+}
+
+void
+print_aggregate_value(
+  aggregate_type_e    aggregate,
+  aggregate_state_t*  state
+)
+{
+  if (aggregate == AGGREGATE_COUNT)
+  {
+    printf("(%d)\n", state->count);
+    return;
+  }
+  if (state->count == 0)
+  {
+    printf("(NULL)\n");
+    return;
+  }
+  switch (aggregate)
+  {
+    case (AGGREGATE_MIN):
+      printf("(%d)\n", state->min);
+      break;
+    case (AGGREGATE_MAX):
+      printf("(%d)\n", state->max);
+      break;
+    case (AGGREGATE_SUM):
+      printf("(%lld)\n", (long long)state->sum);
+      break;
+    case (AGGREGATE_AVG):
+      printf("(%.2f)\n", (double)state->sum / state->count);
+      break;
+    default:
+      break;
+  }
+}
+
+void
+print_aggregate(
+  pager_t*            pager,
+  aggregate_type_e    aggregate,
+  aggregate_state_t*  state
+)
+{
+  uint64_t start = monotonic_ns();
+  print_aggregate_value(aggregate, state);
+  pager->stats.output_ns += monotonic_ns() - start;
+}
+
+bool
+accumulate_row(
+  row_view_t* view,
+  void*       context
+)
+{
+  aggregate_state_t*  state = context;
+  int32_t             value = (int32_t)row_view_int(view, state->column);
+
+  if (state->count == 0 || value < state->min)
+  {
+    state->min = value;
+  }
+  if (state->count == 0 || value > state->max)
+  {
+    state->max = value;
+  }
+  state->count += 1;
+  state->sum   += value;
+  return true;
+}
+
+void
+result_writer_init(
+  result_writer_t*  writer,
+  FILE*             stream,
+  result_format_e   format,
+  pager_t*          pager
+)
+{
+  writer->stream    = stream;
+  writer->fd        = -1;
+  writer->offset    = 0;
+  writer->failed    = false;
+  writer->format    = format;
+  writer->pager     = pager;
+  writer->length    = 0;
+  writer->capacity  = RESULT_BUFFER_SIZE;
+  writer->data      = format != RESULT_FORMAT_TEXT ? malloc(writer->capacity) : NULL;
+}
+
+/* Writer for a file of its own, filled from the start in COPY_BUFFER_SIZE chunks */
+void
+result_writer_open(
+  result_writer_t*  writer,
+  int               fd,
+  result_format_e   format,
+  pager_t*          pager
+)
+{
+  result_writer_init(writer, NULL, format, pager);
+  free(writer->data);
+  writer->fd        = fd;
+  writer->capacity  = COPY_BUFFER_SIZE;
+  writer->data      = malloc(writer->capacity);
+}
+
+void
+result_writer_flush(
+  result_writer_t*  writer
+)
+{
+  uint64_t start = monotonic_ns();
+  if (writer->stream != NULL)
+  {
+    fwrite(writer->data, 1, writer->length, writer->stream);
+  }
+  for (uint32_t written = 0; writer->stream == NULL && written < writer->length && !(writer->failed); )
+  {
+    ssize_t bytes = pwrite(writer->fd, writer->data + written, writer->length - written, writer->offset);
+    if (bytes <= 0)
+    {
+      writer->failed = true;
+      break;
+    }
+    written        += bytes;
+    writer->offset += bytes;
+  }
+  writer->length = 0;
+  writer->pager->stats.output_ns += monotonic_ns() - start;
+}
+
+/* Room for the next bytes bytes, flushing first and growing the buffer for rows with overflow text */
+void
+result_writer_reserve(
+  result_writer_t*  writer,
+  uint32_t          bytes
+)
+{
+  if (writer->length + bytes <= writer->capacity)
+  {
+    return;
+  }
+  result_writer_flush(writer);
+  if (bytes > writer->capacity)
+  {
+    writer->capacity  = bytes;
+    writer->data      = realloc(writer->data, writer->capacity);
+  }
+}
+
+void
+result_writer_put_u32(
+  result_writer_t*  writer,
+  uint32_t          value
+)
+{
+  uint8_t* out  = (uint8_t*)writer->data + writer->length;
+  out[0]        = value & 0xff;
+  out[1]        = (value >> 8) & 0xff;
+  out[2]        = (value >> 16) & 0xff;
+  out[3]        = value >> 24;
+  writer->length += sizeof(uint32_t);
+}
+
+/*
+ Binary row: u32 length of the rest, then each column in schema order,
+ an int as 4 bytes and a text as a u32 length and its bytes, all little endian.
+*/
+void
+result_writer_binary_row(
+  result_writer_t*  writer,
+  row_view_t*       view
+)
+{
+  schema_t* schema  = view->schema;
+  uint32_t  size    = 0;
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    size += sizeof(uint32_t);
+    if (schema->columns[i].type != COLUMN_TYPE_INT)
+    {
+      size += strlen(row_view_text(view, i));
+    }
+  }
+  result_writer_reserve(writer, sizeof(uint32_t) + size);
+
+  result_writer_put_u32(writer, size);
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    if (schema->columns[i].type == COLUMN_TYPE_INT)
+    {
+      result_writer_put_u32(writer, row_view_int(view, i));
+      continue;
+    }
+    const char* text    = row_view_text(view, i);
+    uint32_t    length  = strlen(text);
+    result_writer_put_u32(writer, length);
+    memcpy(writer->data + writer->length, text, length);
+    writer->length += length;
+  }
+}
+
+/* Decimal digits of a signed int, without going through printf */
+char*
+csv_put_int(
+  char*     out,
+  int32_t   value
+)
+{
+  char      digits[10];
+  uint32_t  count     = 0;
+  uint32_t  magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+  if (value < 0)
+  {
+    *out++ = '-';
+  }
+  do
+  {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude      /= 10;
+  } while (magnitude > 0);
+  while (count > 0)
+  {
+    *out++ = digits[--count];
+  }
+  return out;
+}
+
+/* Texts with a comma, quote or line break are quoted, with quotes doubled as copy ... from reads them */
+char*
+csv_put_text(
+  char*       out,
+  const char* text
+)
+{
+  size_t length = strlen(text);
+  if (strpbrk(text, ",\"\r\n") == NULL)
+  {
+    memcpy(out, text, length);
+    return out + length;
+  }
+  *out++ = '"';
+  for (size_t i = 0; i < length; i++)
+  {
+    if (text[i] == '"')
+    {
+      *out++ = '"';
+    }
+    *out++ = text[i];
+  }
+  *out++ = '"';
+  return out;
+}
+
+void
+result_writer_csv_header(
+  result_writer_t*  writer,
+  schema_t*         schema
+)
+{
+  char* out = writer->data + writer->length;
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    if (i > 0)
+    {
+      *out++ = ',';
+    }
+    out = csv_put_text(out, schema->columns[i].name);
+  }
+  *out++          = '\n';
+  writer->length  = out - writer->data;
+}
+
+void
+result_writer_csv_row(
+  result_writer_t*  writer,
+  row_view_t*       view
+)
+{
+  schema_t* schema = view->schema;
+  uint32_t  size   = 0;
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    size += schema->columns[i].max_size;
+  }
+  // Quoting at most doubles a text, an int takes at most 11 characters
+  result_writer_reserve(writer, 2 * size + 16 * schema->num_columns);
+
+  char* out = writer->data + writer->length;
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    if (i > 0)
+    {
+      *out++ = ',';
+    }
+    if (schema->columns[i].type == COLUMN_TYPE_INT)
+    {
+      out = csv_put_int(out, row_view_int(view, i));
+    }
+    else
+    {
+      out = csv_put_text(out, row_view_text(view, i));
+    }
+  }
+  *out++          = '\n';
+  writer->length  = out - writer->data;
+}
+
+/*
+ Row visitor, context is a result_writer_t. Text rows are timed as output one by one;
+ buffered formats only when a chunk is written, timing each would cost more than encoding it.
+*/
+bool
+result_writer_row(
+  row_view_t* view,
+  void*       context
+)
+{
+  result_writer_t* writer = context;
+  if (writer->format == RESULT_FORMAT_BINARY)
+  {
+    result_writer_binary_row(writer, view);
+    return true;
+  }
+  if (writer->format == RESULT_FORMAT_CSV)
+  {
+    result_writer_csv_row(writer, view);
+    return true;
+  }
+  uint64_t start = monotonic_ns();
+  print_row_view(writer->stream, view);
+  writer->pager->stats.output_ns += monotonic_ns() - start;
+  return true;
+}
+
+/* Ends a result; in binary a zero length row marks the end, before the status line */
+void
+result_writer_finish(
+  result_writer_t*  writer
+)
+{
+  if (writer->data == NULL)
+  {
+    return;
+  }
+  if (writer->format == RESULT_FORMAT_BINARY)
+  {
+    if (writer->length + sizeof(uint32_t) > writer->capacity)
+    {
+      result_writer_flush(writer);
+    }
+    result_writer_put_u32(writer, 0);
+  }
+  result_writer_flush(writer);
+  free(writer->data);
+  writer->data = NULL;
+}
+
+/*
+ * COPY TO: one walk of the leaf chain straight into a large buffer written with
+ * pwrite(), no stdio on the way. Whenever the walk enters a new parent, the
+ * leaves under it are read ahead so their reads overlap with encoding.
+ */
+void
+table_read_ahead_children(
+  table_t*  table,
+  uint32_t  parent_page_num
+)
+{
+  void* parent = get_page(table->pager, parent_page_num);
+  if (get_node_type(parent) != NODE_INTERNAL)
+  {
+    return;
+  }
+  uint32_t num_keys = *internal_node_num_keys(parent);
+  for (uint32_t i = 0; i <= num_keys; i++)
+  {
+    pager_read_ahead(table->pager, *internal_node_child(parent, i));
+  }
+}
+
+/* Writes the whole table as CSV, with a header line, or as binary rows */
+execute_result_e
+table_copy_to(
+  table_t*        table,
+  const char*     path,
+  result_format_e format,
+  uint32_t*       rows_copied
+)
+{
+  *rows_copied = 0;
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd == -1)
+  {
+    return EXECUTE_WRITE_ERROR;
+  }
+  // Buffered rows go out in id order with the tree's
+  table_flush_write_buffer(table);
+
+  result_writer_t writer;
+  result_writer_open(&writer, fd, format, table->pager);
+  if (format == RESULT_FORMAT_CSV)
+  {
+    result_writer_csv_header(&writer, &(table->schema));
+  }
+
+  uint32_t  read_ahead_parent = INVALID_PAGE_NUM;
+  cursor_t* cursor            = table_start(table);
+  while (!(cursor->end_of_table) && !(writer.failed))
+  {
+    void* node = get_page(table->pager, cursor->page_num);
+    if (cursor->cell_num == 0 && !is_node_root(node) && *node_parent(node) != read_ahead_parent)
+    {
+      read_ahead_parent = *node_parent(node);
+      table_read_ahead_children(table, read_ahead_parent);
+    }
+    row_view_t view = row_view_at(cursor);
+    result_writer_row(&view, &writer);
+    *rows_copied += 1;
+    cursor_advance(cursor);
+  }
+  free(cursor);
+  result_writer_finish(&writer);
+
+  bool failed = writer.failed;
+  if (close(fd) == -1)
+  {
+    failed = true;
+  }
+  return failed ? EXECUTE_WRITE_ERROR : EXECUTE_SUCCESS;
+}
+
+execute_result_e
+execute_copy_to(
+  statement_t*  statement,
+  table_t*      table
+)
+{
+  uint32_t          rows_copied;
+  execute_result_e  result = table_copy_to(table, statement->copy_path, statement->copy_format, &rows_copied);
+  if (result == EXECUTE_SUCCESS)
+  {
+    printf("Copied %u rows.\n", rows_copied);
+  }
+  return result;
+}
+
+/* Bind the where clause's column name and value to the table's schema */
+execute_result_e
+resolve_where(
+  table_t*        table,
+  where_clause_t* where
+)
+{
+  if (where->op == WHERE_NONE)
+  {
+    return EXECUTE_SUCCESS;
+  }
+  if (!schema_find_column(&(table->schema), where->column_name, &(where->column)))
+  {
+    return EXECUTE_COLUMN_NOT_FOUND;
+  }
+  if (table->schema.columns[where->column].type == COLUMN_TYPE_INT)
+  {
+    if (where->op == WHERE_PREFIX)
+    {
+      return EXECUTE_TYPE_MISMATCH;
+    }
+    where->number = atoi(where->value);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+/* Length and prefix in the slot settle most rows before an overflow page is read */
+bool
+overflow_text_matches(
+  row_view_t*     view,
+  where_clause_t* where
+)
+{
+  const uint8_t*  slot    = row_view_column(view, where->column);
+  uint32_t        length  = overflow_slot_length(slot);
+  size_t          wanted  = strlen(where->value);
+  size_t          prefix  = wanted < OVERFLOW_SLOT_PREFIX_SIZE ? wanted : OVERFLOW_SLOT_PREFIX_SIZE;
+  if ((where->op == WHERE_EQUAL) ? length != wanted : length < wanted)
+  {
+    return false;
+  }
+  if (memcmp(slot + OVERFLOW_SLOT_PREFIX_OFFSET, where->value, prefix) != 0)
+  {
+    return false;
+  }
+  if (wanted == prefix)
+  {
+    return true;
+  }
+  const char* text = row_view_text(view, where->column);
+  return memcmp(text + prefix, where->value + prefix, wanted - prefix) == 0;
+}
+
+bool
+row_matches(
+  row_view_t*     view,
+  where_clause_t* where
+)
+{
+  if (where->op != WHERE_NONE && view->schema->columns[where->column].type == COLUMN_TYPE_OVERFLOW_TEXT)
+  {
+    return overflow_text_matches(view, where);
+  }
+  switch (where->op)
+  {
+    case (WHERE_NONE):
+      return true;
+    case (WHERE_EQUAL):
+      if (view->schema->columns[where->column].type == COLUMN_TYPE_INT)
+      {
+        return row_view_int(view, where->column) == where->number;
+      }
+      return strcmp(row_view_text(view, where->column), where->value) == 0;
+    case (WHERE_PREFIX):
+      return strncmp(row_view_text(view, where->column), where->value, strlen(where->value)) == 0;
+  }
+  return false;
+}
+
+/*
+ Full scan of a table with PAX leaves: the where clause is tested a leaf at a time over
+ the column's minipage alone, and only the matching cells are visited. Leaves still in
+ the row layout are matched row by row.
+*/
+void
+table_scan_pax(
+  table_t*        table,
+  where_clause_t* where,
+  row_visitor_t   visitor,
+  void*           context
+)
+{
+  db_stats_t* stats     = &(table->pager->stats);
+  column_t*   column    = (where->op == WHERE_NONE) ? NULL : &(table->schema.columns[where->column]);
+  size_t      length    = (where->op == WHERE_PREFIX) ? strlen(where->value) : 0;
+  uint16_t    selected[PAGE_SIZE / sizeof(uint32_t)];
+  cursor_t*   cursor    = table_start(table);
+  uint32_t    page_num  = cursor->end_of_table ? 0 : cursor->page_num;
+  free(cursor);
+
+  while (page_num != 0)
+  {
+    void*     node      = get_page(table->pager, page_num);
+    uint32_t  num_cells = *leaf_node_num_cells(node);
+    uint32_t  count     = 0;
+    if (!leaf_node_is_pax(node) || where->op == WHERE_NONE || column->type == COLUMN_TYPE_OVERFLOW_TEXT)
+    {
+      for (uint32_t i = 0; i < num_cells; i++)
+      {
+        row_view_t view  = row_view_at_cell(table, node, i);
+        selected[count]  = i;
+        count           += row_matches(&view, where);
+      }
+    }
+    else if (column->type == COLUMN_TYPE_INT)
+    {
+      // Branchless: every cell is written, only matches advance
+      const uint8_t* values = leaf_node_pax_minipage(node, column->offset);
+      for (uint32_t i = 0; i < num_cells; i++)
+      {
+        uint32_t value;
+        memcpy(&value, values + i * sizeof(uint32_t), sizeof(uint32_t));
+        selected[count]  = i;
+        count           += (value == where->number);
+      }
+    }
+    else
+    {
+      const char* values = (const char*)leaf_node_pax_minipage(node, column->offset);
+      for (uint32_t i = 0; i < num_cells; i++)
+      {
+        const char* value = values + i * column->size;
+        selected[count]   = i;
+        count            += (where->op == WHERE_EQUAL) ? strcmp(value, where->value) == 0
+                                                       : strncmp(value, where->value, length) == 0;
+      }
+    }
+
+    stats->rows_examined += num_cells;
+    stats->rows_returned += count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      row_view_t view = row_view_at_cell(table, node, selected[i]);
+      if (!visitor(&view, context))
+      {
+        return;
+      }
+    }
+    page_num = *leaf_node_next_leaf(node);
+    // Scans may run over more pages than the cache holds
+    pager_release_pages(table->pager);
+  }
+}
+
+/*
+ Pick an access path for the where clause and hand every matching row to visitor:
+ point seek on the primary key, index range scan on an indexed column, or a full scan.
+ The scan ends early when the visitor returns false.
+*/
+void
+table_select_where(
+  table_t*        table,
+  where_clause_t* where,
+  row_visitor_t   visitor,
+  void*           context
+)
+{
+  db_stats_t* stats = &(table->pager->stats);
+
+  if (where->op == WHERE_EQUAL && where->column == 0)
+  {
+    if (!table_may_contain(table, where->number))
+    {
+      return;
+    }
+    stats->point_seeks += 1;
+    memtable_node_t* buffered = table->memtable ? memtable_seek(table->memtable, where->number, NULL) : NULL;
+    if (buffered != NULL)
+    {
+      row_view_t view = row_view_of(table, buffered->row);
+      stats->rows_examined += 1;
+      stats->rows_returned += 1;
+      visitor(&view, context);
+      return;
+    }
+    cursor_t* cursor = table_find(table, where->number);
+    void*     node   = get_page(table->pager, cursor->page_num);
+    if (cursor->cell_num < *leaf_node_num_cells(node) &&
+        *leaf_node_key(node, cursor->cell_num) == where->number)
+    {
+      row_view_t view = row_view_at(cursor);
+      stats->rows_examined += 1;
+      stats->rows_returned += 1;
+      visitor(&view, context);
+    }
+    free(cursor);
+    return;
+  }
+
+  if (where->op != WHERE_NONE && table->indexes[where->column].root_page_num != 0)
+  {
+    index_t*  index = &(table->indexes[where->column]);
+    uint8_t   entry[INDEX_NODE_ID_SIZE + COLUMN_TEXT_MAX_SIZE + 1];
+    size_t    length = (where->op == WHERE_EQUAL) ? index->key_size : strlen(where->value);
+
+    // Buffered rows are not in the index yet
+    table_flush_write_buffer(table);
+    stats->index_scans += 1;
+    index_make_entry(index, where->value, 0, entry);
+    cursor_t* cursor = index_find(table, index, entry);
+    while (!(cursor->end_of_table))
+    {
+      void* node = get_page(table->pager, cursor->page_num);
+      void* key  = index_leaf_entry(index, node, cursor->cell_num);
+      if (strncmp(key, where->value, length) != 0)
+      {
+        break;
+      }
+      cursor_t* row_cursor = table_find(table, index_entry_id(index, key));
+      row_view_t view = row_view_at(row_cursor);
+      stats->rows_examined += 1;
+      stats->rows_returned += 1;
+      bool more = visitor(&view, context);
+      free(row_cursor);
+      if (!more)
+      {
+        break;
+      }
+      cursor_advance(cursor);
+    }
+    free(cursor);
+    return;
+  }
+
+  /* Full scan, merging the write buffer's rows in id order with the tree's */
+  stats->full_scans += 1;
+  if (table->leaf_layout == LEAF_LAYOUT_PAX &&
+      (table->memtable == NULL || table->memtable->head->next[0] == NULL))
+  {
+    table_scan_pax(table, where, visitor, context);
+    return;
+  }
+  memtable_node_t*  buffered  = table->memtable ? table->memtable->head->next[0] : NULL;
+  cursor_t*         cursor    = table_start(table);
+  while (!(cursor->end_of_table) || buffered != NULL)
+  {
+    row_view_t  view;
+    bool        from_tree = !(cursor->end_of_table);
+    if (from_tree && buffered != NULL)
+    {
+      void* node = get_page(table->pager, cursor->page_num);
+      from_tree  = *leaf_node_key(node, cursor->cell_num) < buffered->key;
+    }
+    if (from_tree)
+    {
+      view = row_view_at(cursor);
+    }
+    else
+    {
+      view      = row_view_of(table, buffered->row);
+      buffered  = buffered->next[0];
+    }
+
+    stats->rows_examined += 1;
+    if (row_matches(&view, where))
+    {
+      stats->rows_returned += 1;
+      if (!visitor(&view, context))
+      {
+        break;
+      }
+    }
+    if (from_tree)
+    {
+      cursor_advance(cursor);
+    }
+  }
+  free(cursor);
+}
+
+/*
+ * ORDER BY, LIMIT and OFFSET. Rows in id order come straight from the tree: without a
+ * where clause the first row is found by rank from the internal nodes' subtree row
+ * counts, and the scan stops once the limit is reached. Any other order copies the
+ * matching rows out. When offset + limit rows fit in sort_memory only the best of them
+ * are kept, in a bounded heap. Otherwise rows are heap sorted a sort_memory at a time and
+ * written as sorted runs to a temporary file next to the database, then merged.
+ */
+typedef struct sort_item_struct
+{
+  uint8_t*          row;
+  uint32_t          run;
+} sort_item_t;
+
+typedef struct sort_run_struct
+{
+  off_t             offset;     // of the next rows to read back
+  uint32_t          remaining;  // rows still in the file
+  uint8_t*          rows;       // a page's worth read back
+  uint32_t          count;
+  uint32_t          position;
+} sort_run_t;
+
+typedef struct sort_struct
+{
+  table_t*          table;
+  column_t*         column;
+  bool              descending;
+  uint32_t          row_size;
+  uint64_t          skip;       // offset rows still to drop
+  uint64_t          remaining;  // limit rows still to emit
+  uint64_t          emitted;
+  row_visitor_t     visitor;
+  void*             context;
+  bool              top_k;
+  uint8_t*          rows;       // capacity rows, the heap or the run being filled
+  uint8_t*          scratch;
+  sort_item_t*      items;
+  uint32_t          count;
+  uint32_t          capacity;
+  const char*       path;       // of the run file
+  int               fd;         // -1 until the first run is written
+  off_t             file_size;
+  sort_run_t*       runs;
+  uint32_t          num_runs;
+} sort_t;
+
+/* Output order: the sort column, then id ascending for ties */
+int
+sort_compare(
+  sort_t*         sort,
+  const uint8_t*  a,
+  const uint8_t*  b
+)
+{
+  int order = 0;
+  if (sort->column->type == COLUMN_TYPE_INT)
+  {
+    int32_t x, y;
+    memcpy(&x, a + sort->column->offset, sizeof(int32_t));
+    memcpy(&y, b + sort->column->offset, sizeof(int32_t));
+    order = (x > y) - (x < y);
+  }
+  else
+  {
+    order = strcmp((const char*)a + sort->column->offset, (const char*)b + sort->column->offset);
+  }
+  if (sort->descending)
+  {
+    order = -order;
+  }
+  if (order == 0)
+  {
+    uint32_t x, y;
+    memcpy(&x, a + ID_OFFSET, sizeof(uint32_t));
+    memcpy(&y, b + ID_OFFSET, sizeof(uint32_t));
+    order = (x > y) - (x < y);
+  }
+  return order;
 }
 
-uint32_t*
-internal_node_right_child(
-  void*   node
+/* Heap whose root comes last in output order, or first with reverse set */
+void
+sort_sift_down(
+  sort_t*       sort,
+  sort_item_t*  items,
+  uint32_t      count,
+  uint32_t      i,
+  bool          reverse
 )
 {
-  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+  int sign = reverse ? -1 : 1;
+  while (true)
+  {
+    uint32_t top   = i;
+    uint32_t left  = 2 * i + 1;
+    uint32_t right = left + 1;
+    if (left < count && sign * sort_compare(sort, items[left].row, items[top].row) > 0)
+    {
+      top = left;
+    }
+    if (right < count && sign * sort_compare(sort, items[right].row, items[top].row) > 0)
+    {
+      top = right;
+    }
+    if (top == i)
+    {
+      return;
+    }
+    sort_item_t item = items[i];
+    items[i]         = items[top];
+    items[top]       = item;
+    i                = top;
+  }
 }
 
-uint32_t*
-internal_node_cell(
-  void*     node,
-  uint32_t  cell_num
+void
+sort_heapify(
+  sort_t*       sort,
+  sort_item_t*  items,
+  uint32_t      count,
+  bool          reverse
 )
 {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+  for (uint32_t i = count / 2; i > 0; i--)
+  {
+    sort_sift_down(sort, items, count, i - 1, reverse);
+  }
 }
 
-uint32_t*
-internal_node_child(
-  void*     node,
-  uint32_t  child_num
+/* Leaves items in output order */
+void
+sort_heapsort(
+  sort_t*       sort,
+  sort_item_t*  items,
+  uint32_t      count
 )
 {
-  uint32_t  num_keys = *internal_node_num_keys(node);
-  if(child_num > num_keys)
+  sort_heapify(sort, items, count, false);
+  for (uint32_t last = count; last > 1; last--)
   {
-    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-    exit(EXIT_FAILURE);
+    sort_item_t item = items[0];
+    items[0]         = items[last - 1];
+    items[last - 1]  = item;
+    sort_sift_down(sort, items, last - 1, 0, false);
   }
-  else if(child_num == num_keys)
+}
+
+/* Applies offset and limit on the way out; false once the limit is reached */
+bool
+sort_emit(
+  sort_t*     sort,
+  row_view_t* view
+)
+{
+  if (sort->remaining == 0)
   {
-    return internal_node_right_child(node);
+    return false;
   }
-  else
+  if (sort->skip > 0)
   {
-    return internal_node_cell(node, child_num);
+    sort->skip -= 1;
+    return true;
   }
+  sort->remaining -= 1;
+  sort->emitted   += 1;
+  return sort->visitor(view, sort->context) && sort->remaining > 0;
 }
 
-uint32_t*
-internal_node_key(
-  void*     node,
-  uint32_t  key_num
+bool
+sort_limit_row(
+  row_view_t* view,
+  void*       context
 )
 {
-  return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+  return sort_emit((sort_t*)context, view);
 }
 
-uint32_t
-get_node_max_key(
-  void* node
+/* Copies a row in the serialized row layout, whatever the leaf layout */
+void
+row_view_copy(
+  row_view_t* view,
+  uint8_t*    destination
 )
 {
-  switch (get_node_type(node))
+  if (view->data != NULL)
   {
-  case NODE_INTERNAL:
-    return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-  case NODE_LEAF:
-    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    memcpy(destination, view->data, view->schema->row_size);
+  }
+  else
+  {
+    leaf_node_read_row(view->node, view->cell_num, destination);
   }
 }
 
+/* Heap sorts the rows held and appends them to the run file as one run */
 void
-create_new_root(
-  table_t*      table,
-  uint32_t      right_child_page_num
+sort_spill(
+  sort_t* sort
 )
 {
-  /*
-  Handle splitting the root.
-  Old root copied to new page, becomes left child.
-  Address of right child passed in.
-  Re-initialize root page to contain the new root node.
-  New root node points to two children.
-  */
-  void*     root                = get_page(table->pager, table->root_page_num);
-  void*     right_child         = get_page(table->pager, right_child_page_num);
-  uint32_t  left_child_page_num = get_unused_page_num(table->pager);
-  void*     left_child          = get_page(table->pager, left_child_page_num);
+  uint8_t   buffer[PAGE_SIZE * 16];
+  uint32_t  rows_per_write = sizeof(buffer) / sort->row_size;
+  uint32_t  used           = 0;
 
-  /* Left child has data copied from old root */
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
+  if (sort->fd == -1)
+  {
+    sort->fd = open(sort->path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (sort->fd == -1)
+    {
+      printf("Unable to open sort file.\n");
+      exit(EXIT_FAILURE);
+    }
+    // Nothing else needs the name, the runs go away with the descriptor
+    unlink(sort->path);
+  }
 
-  /* Root node is a new internal node with one key and two children */
-  initialize_internal_node(root);
-  set_node_root(root, true);
+  sort_heapsort(sort, sort->items, sort->count);
+  sort->runs = realloc(sort->runs, (sort->num_runs + 1) * sizeof(sort_run_t));
+  sort_run_t* run = &(sort->runs[sort->num_runs]);
+  run->offset     = sort->file_size;
+  run->remaining  = sort->count;
+  run->rows       = NULL;
+  sort->num_runs += 1;
+  sort->table->pager->stats.sort_runs += 1;
 
-  *internal_node_num_keys(root)    = 1;
-  *internal_node_child(root, 0)    = left_child_page_num;
-  uint32_t  left_child_max_key     = get_node_max_key(left_child);
-  *internal_node_key(root, 0)      = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child)         = table->root_page_num;
-  *node_parent(right_child)        = table->root_page_num; 
+  for (uint32_t i = 0; i < sort->count; i++)
+  {
+    memcpy(buffer + used * sort->row_size, sort->items[i].row, sort->row_size);
+    used += 1;
+    if (used == rows_per_write || i + 1 == sort->count)
+    {
+      ssize_t bytes = pwrite(sort->fd, buffer, used * sort->row_size, sort->file_size);
+      if (bytes != (ssize_t)(used * sort->row_size))
+      {
+        printf("Error writing sort file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      sort->file_size += bytes;
+      used             = 0;
+    }
+  }
+  sort->count = 0;
 }
 
 bool
-is_node_root(
-  void*   node
+sort_collect_row(
+  row_view_t* view,
+  void*       context
 )
 {
-  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-  return  (bool)value;
+  sort_t* sort = context;
+
+  if (sort->top_k && sort->count == sort->capacity)
+  {
+    // The root is the worst row kept, replace it when this one sorts before it
+    row_view_copy(view, sort->scratch);
+    if (sort_compare(sort, sort->scratch, sort->items[0].row) < 0)
+    {
+      memcpy(sort->items[0].row, sort->scratch, sort->row_size);
+      sort_sift_down(sort, sort->items, sort->count, 0, false);
+    }
+    return true;
+  }
+  if (sort->count == sort->capacity)
+  {
+    sort_spill(sort);
+  }
+  row_view_copy(view, sort->items[sort->count].row);
+  sort->count += 1;
+  if (sort->top_k && sort->count == sort->capacity)
+  {
+    sort_heapify(sort, sort->items, sort->count, false);
+  }
+  return true;
 }
 
-void
-set_node_root(
-  void*   node,
-  bool    is_root
+bool
+sort_run_refill(
+  sort_t*     sort,
+  sort_run_t* run
 )
 {
-  uint8_t      value                    = is_root;
-  *((uint8_t*) (node + IS_ROOT_OFFSET)) = value;
+  uint32_t rows_per_read = PAGE_SIZE / sort->row_size > 0 ? PAGE_SIZE / sort->row_size : 1;
+  uint32_t count         = run->remaining < rows_per_read ? run->remaining : rows_per_read;
+  if (count == 0)
+  {
+    return false;
+  }
+  if (run->rows == NULL)
+  {
+    run->rows = malloc((size_t)rows_per_read * sort->row_size);
+  }
+  if (pread(sort->fd, run->rows, (size_t)count * sort->row_size, run->offset) !=
+      (ssize_t)((size_t)count * sort->row_size))
+  {
+    printf("Error reading sort file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  run->offset    += (off_t)count * sort->row_size;
+  run->remaining -= count;
+  run->count      = count;
+  run->position   = 0;
+  return true;
 }
 
+/* Merges the runs with a heap holding each run's next row */
 void
-update_internal_node_key(
-  void*       node,
-  uint32_t    old_key,
-  uint32_t    new_key
+sort_merge_runs(
+  sort_t* sort
 )
 {
-  uint32_t old_child_index = internal_node_find_child(node ,old_key);
+  sort_item_t* heap  = malloc(sort->num_runs * sizeof(sort_item_t));
+  uint32_t     count = 0;
+
+  for (uint32_t i = 0; i < sort->num_runs; i++)
+  {
+    if (sort_run_refill(sort, &(sort->runs[i])))
+    {
+      heap[count].row = sort->runs[i].rows;
+      heap[count].run = i;
+      count          += 1;
+    }
+  }
+  sort_heapify(sort, heap, count, true);
+
+  while (count > 0)
+  {
+    sort_run_t* run  = &(sort->runs[heap[0].run]);
+    row_view_t  view = row_view_of(sort->table, heap[0].row);
+    if (!sort_emit(sort, &view))
+    {
+      break;
+    }
+    run->position += 1;
+    if (run->position < run->count || sort_run_refill(sort, run))
+    {
+      heap[0].row = run->rows + (size_t)run->position * sort->row_size;
+    }
+    else
+    {
+      heap[0] = heap[count - 1];
+      count  -= 1;
+    }
+    sort_sift_down(sort, heap, count, 0, true);
+  }
+  free(heap);
+}
+
+/* Rows in id order from the given rank, found by the subtree row counts of internal nodes */
+cursor_t*
+table_seek_rank(
+  table_t*  table,
+  uint32_t  rank
+)
+{
+  uint32_t  page_num = table->root_page_num;
+  void*     node     = get_page(table->pager, page_num);
+
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t child    = *internal_node_right_child(node);
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+      uint32_t count = node_row_count(get_page(table->pager, *internal_node_child(node, i)));
+      if (rank < count)
+      {
+        child = *internal_node_child(node, i);
+        break;
+      }
+      rank -= count;
+    }
+    page_num = child;
+    node     = get_page(table->pager, page_num);
+  }
 
-  *internal_node_key(node, old_child_index) = new_key;
+  cursor_t* cursor = malloc(sizeof(cursor_t));
+  table->pager->stats.cursors_allocated += 1;
+  cursor->table        = table;
+  cursor->page_num     = page_num;
+  cursor->cell_num     = rank;
+  cursor->end_of_table = rank >= *leaf_node_num_cells(node);
+  return cursor;
 }
 
+/* Rows [offset, offset + limit) in id order, or the same window counted from the end */
 void
-internal_node_insert(
-  table_t*    table,
-  uint32_t    parent_page_num,
-  uint32_t    child_page_num
+table_select_rank(
+  table_t*        table,
+  sort_t*         sort,
+  uint32_t        offset,
+  uint32_t        limit
 )
 {
-  void*     parent            = get_page(table->pager, parent_page_num);
-  void*     child             = get_page(table->pager, child_page_num);
-  uint32_t  child_max_key     = get_node_max_key(child);
-  uint32_t  index             = internal_node_find_child(parent, child_max_key);
-  uint32_t  original_num_keys = *internal_node_num_keys(parent);
+  db_stats_t* stats = &(table->pager->stats);
 
-  *internal_node_num_keys(parent) = original_num_keys + 1;
+  // Ranks are counted in the tree, so buffered rows go in first
+  table_flush_write_buffer(table);
+  stats->rank_seeks += 1;
 
-  if(original_num_keys >= INTERNAL_NODE_MAX_CELLS)
+  uint32_t total = node_row_count(get_page(table->pager, table->root_page_num));
+  if (offset >= total)
   {
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
+    return;
   }
-  
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void*    right_child          = get_page(table->pager, right_child_page_num);
+  uint32_t  count  = limit < total - offset ? limit : total - offset;
+  uint32_t  first  = sort->descending ? total - offset - count : offset;
+  cursor_t* cursor = table_seek_rank(table, first);
+  uint8_t*  rows   = sort->descending ? malloc((size_t)count * sort->row_size) : NULL;
 
-  if(child_max_key > get_node_max_key(right_child))
+  sort->skip = 0;
+  for (uint32_t i = 0; i < count && !(cursor->end_of_table); i++)
   {
-    //replace right child
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
-    *internal_node_right_child(parent) = child_page_num;
+    row_view_t view = row_view_at(cursor);
+    stats->rows_examined += 1;
+    if (rows != NULL)
+    {
+      row_view_copy(&view, rows + (size_t)i * sort->row_size);
+    }
+    else if (!sort_emit(sort, &view))
+    {
+      break;
+    }
+    cursor_advance(cursor);
   }
-  else
+  free(cursor);
+
+  for (uint32_t i = count; rows != NULL && i > 0; i--)
   {
-    /* Make room for the new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) 
+    row_view_t view = row_view_of(table, rows + (size_t)(i - 1) * sort->row_size);
+    if (!sort_emit(sort, &view))
     {
-      void* destination = internal_node_cell(parent, i);
-      void* source      = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+      break;
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index)   = child_max_key;
   }
+  free(rows);
 }
 
-void
-leaf_node_split_and_insert(
-  cursor_t*     cursor,
-  uint32_t      key,
-  row_t*        value
+/*
+ Hands the rows of a select with order by, limit or offset to visitor. Without an order by
+ the rows come in the order of the access path, as for any other select.
+*/
+execute_result_e
+table_select_ordered(
+  database_t*     database,
+  table_t*        table,
+  statement_t*    statement,
+  row_visitor_t   visitor,
+  void*           context
 )
 {
-  /*
-  Create a new node and move half the cells over.
-  Insert the new value in one of the two nodes.
-  Update parent or create a new parent.
-  */
-  void*     old_node      = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t  old_max       = get_node_max_key(old_node);
-  uint32_t  new_page_num  = get_unused_page_num(cursor->table->pager);
-  void*     new_node      = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node)         = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
-  /*
-  All existing keys plus new key should be divided
-  evenly between old (left) and new (right) nodes.
-  Starting from the right, move each key to correct position.
-  */
-  for(int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--)
+  db_stats_t*     stats   = &(table->pager->stats);
+  where_clause_t* where   = &(statement->where);
+  uint32_t        column  = 0;
+  uint64_t        before  = stats->rows_returned;
+  sort_t          sort    = { 0 };
+
+  if (statement->order_column != NULL)
   {
-    void* destination_node;
-    if(i >= LEAF_NODE_LEFT_SPLIT_COUNT)
+    if (!schema_find_column(&(table->schema), statement->order_column, &column))
     {
-      destination_node = new_node;
+      return EXECUTE_COLUMN_NOT_FOUND;
+    }
+    if (table->schema.columns[column].type == COLUMN_TYPE_OVERFLOW_TEXT)
+    {
+      return EXECUTE_TYPE_MISMATCH;
+    }
+  }
+
+  sort.table      = table;
+  sort.column     = &(table->schema.columns[column]);
+  sort.descending = statement->order_descending;
+  sort.row_size   = table->schema.row_size;
+  sort.skip       = statement->offset;
+  sort.remaining  = statement->limit == UINT32_MAX ? UINT64_MAX : statement->limit;
+  sort.visitor    = visitor;
+  sort.context    = context;
+  sort.fd         = -1;
+  if (statement->limit == 0)
+  {
+    return EXECUTE_SUCCESS;
+  }
+
+  uint64_t window = (uint64_t)statement->offset + statement->limit;
+  bool     fits   = statement->limit != UINT32_MAX &&
+                    (uint64_t)statement->limit * sort.row_size <= database->sort_memory;
+
+  if (column == 0 && where->op == WHERE_NONE && (!sort.descending || fits))
+  {
+    table_select_rank(table, &sort, statement->offset, statement->limit);
+  }
+  else if (statement->order_column == NULL)
+  {
+    table_select_where(table, where, sort_limit_row, &sort);
+  }
+  else
+  {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.sort", database->filename);
+    sort.path     = path;
+    sort.top_k    = statement->limit != UINT32_MAX && window * sort.row_size <= database->sort_memory;
+    sort.capacity = sort.top_k ? (uint32_t)window : database->sort_memory / sort.row_size;
+    if (sort.capacity == 0)
+    {
+      sort.capacity = 1;
+    }
+    sort.rows     = malloc((size_t)sort.capacity * sort.row_size);
+    sort.scratch  = malloc(sort.row_size);
+    sort.items    = malloc((size_t)sort.capacity * sizeof(sort_item_t));
+    for (uint32_t i = 0; i < sort.capacity; i++)
+    {
+      sort.items[i].row = sort.rows + (size_t)i * sort.row_size;
+    }
+    stats->sorts       += 1;
+    stats->top_k_sorts += sort.top_k;
+
+    table_select_where(table, where, sort_collect_row, &sort);
+    if (sort.num_runs == 0)
+    {
+      sort_heapsort(&sort, sort.items, sort.count);
+      for (uint32_t i = 0; i < sort.count; i++)
+      {
+        row_view_t view = row_view_of(table, sort.items[i].row);
+        if (!sort_emit(&sort, &view))
+        {
+          break;
+        }
+      }
     }
     else
     {
-      destination_node = old_node;
+      if (sort.count > 0)
+      {
+        sort_spill(&sort);
+      }
+      sort_merge_runs(&sort);
+      close(sort.fd);
     }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void*    destination       = leaf_node_cell(destination_node, index_within_node);
+    for (uint32_t i = 0; i < sort.num_runs; i++)
+    {
+      free(sort.runs[i].rows);
+    }
+    free(sort.runs);
+    free(sort.items);
+    free(sort.scratch);
+    free(sort.rows);
+  }
+
+  // The scans count what they examined; only what passed the limit was returned
+  stats->rows_returned = before + sort.emitted;
+  return EXECUTE_SUCCESS;
+}
+
+execute_result_e
+execute_aggregate(
+  statement_t*  statement,
+  table_t*      table
+)
+{
+  aggregate_state_t state = { 0 };
 
-    if(i == cursor->cell_num)
-    {
-      //serialize_row(value, destination);
-      serialize_row(value, leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    }
-    else if(i > cursor->cell_num)
+  // Aggregates read the tree's metadata and leaves directly
+  table_flush_write_buffer(table);
+
+  if (statement->aggregate != AGGREGATE_COUNT)
+  {
+    if (!schema_find_column(&(table->schema), statement->aggregate_column, &(state.column)))
     {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+      return EXECUTE_COLUMN_NOT_FOUND;
     }
-    else
+    if (table->schema.columns[state.column].type != COLUMN_TYPE_INT)
     {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+      return EXECUTE_TYPE_MISMATCH;
     }
   }
 
-  /* Update cell count on both leaf nodes */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-  if(is_node_root(old_node))
+  /* Only the primary key can be answered from the tree itself */
+  if (statement->where.op != WHERE_NONE || state.column != 0)
   {
-    return create_new_root(cursor->table, new_page_num);
+    table_select_where(table, &(statement->where), accumulate_row, &state);
+    print_aggregate(table->pager, statement->aggregate, &state);
+    return EXECUTE_SUCCESS;
   }
-  else
+
+  void* root  = get_page(table->pager, table->root_page_num);
+  state.count = node_row_count(root);
+  if (state.count == 0)
   {
-    uint32_t parent_page_num  = *node_parent(old_node);
-    uint32_t new_max          = get_node_max_key(old_node);
-    void*    parent           = get_page(cursor->table->pager, parent_page_num);
+    print_aggregate(table->pager, statement->aggregate, &state);
+    return EXECUTE_SUCCESS;
+  }
 
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
-    return;
+  switch (statement->aggregate)
+  {
+    case (AGGREGATE_MIN):
+      state.min = table_min_key(table);
+      break;
+    case (AGGREGATE_MAX):
+      state.max = get_node_max_key(table->pager, root);
+      break;
+    case (AGGREGATE_SUM):
+    case (AGGREGATE_AVG):
+    {
+      /* No per-subtree sums are kept, so walk the leaf keys only */
+      table->pager->stats.full_scans += 1;
+      cursor_t* cursor = table_start(table);
+      while (!(cursor->end_of_table))
+      {
+        void* node = get_page(table->pager, cursor->page_num);
+        table->pager->stats.rows_examined += 1;
+        state.sum += *leaf_node_key(node, cursor->cell_num);
+        cursor_advance(cursor);
+      }
+      free(cursor);
+      break;
+    }
+    default:
+      break;
   }
+  print_aggregate(table->pager, statement->aggregate, &state);
+  return EXECUTE_SUCCESS;
 }
 
-void 
-leaf_node_insert(
-  cursor_t* cursor, 
-  uint32_t  key, 
-  row_t*    value
+execute_result_e
+execute_select(
+  statement_t*  statement, 
+  database_t*   database,
+  table_t*      table
 ) 
 {
-  void*    node       = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t num_cells  = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) 
+  execute_result_e result = resolve_where(table, &(statement->where));
+  if (result != EXECUTE_SUCCESS)
   {
-    // Node full
-    // printf("Need to implement splitting a leaf node.\n");
-    // exit(EXIT_FAILURE);
-    leaf_node_split_and_insert(cursor, key, value);
-    return;
+    return result;
   }
 
-  if (cursor->cell_num < num_cells) 
+  if (statement->aggregate != AGGREGATE_NONE)
   {
-    // Make room for new cell
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) 
-    {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
-    }
+    return execute_aggregate(statement, table);
+  }
+
+  result_writer_t writer;
+  result_writer_init(&writer, stdout, database->result_format, table->pager);
+  if (statement->order_column != NULL || statement->limit != UINT32_MAX || statement->offset != 0)
+  {
+    result = table_select_ordered(database, table, statement, result_writer_row, &writer);
+  }
+  else
+  {
+    table_select_where(table, &(statement->where), result_writer_row, &writer);
   }
+  result_writer_finish(&writer);
 
-  *(leaf_node_num_cells(node))            += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+  return result;
 }
 
 execute_result_e 
-execute_insert(
-  statement_t*  statement, 
-  table_t*      table
+dispatch_statement(
+  statement_t*  statement,
+  database_t*   database
 ) 
 {
-  void*     node    = get_page(table->pager, table->root_page_num);
-  // if ((*leaf_node_num_cells(node)) >= LEAF_NODE_MAX_CELLS) 
-  // {
-  uint32_t num_cells = (*leaf_node_num_cells(node));
-  // if(num_cells >= LEAF_NODE_MAX_CELLS)
-  // {  
-  //   return EXECUTE_TABLE_FULL;
-  // }
-
-  row_t*    row_to_insert = &(statement->row_to_insert);
-//  cursor_t* cursor        = table_end(table);
+  if (statement->type == STATEMENT_CREATE_TABLE)
+  {
+    return execute_create_table(statement, database);
+  }
 
-  // serialize_row(row_to_insert, cursor_value(cursor));
-  // table->num_rows += 1;
+  const char* name  = statement->table_name ? statement->table_name : DEFAULT_TABLE_NAME;
+  table_t*    table = database_find_table(database, name);
+  if (table == NULL)
+  {
+    return EXECUTE_TABLE_NOT_FOUND;
+  }
 
-  uint32_t  key_to_insert = row_to_insert->id;
-  cursor_t* cursor        = table_find(table, key_to_insert);
-  if(cursor->cell_num < num_cells)
+  switch (statement->type) 
   {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if(key_at_index == key_to_insert)
-    {
-      return EXECUTE_DUPLICATE_KEY;
-    }
+    case (STATEMENT_INSERT):
+      return execute_insert(statement, table);
+    case (STATEMENT_SELECT):
+      return execute_select(statement, database, table);
+    case (STATEMENT_CREATE_INDEX):
+      return execute_create_index(statement, database, table);
+    case (STATEMENT_COPY_FROM):
+      return execute_copy_from(statement, table);
+    case (STATEMENT_COPY_TO):
+      return execute_copy_to(statement, table);
+    case (STATEMENT_UPDATE):
+      return execute_update(statement, table);
+    default:
+      return EXECUTE_SUCCESS;
   }
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-  free(cursor);
-  return EXECUTE_SUCCESS;
 }
 
-void 
-print_row(
-  row_t* row
-) 
+/* Bucket b holds durations in [2^b, 2^(b+1)) ns */
+uint32_t
+latency_bucket(
+  uint64_t  elapsed_ns
+)
 {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+  uint32_t bucket = 0;
+  while (elapsed_ns > 1 && bucket < STATS_LATENCY_BUCKETS - 1)
+  {
+    elapsed_ns >>= 1;
+    bucket      += 1;
+  }
+  return bucket;
 }
 
-execute_result_e
-execute_select(
-  statement_t*  statement, 
-  table_t*      table
-) 
+/*
+ EXPLAIN ANALYZE report, from the difference of the counters around one statement.
+ Output time is spent printing rows and is not part of execute time.
+*/
+void
+print_explain(
+  statement_t*  statement,
+  db_stats_t*   before,
+  db_stats_t*   after,
+  uint64_t      elapsed_ns
+)
 {
-  row_t     row;
-  cursor_t* cursor = table_start(table);
-  while (!(cursor->end_of_table))
+  uint64_t output_ns = after->output_ns - before->output_ns;
+
+  printf("Plan:\n");
+  if (after->bloom_skips != before->bloom_skips && after->point_seeks == before->point_seeks)
   {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+    printf("access path: bloom filter, key absent\n");
   }
-
-  free(cursor);
-
-  return EXECUTE_SUCCESS;
+  else if (after->rank_seeks != before->rank_seeks)
+  {
+    printf("access path: rank seek (subtree row counts)\n");
+  }
+  else if (after->full_scans != before->full_scans)
+  {
+    printf("access path: full scan (table_start)\n");
+  }
+  else if (after->index_scans != before->index_scans)
+  {
+    printf("access path: index range scan on %s (index_find)\n", statement->where.column_name);
+  }
+  else if (after->point_seeks != before->point_seeks)
+  {
+    printf("access path: point seek (table_find)\n");
+  }
+  else if (after->fast_appends != before->fast_appends)
+  {
+    printf("access path: rightmost leaf append\n");
+  }
+  else if (statement->type == STATEMENT_SELECT && statement->aggregate != AGGREGATE_NONE)
+  {
+    printf("access path: tree metadata\n");
+  }
+  else
+  {
+    printf("access path: none\n");
+  }
+  if (after->sort_runs != before->sort_runs)
+  {
+    printf("sort: external merge of %llu runs\n", (unsigned long long)(after->sort_runs - before->sort_runs));
+  }
+  else if (after->top_k_sorts != before->top_k_sorts)
+  {
+    printf("sort: top-k heap\n");
+  }
+  else if (after->sorts != before->sorts)
+  {
+    printf("sort: in memory\n");
+  }
+  printf("pages touched: %llu\n",
+         (unsigned long long)(after->cache_hits + after->cache_misses -
+                              before->cache_hits - before->cache_misses));
+  printf("pages read: %llu\n", (unsigned long long)(after->pages_read - before->pages_read));
+  printf("rows examined: %llu\n", (unsigned long long)(after->rows_examined - before->rows_examined));
+  printf("rows returned: %llu\n", (unsigned long long)(after->rows_returned - before->rows_returned));
+  printf("parse_ns: %llu\n", (unsigned long long)statement->parse_ns);
+  printf("execute_ns: %llu\n", (unsigned long long)(elapsed_ns - output_ns));
+  printf("output_ns: %llu\n", (unsigned long long)output_ns);
 }
 
-execute_result_e 
+/* Runs one statement and records its latency by statement type */
+execute_result_e
 execute_statement(
   statement_t*  statement,
-  table_t*      table
-) 
+  database_t*   database
+)
 {
-  switch (statement->type) 
+  pager_release_pages(database->pager);
+
+  db_stats_t*       stats   = &(database->pager->stats);
+  db_stats_t        before;
+  db_stats_snapshot(database, &before);
+  uint64_t          start   = monotonic_ns();
+  execute_result_e  result  = dispatch_statement(statement, database);
+  uint64_t          elapsed = monotonic_ns() - start;
+
+  stats->statements[statement->type]   += 1;
+  stats->statement_ns[statement->type] += elapsed;
+  stats->latency_buckets[statement->type][latency_bucket(elapsed)] += 1;
+
+  if (statement->explain && result == EXECUTE_SUCCESS)
   {
-    case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
-    case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+    print_explain(statement, &before, stats, elapsed);
   }
+  return result;
 }
 
 pager_t*
@@ -1168,40 +8366,224 @@ pager_open(
     pager->file_descriptor  = fd;
     pager->file_length      = file_length; 
     pager->num_pages        = file_length / PAGE_SIZE;
+    pager->page_map         = NULL;
 
-    if(file_length % PAGE_SIZE != 0)
+    // The catalog always starts the file uncompressed and says whether a page map follows
+    if (file_length >= PAGE_SIZE)
+    {
+      uint8_t   catalog[PAGE_SIZE];
+      uint32_t  magic;
+      // Files from before the catalog have a tree node there
+      if (pread(fd, catalog, PAGE_SIZE, 0) == PAGE_SIZE &&
+          (memcpy(&magic, catalog + CATALOG_MAGIC_OFFSET, CATALOG_MAGIC_SIZE), magic == CATALOG_MAGIC))
+      {
+        pager->page_map = page_map_load(fd, catalog, &(pager->num_pages));
+      }
+    }
+    if(pager->page_map == NULL && file_length % PAGE_SIZE != 0)
     {
       printf("Db file is not a whole number of pages. Corrupt file.\n");
       exit(EXIT_FAILURE);
     }
+    if(pager->num_pages > TABLE_MAX_PAGES)
+    {
+      printf("Db file has more pages than TABLE_MAX_PAGES (%u), rebuild with a larger limit.\n", TABLE_MAX_PAGES);
+      exit(EXIT_FAILURE);
+    }
 
     for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) 
     {
-      pager->pages[i] = NULL;
+      pager->pages[i]           = NULL;
+      pager->clean_copies[i]    = NULL;
+      pager->page_epoch[i]      = 0;
+      pager->page_referenced[i] = 0;
+      pager->page_state[i]      = PAGE_CLEAN;
     }
+    pager->cache_capacity   = PAGER_CACHE_PAGES;
+    pager->num_cached       = 0;
+    pager->epoch            = 1;
+    pager->clock_hand       = 0;
+    pager->writer_hand      = 0;
+    pager->warm_pages       = NULL;
+    pager->num_warm_pages   = 0;
+    pager->next_warm_page   = 0;
+    // Known once the catalog has been read, new files always have them
+    pager->checksums        = pager->num_pages == 0;
+    memset(&(pager->stats), 0, sizeof(db_stats_t));
 
     return pager;
 }
 
-table_t* 
+/* Reads a page of a file from before the catalog, exits if it is not a tree node */
+void
+baseline_read_node(
+  pager_t*  pager,
+  uint32_t  page_num,
+  uint8_t*  page
+)
+{
+  uint32_t num_cells;
+  if (page_num >= pager->num_pages ||
+      pread(pager->file_descriptor, page, PAGE_SIZE, pager_page_offset(page_num)) != PAGE_SIZE)
+  {
+    printf("Db file in the format before the catalog has no page %u. Corrupt file.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&num_cells, page + BASELINE_NUM_CELLS_OFFSET, sizeof(uint32_t));
+  if ((page[NODE_TYPE_OFFSET] != NODE_LEAF && page[NODE_TYPE_OFFSET] != NODE_INTERNAL) ||
+      (page[NODE_TYPE_OFFSET] == NODE_LEAF && num_cells > BASELINE_LEAF_MAX_CELLS) ||
+      (page[NODE_TYPE_OFFSET] == NODE_INTERNAL && num_cells > INTERNAL_NODE_MAX_CELLS))
+  {
+    printf("Db file in the format before the catalog has a bad page %u. Corrupt file.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Page 0 is a root node instead of a catalog: a file from before the catalog */
+bool
+baseline_detect(
+  pager_t*  pager
+)
+{
+  uint8_t   page[PAGE_SIZE];
+  uint32_t  magic;
+  if (pager->num_pages == 0 || pager->page_map != NULL ||
+      pread(pager->file_descriptor, page, PAGE_SIZE, pager_page_offset(CATALOG_PAGE_NUM)) != PAGE_SIZE)
+  {
+    return false;
+  }
+  memcpy(&magic, page + CATALOG_MAGIC_OFFSET, CATALOG_MAGIC_SIZE);
+  return magic != CATALOG_MAGIC && (page[NODE_TYPE_OFFSET] == NODE_LEAF || page[NODE_TYPE_OFFSET] == NODE_INTERNAL) &&
+         page[IS_ROOT_OFFSET] == 1;
+}
+
+/*
+ Rewrites a file from before the catalog in the current format, atomically like a vacuum:
+ its rows are read leaf by leaf into the users table of a new file, which then replaces it.
+*/
+void
+database_migrate_baseline(
+  const char* filename,
+  pager_t*    pager
+)
+{
+  char      path[PATH_MAX];
+  char      warm_path[PATH_MAX];
+  uint8_t   page[PAGE_SIZE];
+  uint32_t  page_num  = 0;
+  uint32_t  visited   = 0;
+  snprintf(path, sizeof(path), "%s.migrate", filename);
+  snprintf(warm_path, sizeof(warm_path), "%s.migrate.warm", filename);
+  unlink(path);
+
+  // Down the leftmost children to the first leaf, then along the leaves
+  baseline_read_node(pager, page_num, page);
+  while (page[NODE_TYPE_OFFSET] == NODE_INTERNAL && visited++ < pager->num_pages)
+  {
+    uint32_t num_keys;
+    memcpy(&num_keys, page + BASELINE_NUM_CELLS_OFFSET, sizeof(uint32_t));
+    memcpy(&page_num, page + (num_keys == 0 ? BASELINE_NEXT_PAGE_OFFSET : BASELINE_NODE_HEADER_SIZE),
+           sizeof(uint32_t));
+    baseline_read_node(pager, page_num, page);
+  }
+
+  database_t* migrated  = db_open(path);
+  table_t*    table     = migrated->tables[0];
+  while (true)
+  {
+    // A leaf link back into the chain would loop forever
+    if (page[NODE_TYPE_OFFSET] != NODE_LEAF || visited++ >= pager->num_pages)
+    {
+      printf("Db file in the format before the catalog has a bad page %u. Corrupt file.\n", page_num);
+      exit(EXIT_FAILURE);
+    }
+    uint32_t num_cells;
+    memcpy(&num_cells, page + BASELINE_NUM_CELLS_OFFSET, sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_cells; i++)
+    {
+      // The baseline row is the users table's row
+      void* row = page + BASELINE_NODE_HEADER_SIZE + i * BASELINE_LEAF_CELL_SIZE + sizeof(uint32_t);
+      if (table_insert(table, row) != EXECUTE_SUCCESS)
+      {
+        printf("Could not migrate row %u of the db file in the format before the catalog.\n", i);
+        exit(EXIT_FAILURE);
+      }
+    }
+    memcpy(&page_num, page + BASELINE_NEXT_PAGE_OFFSET, sizeof(uint32_t));
+    if (page_num == 0)
+    {
+      break;
+    }
+    baseline_read_node(pager, page_num, page);
+  }
+
+  pager_flush_all(migrated->pager);
+  bool synced = fsync(migrated->pager->file_descriptor) != -1;
+  db_close(migrated);
+  unlink(warm_path);
+  if (!synced || rename(path, filename) == -1)
+  {
+    unlink(path);
+    printf("Could not rewrite the db file from the format before the catalog.\n");
+    exit(EXIT_FAILURE);
+  }
+  vacuum_sync_directory(filename);
+}
+
+database_t* 
 db_open(
   const char* filename
 ) 
 {
-  pager_t* pager        = pager_open(filename);
+  pager_t*    pager       = pager_open(filename);
+  if (baseline_detect(pager))
+  {
+    // Nothing was cached from the old file, the new one is opened in its place
+    database_migrate_baseline(filename, pager);
+    close(pager->file_descriptor);
+    free(pager);
+    pager = pager_open(filename);
+  }
 //  uint32_t num_rows  = pager->file_length / ROW_SIZE;
-  table_t* table        = (table_t*)malloc(sizeof(table_t));
-  table->pager          = pager;
+  database_t* database    = malloc(sizeof(database_t));
+  database->filename      = strdup(filename);
+  database->pager         = pager;
+  database->num_tables    = 0;
+  database->memtable_rows = 0;
+  database->result_format = RESULT_FORMAT_TEXT;
+  database->sort_memory   = SORT_MEMORY_SIZE;
+  database->writer_running  = false;
+  database->writer_stopping = false;
+  pthread_mutex_init(&(database->lock), NULL);
+  pthread_mutex_init(&(database->writer_mutex), NULL);
+  pthread_cond_init(&(database->writer_wake), NULL);
 //  table->num_rows    = num_rows;
-  table->root_page_num  = 0;
   if(pager->num_pages == 0)
   {
-    // New database file. Initialize page 0 as leaf node.
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
+    // New database file. Page 0 is the catalog, page 1 the root of the default table.
+    schema_t  schema;
+    schema_init_users(&schema);
+    table_t*  table       = table_new(database, DEFAULT_TABLE_NAME, &schema);
+    table->root_page_num  = 1;
+    void*     root_node   = get_page(pager, table->root_page_num);
+    initialize_table_leaf_node(root_node, &schema, table->leaf_layout);
     set_node_root(root_node, true);
+    table_attach_bloom(table);
+    catalog_save(database);
+    return database;
   }
-  return table;
+
+  // Pages without a checksum trailer may use its bytes, only a rewrite can add one
+  if (catalog_load(database) >= CATALOG_CHECKSUM_VERSION)
+  {
+    database_load_warm(database);
+  }
+  else if (database_vacuum(database, VACUUM_DEFAULT_FILL, false) != EXECUTE_SUCCESS)
+  {
+    printf("Could not rewrite the db file with page checksums.\n");
+    exit(EXIT_FAILURE);
+  }
+  return database;
 }
 
 // void 
@@ -1217,6 +8599,118 @@ db_open(
 // }
 
 
+/* process_input() with the database lock held */
+bool
+run_input(
+  input_buffer_t* input_buffer,
+  database_t*     database
+)
+{
+  if(input_buffer->buffer[0] == '.')
+  {
+    switch(do_meta_command(input_buffer, database))
+    {
+      case (META_COMMAND_SUCCESS):
+        return true;
+      case (META_COMMAND_UNRECONGNIZED_COMMAND):
+        printf("Unrecognized command '%s'\n", input_buffer->buffer);
+        return false;
+    }
+  }
+  statement_t statement;
+  switch(prepare_statement(input_buffer, &statement))
+  {
+    case (PREPARE_SUCCESS):
+      break;
+    case (PREPARE_NEGATIVE_ID):
+      printf("ID must be positive.\n"); 
+      return false; 
+    case (PREPARE_STRING_TOO_LONG):
+      printf("String is too long.\n");
+      return false;
+    case (PREPARE_SYNTAX_ERROR):
+      printf("Syntax error. Could not parse statement.\n");
+      return false;
+    case (PREPARE_UNRECOGNIZED_STATEMENT):
+      printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
+      return false;
+  }
+
+  switch (execute_statement(&statement, database))
+  {
+  case (EXECUTE_SUCCESS):
+    printf("Executed.\n");
+    return true;
+  case (EXECUTE_DUPLICATE_KEY):
+    printf("Error: Duplicate key.\n");
+    break;
+  case (EXECUTE_TABLE_FULL):
+    printf("Error: Table full.\n");
+    break;
+  case (EXECUTE_DUPLICATE_INDEX):
+    printf("Error: Index already exists.\n");
+    break;
+  case (EXECUTE_STRING_TOO_LONG):
+    printf("String is too long.\n");
+    break;
+  case (EXECUTE_WRONG_VALUE_COUNT):
+    printf("Syntax error. Could not parse statement.\n");
+    break;
+  case (EXECUTE_TABLE_NOT_FOUND):
+    printf("Error: Table not found.\n");
+    break;
+  case (EXECUTE_COLUMN_NOT_FOUND):
+    printf("Error: Column not found.\n");
+    break;
+  case (EXECUTE_DUPLICATE_TABLE):
+    printf("Error: Table already exists.\n");
+    break;
+  case (EXECUTE_CATALOG_FULL):
+    printf("Error: Catalog full.\n");
+    break;
+  case (EXECUTE_ROW_TOO_LARGE):
+    printf("Error: Row too large.\n");
+    break;
+  case (EXECUTE_TYPE_MISMATCH):
+    printf("Error: Type mismatch.\n");
+    break;
+  case (EXECUTE_NEGATIVE_ID):
+    printf("ID must be positive.\n");
+    break;
+  case (EXECUTE_FILE_ERROR):
+    printf("Error: Could not read file.\n");
+    break;
+  case (EXECUTE_WRITE_ERROR):
+    printf("Error: Could not write file.\n");
+    return false;
+  case (EXECUTE_KEY_REQUIRED):
+    printf("Error: Update needs where <key column> = <id>.\n");
+    return false;
+  case (EXECUTE_KEY_UPDATE):
+    printf("Error: The key column cannot be updated.\n");
+    break;
+  }
+  return false;
+}
+
+/*
+ Runs one line of input, a meta command or a statement, and prints its outcome.
+ Returns false if the line failed, shared by the REPL and the server. The page
+ writer only runs between lines.
+*/
+bool
+process_input(
+  input_buffer_t* input_buffer,
+  database_t*     database
+)
+{
+  pthread_mutex_lock(&(database->lock));
+  bool ok = run_input(input_buffer, database);
+  pthread_mutex_unlock(&(database->lock));
+  return ok;
+}
+
+#ifndef DB_STUDY_NO_MAIN
 int main(
     int     argc, 
     char*   argv[]
@@ -1229,54 +8723,39 @@ int main(
   // }
   //char*     filename  = argv[1];
   char*     filename  = "mydb.db";
-  table_t*  table     = db_open(filename);
-  input_buffer_t* input_buffer  = new_input_buffer();
-  while (true) 
-  {
-    print_prompt();
-    read_input(input_buffer);
+  database_t* database = db_open(filename);
 
-    if(input_buffer->buffer[0] == '.')
+  // "--serve <socket> [--workers <n>]" shares this database with local clients
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--format=binary") == 0)
     {
-      switch(do_meta_command(input_buffer, table))
-      {
-        case (META_COMMAND_SUCCESS):
-          continue;
-        case (META_COMMAND_UNRECONGNIZED_COMMAND):
-          printf("Unrecognized command '%s'\n", input_buffer->buffer);
-          continue;
-      }
+      database->result_format = RESULT_FORMAT_BINARY;
     }
-    statement_t statement;
-    switch(prepare_statement(input_buffer, &statement))
+  }
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
     {
-      case (PREPARE_SUCCESS):
-        break;
-      case (PREPARE_NEGATIVE_ID):
-        printf("ID must be positive.\n"); 
-        continue; 
-      case (PREPARE_STRING_TOO_LONG):
-        printf("String is too long.\n");
-        continue;
-      case (PREPARE_SYNTAX_ERROR):
-        printf("Syntax error. Could not parse statement.\n");
-        continue;
-      case (PREPARE_UNRECOGNIZED_STATEMENT):
-        printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
-        continue;
+      uint32_t workers = SERVER_DEFAULT_WORKERS;
+      for (int j = 1; j + 1 < argc; j++)
+      {
+        if (strcmp(argv[j], "--workers") == 0 && atoi(argv[j + 1]) > 0)
+        {
+          workers = atoi(argv[j + 1]);
+        }
+      }
+      return db_serve(database, argv[i + 1], workers);
     }
+  }
 
-    switch (execute_statement(&statement, table))
-    {
-    case (EXECUTE_SUCCESS):
-      printf("Executed.\n");
-      break;
-    case (EXECUTE_DUPLICATE_KEY):
-      printf("Error: Duplicate key.\n");
-      break;
-    case (EXECUTE_TABLE_FULL):
-      printf("Error: Table full.\n");
-      break;
-    }
+  database_start_writer(database);
+  input_buffer_t* input_buffer  = new_input_buffer();
+  while (true) 
+  {
+    print_prompt();
+    read_input(input_buffer);
+    process_input(input_buffer, database);
   }
-}
\ No newline at end of file
+}
+#endif
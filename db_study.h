@@ -3,13 +3,29 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 typedef struct input_buffer_struct  input_buffer_t;
 typedef struct statement_struct     statement_t;
 typedef struct row_struct           row_t;
 typedef struct table_struct         table_t;
+typedef struct database_struct      database_t;
+typedef struct column_struct        column_t;
+typedef struct schema_struct        schema_t;
 typedef struct pager_struct         pager_t;
 typedef struct cursor_struct        cursor_t;
+typedef struct row_view_struct      row_view_t;
+typedef struct index_struct         index_t;
+typedef struct where_clause_struct  where_clause_t;
+typedef struct aggregate_state_struct aggregate_state_t;
+typedef struct db_stats_struct      db_stats_t;
+typedef struct memtable_struct      memtable_t;
+typedef struct memtable_node_struct memtable_node_t;
+typedef struct result_writer_struct result_writer_t;
+typedef struct page_map_struct      page_map_t;
+typedef struct sector_list_struct   sector_list_t;
 
 
 typedef enum meta_command_result_enum   meta_command_result_e;
@@ -17,19 +33,133 @@ typedef enum prepare_result_enum        prepare_result_e;
 typedef enum statement_type_enum        statement_type_e;
 typedef enum execute_result_enum        execute_result_e;
 typedef enum node_type_enum             node_type_e;
+typedef enum aggregate_type_enum        aggregate_type_e;
+typedef enum column_type_enum           column_type_e;
+typedef enum where_operator_enum        where_operator_e;
+typedef enum result_format_enum         result_format_e;
+typedef enum leaf_layout_enum           leaf_layout_e;
+typedef enum page_state_enum            page_state_e;
+
+/* Called once per row produced by a scan; the view is only valid during the call. False ends the scan. */
+typedef bool (*row_visitor_t)(row_view_t* view, void* context);
 
 
 #define COLUMN_USERNAME_SIZE    32
 #define COLUMN_EMAIL_SIZE       255
+#define COLUMN_TEXT_MAX_SIZE    255
+/* Wider text columns keep a prefix in the row and the rest of long values in overflow pages */
+#define COLUMN_OVERFLOW_MAX_SIZE (1 << 20)
 
+#ifndef TABLE_MAX_PAGES
 #define TABLE_MAX_PAGES         100
+#endif
+/* Page numbers are uint32_t and UINT32_MAX is INVALID_PAGE_NUM */
+#if TABLE_MAX_PAGES >= 0xFFFFFFFF
+#error "TABLE_MAX_PAGES must stay below UINT32_MAX"
+#endif
+/*
+ Pages kept in memory at once, the file itself may grow to TABLE_MAX_PAGES.
+ A page handed out since its last flush also keeps a clean copy (see pager_flush()),
+ so the pager holds at most 2 * PAGER_CACHE_PAGES pages. Evictions and the page
+ writer's checkpoints flush pages and so drop their copies.
+*/
+#ifndef PAGER_CACHE_PAGES
+#define PAGER_CACHE_PAGES       TABLE_MAX_PAGES
+#endif
+/* Compressed files store a page in one to PAGE_MAP_SIZE_CLASSES sectors */
+#define PAGE_MAP_SECTOR_SIZE    512
+#define PAGE_MAP_SIZE_CLASSES   8
+#define TABLE_MAX_COLUMNS       8
+#define TABLE_NAME_SIZE         16
+#define COLUMN_NAME_SIZE        16
+#define MEMTABLE_MAX_LEVEL      16
+#define DB_MAX_TABLES           16
+/* copy ... from parses files in up to this many threads, one per chunk of at least the size */
+#define COPY_MAX_THREADS        8
+#define COPY_MIN_CHUNK_SIZE     (1 << 20)
+/* Rows serialized at once for the sorted insert */
+#define COPY_BATCH_ROWS         4096
+/* Binary select results are written in chunks of this size */
+#define RESULT_BUFFER_SIZE      65536
+/* copy ... to writes the file in chunks of this size */
+#define COPY_BUFFER_SIZE        (1 << 20)
+/* .vacuum packs leaves to this percentage of their cells unless given one */
+#define VACUUM_DEFAULT_FILL     90
+/* order by sorts this many bytes of rows in memory, more spill as sorted runs; .sort_memory changes it */
+#define SORT_MEMORY_SIZE        (8 << 20)
+/* The page writer wakes this often and writes at most a batch of cold dirty pages */
+#define PAGER_WRITER_INTERVAL_MS    20
+#define PAGER_WRITER_BATCH_PAGES    64
+/* and starts a checkpoint, a sweep writing every dirty page and a sync, this often */
+#define PAGER_CHECKPOINT_INTERVAL_MS 1000
+/* Eviction looks this many pages past a dirty victim for a clean one */
+#define PAGER_CLEAN_SEARCH_PAGES    32
+/* After a restart the page writer loads the pages listed in <db>.warm, this many per wake up */
+#define PAGER_WARM_BATCH_PAGES      64
+#define PAGER_WARM_MAGIC            0x4D524157  // "WARM"
+/* .check reads the file in up to this many threads, CHECK_READ_PAGES pages per read */
+#define CHECK_MAX_THREADS       8
+#define CHECK_READ_PAGES        64
+/* Deeper trees are reported as cycles, errors past the limit are only counted */
+#define CHECK_MAX_DEPTH         64
+#define CHECK_MAX_REPORTED      20
+/* Threads running statements for clients of --serve */
+#define SERVER_DEFAULT_WORKERS  4
+/* Table the legacy "insert <id> <username> <email>" syntax talks to */
+#define DEFAULT_TABLE_NAME      "users"
+
+/* What the file holds of a cached page */
+enum page_state_enum
+{
+    PAGE_CLEAN,       // as in the file, not handed out since
+    PAGE_HANDED_OUT,  // get_page() returned it, maybe written through: its clean copy tells on flush
+    PAGE_NEW          // not in the file yet
+};
 
 enum node_type_enum
 {
     NODE_INTERNAL,
-    NODE_LEAF
+    NODE_LEAF,
+    NODE_OVERFLOW
+};
+
+/* How a table leaf stores its cells: key and row side by side, or one minipage per column */
+enum leaf_layout_enum
+{
+    LEAF_LAYOUT_ROWS,
+    LEAF_LAYOUT_PAX
+};
+
+enum column_type_enum
+{
+    COLUMN_TYPE_INT,
+    COLUMN_TYPE_TEXT,
+    COLUMN_TYPE_OVERFLOW_TEXT
+};
+
+/*
+ * Column definition as stored in the catalog.
+ * size is the width in the row, text columns include the NUL byte.
+ * max_size is the declared width, which overflow text columns do not keep in the row.
+ */
+struct column_struct
+{
+    char            name[COLUMN_NAME_SIZE];
+    column_type_e   type;
+    uint32_t        size;
+    uint32_t        offset;
+    uint32_t        max_size;
+};
+
+/* The first column is always the int primary key */
+struct schema_struct
+{
+    uint32_t    num_columns;
+    column_t    columns[TABLE_MAX_COLUMNS];
+    uint32_t    row_size;
 };
 
+/* Row layout of the default users table */
 struct row_struct
 {
     uint32_t    id;
@@ -55,13 +185,57 @@ enum meta_command_result_enum
 enum statement_type_enum
 { 
     STATEMENT_INSERT, 
-    STATEMENT_SELECT 
+    STATEMENT_SELECT,
+    STATEMENT_CREATE_INDEX,
+    STATEMENT_CREATE_TABLE,
+    STATEMENT_COPY_FROM,
+    STATEMENT_COPY_TO,
+    STATEMENT_UPDATE
+};
+#define STATEMENT_TYPE_COUNT    7
+
+enum aggregate_type_enum
+{
+    AGGREGATE_NONE,
+    AGGREGATE_COUNT,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_SUM,
+    AGGREGATE_AVG
+};
+
+enum where_operator_enum
+{
+    WHERE_NONE,
+    WHERE_EQUAL,
+    WHERE_PREFIX
+};
+
+enum result_format_enum
+{
+    RESULT_FORMAT_TEXT,
+    RESULT_FORMAT_BINARY,
+    RESULT_FORMAT_CSV
 };
 
 enum execute_result_enum{
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
-  EXECUTE_TABLE_FULL
+  EXECUTE_TABLE_FULL,
+  EXECUTE_DUPLICATE_INDEX,
+  EXECUTE_STRING_TOO_LONG,
+  EXECUTE_WRONG_VALUE_COUNT,
+  EXECUTE_TABLE_NOT_FOUND,
+  EXECUTE_COLUMN_NOT_FOUND,
+  EXECUTE_DUPLICATE_TABLE,
+  EXECUTE_CATALOG_FULL,
+  EXECUTE_ROW_TOO_LARGE,
+  EXECUTE_TYPE_MISMATCH,
+  EXECUTE_NEGATIVE_ID,
+  EXECUTE_FILE_ERROR,
+  EXECUTE_WRITE_ERROR,
+  EXECUTE_KEY_REQUIRED,
+  EXECUTE_KEY_UPDATE
 };
 
 struct cursor_struct
@@ -73,25 +247,248 @@ struct cursor_struct
     bool            end_of_table;// Indicates a position one past the last element
 };
 
+/*
+ * Zero-copy view of a row stored in a leaf cell.
+ * data points straight into the cached page returned by cursor_value(),
+ * so it is only valid until the cursor moves on. Rows of PAX leaves are
+ * spread over the column minipages: data is NULL and node and cell_num
+ * locate each column instead.
+ */
+struct row_view_struct
+{
+    const void*     data;
+    schema_t*       schema;
+    void*           node;
+    uint32_t        cell_num;
+    table_t*        table;    // pager and buffers for overflow text
+};
+
+/*
+ * Always-on engine counters, one set per pager.
+ * latency_buckets[type][b] counts statements that took [2^b, 2^(b+1)) ns.
+ */
+#define STATS_LATENCY_BUCKETS   40
+struct db_stats_struct
+{
+    uint64_t    cache_hits;
+    uint64_t    cache_misses;
+    uint64_t    cache_evictions;
+    uint64_t    pages_read;
+    uint64_t    pages_written;
+    uint64_t    bytes_read;
+    uint64_t    bytes_written;
+    uint64_t    leaf_splits;
+    uint64_t    internal_splits;
+    uint64_t    cursors_allocated;
+    uint64_t    point_seeks;
+    uint64_t    fast_appends;
+    uint64_t    buffered_inserts;
+    uint64_t    rows_updated;       // in place, by update or an insert on conflict
+    uint64_t    buffer_flushes;
+    uint64_t    bloom_skips;
+    uint64_t    bloom_rebuilds;
+    uint64_t    overflow_pages_read;
+    uint64_t    overflow_pages_written;
+    uint64_t    pages_unchanged;    // flushes skipped, the page matched what was read or written
+    uint64_t    eviction_writes;    // evictions that had to write the victim first
+    uint64_t    writer_pages_written;
+    uint64_t    checkpoints;
+    uint64_t    warm_pages_loaded;
+    uint64_t    index_scans;
+    uint64_t    full_scans;
+    uint64_t    rank_seeks;
+    uint64_t    sorts;
+    uint64_t    top_k_sorts;
+    uint64_t    sort_runs;
+    uint64_t    rows_examined;
+    uint64_t    rows_returned;
+    uint64_t    output_ns;
+    uint64_t    statements[STATEMENT_TYPE_COUNT];
+    uint64_t    statement_ns[STATEMENT_TYPE_COUNT];
+    uint64_t    latency_buckets[STATEMENT_TYPE_COUNT][STATS_LATENCY_BUCKETS];
+};
+
+/*
+ * pages[] is indexed by page number and holds NULL for pages not in memory.
+ * At most cache_capacity pages are cached; a miss beyond that evicts with a clock sweep.
+ * Pages fetched since the last pager_release_pages() are never evicted,
+ * so the cache may run over capacity within one operation.
+ */
+struct sector_list_struct
+{
+    uint64_t*   sectors;
+    uint32_t    count;
+    uint32_t    capacity;
+};
+
+/*
+ * Page map of a compressed file, NULL in the pager of a plain one.
+ * entries[] holds sector << 16 | stored bytes of every page, 0 for pages not
+ * written yet; pages stored in PAGE_SIZE bytes did not compress. A page is
+ * written to new sectors each time and its old ones only become free once the
+ * catalog page has been written with a new map, so the map on disk keeps
+ * pointing at the pages it was written with.
+ */
+struct page_map_struct
+{
+    uint64_t        end_sector;     // first sector past the used space
+    uint64_t        map_sector;     // the map referenced by the catalog on disk
+    uint64_t        map_sectors;
+    uint64_t        spare_sector;   // the map before it, reused when large enough
+    uint64_t        spare_sectors;
+    sector_list_t   free[PAGE_MAP_SIZE_CLASSES + 1];  // free[n] holds runs of n sectors
+    sector_list_t   pending;        // sector << 4 | count, free after the next map
+    uint64_t        pending_sectors;
+    uint64_t        entries[TABLE_MAX_PAGES];
+};
+
 struct pager_struct
 {
     int         file_descriptor;
-    uint32_t    file_length;
+    uint64_t    file_length;
     uint32_t    num_pages;
+    uint32_t    cache_capacity;
+    uint32_t    num_cached;
+    uint32_t    epoch;
+    uint32_t    clock_hand;
+    bool        checksums;  // pages carry a CRC32C trailer, set on flush and verified on read
+    page_map_t* page_map;   // compressed files only
+    db_stats_t  stats;
     void*       pages[TABLE_MAX_PAGES];
+    uint32_t    page_epoch[TABLE_MAX_PAGES];
+    uint8_t     page_referenced[TABLE_MAX_PAGES];
+    uint8_t     page_state[TABLE_MAX_PAGES];  // page_state_e
+    void*       clean_copies[TABLE_MAX_PAGES]; // the file's bytes of a handed-out page, freed on flush
+    uint32_t    writer_hand;                  // where the page writer's sweep resumes
+    uint32_t*   warm_pages;                   // listed in <db>.warm, in file order
+    uint32_t    num_warm_pages;
+    uint32_t    next_warm_page;               // first one the page writer has not loaded
+};
+
+/*
+ * Secondary index: a separate B+tree in the same pager,
+ * keyed on (column value, id). root_page_num 0 means no index.
+ */
+struct index_struct
+{
+    uint32_t    column;
+    uint32_t    key_size;
+    uint32_t    root_page_num;
+};
+
+/*
+ * Write buffer: a skiplist of serialized rows ordered by id, drained into
+ * the B+tree in key order when full or before reads that need the tree.
+ * row points just past the node's next[] array, in the same allocation.
+ */
+struct memtable_node_struct
+{
+    uint32_t            key;
+    uint32_t            level;
+    uint8_t*            row;
+    memtable_node_t*    next[];
+};
+
+struct memtable_struct
+{
+    memtable_node_t*    head;
+    uint32_t            level;
+    uint32_t            num_rows;
+    uint32_t            max_rows;
+    uint32_t            row_size;
+    uint64_t            rng;
 };
 
 struct table_struct{
 //  uint32_t  num_rows;
   pager_t*  pager;
+  char      name[TABLE_NAME_SIZE];
   uint32_t  root_page_num;
+  uint32_t  rightmost_leaf;   // hint for appends, checked before use
+  schema_t  schema;
+  index_t   indexes[TABLE_MAX_COLUMNS];
+  memtable_t* memtable;       // NULL unless write buffering is on
+  uint32_t  bloom_root_page_num; // primary key filter, 0 for none
+  leaf_layout_e leaf_layout;    // of every leaf, changed by rewriting the file
+  char*     overflow_values[TABLE_MAX_COLUMNS]; // last overflow text read back per column, NULL until then
 //  void*     pages[TABLE_MAX_PAGES];
 };
 
+/* All tables share one file and one page cache; page 0 is the catalog */
+struct database_struct
+{
+    char*       filename;
+    pager_t*    pager;
+    uint32_t    num_tables;
+    table_t*    tables[DB_MAX_TABLES];
+    uint32_t    memtable_rows;  // write buffer size for each table, 0 for none
+    result_format_e result_format;  // how select prints rows, --format / .format
+    uint32_t    sort_memory;    // bytes of rows an order by sorts in memory
+    pthread_mutex_t lock;       // held by process_input() and by the page writer while it writes
+    pthread_mutex_t writer_mutex;
+    pthread_cond_t  writer_wake;
+    pthread_t   writer;
+    bool        writer_running;
+    bool        writer_stopping;
+};
+
+/* Rows of one select on their way out, binary rows are batched in data */
+struct result_writer_struct
+{
+    FILE*           stream;   // NULL when writing to fd with pwrite()
+    int             fd;
+    uint64_t        offset;
+    bool            failed;
+    result_format_e format;
+    pager_t*        pager;    // output time is accounted in its stats
+    char*           data;
+    uint32_t        length;
+    uint32_t        capacity;
+};
+
+/*
+ * column_name and value point into the input buffer,
+ * column and number are resolved against the table at execution.
+ */
+struct where_clause_struct
+{
+    where_operator_e    op;
+    char*               column_name;
+    char*               value;
+    uint32_t            column;
+    uint32_t            number;
+};
+
+struct aggregate_state_struct
+{
+    uint32_t    column;
+    uint32_t    count;
+    int32_t     min;        // int columns are signed, only keys are never negative
+    int32_t     max;
+    int64_t     sum;
+};
+
 struct statement_struct
 {
     statement_type_e    type;
-    row_t               row_to_insert;
+    char*               table_name;
+    char*               values[TABLE_MAX_COLUMNS];
+    uint32_t            num_values;
+    aggregate_type_e    aggregate;
+    char*               aggregate_column;
+    where_clause_t      where;
+    char*               index_column;
+    schema_t            schema;
+    char*               copy_path;
+    result_format_e     copy_format;
+    bool                explain;
+    uint64_t            parse_ns;
+    char*               order_column;   // NULL for id order
+    bool                order_descending;
+    uint32_t            limit;          // UINT32_MAX for none
+    uint32_t            offset;
+    char*               update_columns[TABLE_MAX_COLUMNS];  // update: set update_columns[i] = values[i]
+    bool                upsert;         // insert ... on conflict do update
 };
 
 struct input_buffer_struct
@@ -101,4 +498,60 @@ struct input_buffer_struct
     ssize_t input_length;
 };
 
-#endif
\ No newline at end of file
+
+/*
+ * Engine API, for tools that link db_study.c built with -DDB_STUDY_NO_MAIN
+ */
+extern const uint32_t PAGE_SIZE;
+database_t*         db_open(const char* filename);
+void                db_close(database_t* database);
+void                database_start_writer(database_t* database);
+void                database_stop_writer(database_t* database);
+table_t*            database_find_table(database_t* database, const char* name);
+execute_result_e    execute_insert(statement_t* statement, table_t* table);
+execute_result_e    table_insert(table_t* table, void* row);
+execute_result_e    table_update(table_t* table, uint32_t key, uint32_t* columns, char** values, uint32_t count,
+                                 bool* found);
+void*               table_get_row(table_t* table, uint32_t key);
+bool                table_contains(table_t* table, uint32_t key);
+void                table_select_where(table_t* table, where_clause_t* where, row_visitor_t visitor, void* context);
+execute_result_e    table_select_ordered(database_t* database, table_t* table, statement_t* statement,
+                                         row_visitor_t visitor, void* context);
+bool                table_may_contain(table_t* table, uint32_t key);
+void                table_flush_write_buffer(table_t* table);
+void                table_insert_sorted(table_t* table, void** rows, uint32_t count);
+execute_result_e    table_copy_from(table_t* table, const char* path, uint32_t* rows_copied, uint64_t* error_line);
+execute_result_e    table_copy_to(table_t* table, const char* path, result_format_e format, uint32_t* rows_copied);
+void                database_set_write_buffer(database_t* database, uint32_t rows);
+execute_result_e    database_vacuum(database_t* database, uint32_t fill_percent, bool compressed);
+uint64_t            database_check(database_t* database);
+cursor_t*           table_find(table_t* table, uint32_t key);
+cursor_t*           table_start(table_t* table);
+void                cursor_advance(cursor_t* cursor);
+void*               cursor_value(cursor_t* cursor);
+row_view_t          row_view_at(cursor_t* cursor);
+uint32_t            row_view_id(row_view_t* view);
+void*               get_page(pager_t* pager, uint32_t page_num);
+void                pager_release_pages(pager_t* pager);
+void                db_stats_snapshot(database_t* database, db_stats_t* stats);
+void                db_stats_reset(database_t* database);
+uint32_t            table_height(table_t* table);
+void                serialize_row(row_t* source, void* destination);
+void                deserialize_row(void* source, row_t* destination);
+uint32_t*           leaf_node_num_cells(void* node);
+uint32_t            leaf_node_max_cells(void* node);
+uint32_t*           leaf_node_key(void* node, uint32_t cell_num);
+void                leaf_node_split_and_insert(cursor_t* cursor, uint32_t key, void* value);
+void                increment_ancestor_row_counts(pager_t* pager, uint32_t page_num);
+bool                process_input(input_buffer_t* input_buffer, database_t* database);
+void                result_writer_init(result_writer_t* writer, FILE* stream, result_format_e format, pager_t* pager);
+void                result_writer_open(result_writer_t* writer, int fd, result_format_e format, pager_t* pager);
+bool                result_writer_row(row_view_t* view, void* context);
+void                result_writer_finish(result_writer_t* writer);
+
+/*
+ * Server mode, server.c
+ */
+int                 db_serve(database_t* database, const char* socket_path, uint32_t num_workers);
+
+#endif
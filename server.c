@@ -0,0 +1,705 @@
+/*
+ * Local server mode, `db_study --serve <socket> [--workers <n>]`.
+ *
+ * One epoll loop accepts clients on a Unix socket and moves their bytes, a pool of
+ * worker threads runs the statements. The engine itself is single threaded, so the
+ * workers take turns on engine_lock; the pool keeps a long statement from stalling
+ * accept, reads and writes of every other client, and all clients share one warm
+ * page cache instead of each opening the file. The page writer thread shares the
+ * database lock process_input() takes, so it writes between requests.
+ *
+ * Protocol, integers are little endian:
+ *   request   u32 length, then length bytes of statement text (one REPL line, no newline)
+ *   response  u32 length, then a u8 status and length - 1 bytes of the text the REPL
+ *             would have printed for that line
+ * ".format binary" switches the client's select results to the binary row encoding.
+ * Requests may be pipelined; everything buffered for a client runs as one batch and
+ * responses come back in request order. ".exit" closes the connection, SIGINT or
+ * SIGTERM stops the server and closes the database.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "db_study.h"
+
+#define SERVER_MAX_EVENTS   64
+#define SERVER_READ_SIZE    65536
+#define SERVER_MAX_REQUEST  (1 << 20)
+#define SERVER_FRAME_HEADER 4
+
+typedef struct byte_buffer_struct   byte_buffer_t;
+typedef struct connection_struct    connection_t;
+typedef struct server_job_struct    server_job_t;
+typedef struct server_struct        server_t;
+
+typedef enum server_status_enum     server_status_e;
+
+enum server_status_enum
+{
+    SERVER_STATUS_OK,
+    SERVER_STATUS_ERROR,
+    SERVER_STATUS_CLOSED
+};
+
+/* Bytes in [start, length) are live, consumed bytes are reclaimed lazily */
+struct byte_buffer_struct
+{
+    char*   data;
+    size_t  start;
+    size_t  length;
+    size_t  capacity;
+};
+
+struct connection_struct
+{
+    int             fd;
+    uint32_t        events;     // what epoll currently watches for
+    byte_buffer_t   input;      // request bytes not yet handed to a worker
+    byte_buffer_t   output;     // response bytes not yet written
+    bool            busy;       // a batch of this client is queued or running
+    bool            closing;    // no more requests, close once output drains
+    bool            hung_up;    // peer is gone, close as soon as not busy
+    result_format_e format;     // only touched by the worker running its batch
+};
+
+/* A batch of complete request frames of one client and the responses to them */
+struct server_job_struct
+{
+    connection_t*   connection;
+    byte_buffer_t   requests;
+    byte_buffer_t   responses;
+    bool            exit_requested;
+    server_job_t*   next;
+};
+
+struct server_struct
+{
+    database_t*       database;
+    int               listen_fd;
+    int               epoll_fd;
+    int               wakeup_fd;  // eventfd, workers signal finished jobs
+    int               signal_fd;
+    connection_t**    connections;  // indexed by fd
+    uint32_t          num_connection_slots;
+    pthread_t*        workers;
+    uint32_t          num_workers;
+    pthread_mutex_t   engine_lock;
+    pthread_mutex_t   queue_lock;
+    pthread_cond_t    queue_ready;
+    server_job_t*     pending_head;
+    server_job_t*     pending_tail;
+    server_job_t*     done_head;
+    bool              stopping;
+    result_format_e   default_format;  // from --format, workers change the database's
+};
+
+void
+byte_buffer_reserve(
+  byte_buffer_t*  buffer,
+  size_t          extra
+)
+{
+  if (buffer->start > 0 && buffer->start == buffer->length)
+  {
+    buffer->start   = 0;
+    buffer->length  = 0;
+  }
+  if (buffer->length + extra <= buffer->capacity)
+  {
+    return;
+  }
+  if (buffer->start > 0)
+  {
+    memmove(buffer->data, buffer->data + buffer->start, buffer->length - buffer->start);
+    buffer->length -= buffer->start;
+    buffer->start   = 0;
+    if (buffer->length + extra <= buffer->capacity)
+    {
+      return;
+    }
+  }
+  size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+  while (capacity < buffer->length + extra)
+  {
+    capacity *= 2;
+  }
+  buffer->data      = realloc(buffer->data, capacity);
+  buffer->capacity  = capacity;
+}
+
+void
+byte_buffer_append(
+  byte_buffer_t*  buffer,
+  const void*     data,
+  size_t          size
+)
+{
+  byte_buffer_reserve(buffer, size);
+  memcpy(buffer->data + buffer->length, data, size);
+  buffer->length += size;
+}
+
+size_t
+byte_buffer_size(
+  byte_buffer_t*  buffer
+)
+{
+  return buffer->length - buffer->start;
+}
+
+void
+byte_buffer_free(
+  byte_buffer_t*  buffer
+)
+{
+  free(buffer->data);
+  memset(buffer, 0, sizeof(byte_buffer_t));
+}
+
+uint32_t
+frame_length(
+  const char* header
+)
+{
+  const unsigned char* bytes = (const unsigned char*)header;
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+         (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+void
+append_response(
+  byte_buffer_t*  buffer,
+  server_status_e status,
+  const char*     text,
+  size_t          text_length
+)
+{
+  uint32_t      length  = text_length + 1;
+  unsigned char header[SERVER_FRAME_HEADER + 1] =
+  {
+    length & 0xff, (length >> 8) & 0xff, (length >> 16) & 0xff, length >> 24, status
+  };
+  byte_buffer_append(buffer, header, sizeof(header));
+  byte_buffer_append(buffer, text, text_length);
+}
+
+/*
+ Runs one request line with stdout captured, so the client gets exactly what the
+ REPL prints. Called with engine_lock held: stdout is process wide.
+*/
+void
+server_run_request(
+  server_t*       server,
+  server_job_t*   job,
+  const char*     text,
+  uint32_t        length
+)
+{
+  input_buffer_t  input;
+  input.buffer        = malloc(length + 1);
+  input.buffer_length = length + 1;
+  input.input_length  = length;
+  memcpy(input.buffer, text, length);
+  input.buffer[length] = 0;
+
+  char*   output        = NULL;
+  size_t  output_length = 0;
+  FILE*   capture       = open_memstream(&output, &output_length);
+  FILE*   console       = stdout;
+  stdout                = capture;
+  server->database->result_format = job->connection->format;
+  bool    ok            = process_input(&input, server->database);
+  job->connection->format         = server->database->result_format;
+  fflush(capture);
+  stdout                = console;
+  fclose(capture);
+
+  append_response(&(job->responses), ok ? SERVER_STATUS_OK : SERVER_STATUS_ERROR,
+                  output, output_length);
+  free(output);
+  free(input.buffer);
+}
+
+void
+server_run_job(
+  server_t*       server,
+  server_job_t*   job
+)
+{
+  byte_buffer_t* requests = &(job->requests);
+  pthread_mutex_lock(&(server->engine_lock));
+  while (byte_buffer_size(requests) >= SERVER_FRAME_HEADER)
+  {
+    const char* frame   = requests->data + requests->start;
+    uint32_t    length  = frame_length(frame);
+    const char* text    = frame + SERVER_FRAME_HEADER;
+    requests->start    += SERVER_FRAME_HEADER + length;
+    if (length == 5 && memcmp(text, ".exit", 5) == 0)
+    {
+      // Requests pipelined after .exit are dropped with the connection
+      append_response(&(job->responses), SERVER_STATUS_CLOSED, "", 0);
+      job->exit_requested = true;
+      break;
+    }
+    server_run_request(server, job, text, length);
+  }
+  pthread_mutex_unlock(&(server->engine_lock));
+}
+
+void*
+server_worker(
+  void* argument
+)
+{
+  server_t* server = argument;
+  while (true)
+  {
+    pthread_mutex_lock(&(server->queue_lock));
+    while (server->pending_head == NULL && !server->stopping)
+    {
+      pthread_cond_wait(&(server->queue_ready), &(server->queue_lock));
+    }
+    server_job_t* job = server->pending_head;
+    if (job == NULL)
+    {
+      pthread_mutex_unlock(&(server->queue_lock));
+      return NULL;
+    }
+    server->pending_head = job->next;
+    if (server->pending_head == NULL)
+    {
+      server->pending_tail = NULL;
+    }
+    pthread_mutex_unlock(&(server->queue_lock));
+
+    server_run_job(server, job);
+
+    pthread_mutex_lock(&(server->queue_lock));
+    job->next         = server->done_head;
+    server->done_head = job;
+    pthread_mutex_unlock(&(server->queue_lock));
+    uint64_t one = 1;
+    if (write(server->wakeup_fd, &one, sizeof(one)) != sizeof(one))
+    {
+      perror("eventfd write");
+    }
+  }
+}
+
+/*
+ Points epoll at what the connection is waiting for: input unless closing, output if
+ any. With nothing to wait for the fd leaves epoll, which would otherwise keep
+ reporting a hang up while the last batch runs.
+*/
+void
+server_watch(
+  server_t*     server,
+  connection_t* connection
+)
+{
+  uint32_t events = 0;
+  if (!connection->hung_up && !connection->closing)
+  {
+    events |= EPOLLIN;
+  }
+  if (!connection->hung_up && byte_buffer_size(&(connection->output)) > 0)
+  {
+    events |= EPOLLOUT;
+  }
+  if (events == connection->events)
+  {
+    return;
+  }
+  int op = connection->events == 0 ? EPOLL_CTL_ADD :
+           events == 0             ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+  struct epoll_event event;
+  event.events    = events;
+  event.data.fd   = connection->fd;
+  epoll_ctl(server->epoll_fd, op, connection->fd, &event);
+  connection->events = events;
+}
+
+void
+server_close(
+  server_t*     server,
+  connection_t* connection
+)
+{
+  if (connection->events != 0)
+  {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  }
+  close(connection->fd);
+  server->connections[connection->fd] = NULL;
+  byte_buffer_free(&(connection->input));
+  byte_buffer_free(&(connection->output));
+  free(connection);
+}
+
+/* Hands every complete request frame buffered for an idle client to the workers */
+void
+server_dispatch(
+  server_t*     server,
+  connection_t* connection
+)
+{
+  if (connection->busy || connection->hung_up)
+  {
+    return;
+  }
+  byte_buffer_t*  input = &(connection->input);
+  size_t          end   = input->start;
+  while (input->length - end >= SERVER_FRAME_HEADER)
+  {
+    uint32_t length = frame_length(input->data + end);
+    if (length > SERVER_MAX_REQUEST)
+    {
+      connection->hung_up = true;
+      return;
+    }
+    if (input->length - end < SERVER_FRAME_HEADER + length)
+    {
+      break;
+    }
+    end += SERVER_FRAME_HEADER + length;
+  }
+  if (end == input->start)
+  {
+    return;
+  }
+
+  server_job_t* job = calloc(1, sizeof(server_job_t));
+  job->connection   = connection;
+  byte_buffer_append(&(job->requests), input->data + input->start, end - input->start);
+  input->start      = end;
+  connection->busy  = true;
+
+  pthread_mutex_lock(&(server->queue_lock));
+  if (server->pending_tail)
+  {
+    server->pending_tail->next = job;
+  }
+  else
+  {
+    server->pending_head = job;
+  }
+  server->pending_tail = job;
+  pthread_cond_signal(&(server->queue_ready));
+  pthread_mutex_unlock(&(server->queue_lock));
+}
+
+void
+server_flush(
+  connection_t* connection
+)
+{
+  byte_buffer_t* output = &(connection->output);
+  while (byte_buffer_size(output) > 0)
+  {
+    ssize_t written = send(connection->fd, output->data + output->start,
+                           byte_buffer_size(output), MSG_NOSIGNAL);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        connection->hung_up = true;
+      }
+      break;
+    }
+    output->start += written;
+  }
+}
+
+/* Brings a connection up to date after any event, closing it once it is finished */
+void
+server_settle(
+  server_t*     server,
+  connection_t* connection
+)
+{
+  server_flush(connection);
+  server_dispatch(server, connection);
+  // A busy connection keeps its fd open until the batch returns, so it cannot be reused
+  if (!connection->busy &&
+      (connection->hung_up ||
+       (connection->closing && byte_buffer_size(&(connection->output)) == 0)))
+  {
+    server_close(server, connection);
+    return;
+  }
+  server_watch(server, connection);
+}
+
+void
+server_accept(
+  server_t* server
+)
+{
+  while (true)
+  {
+    int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        perror("accept");
+      }
+      return;
+    }
+    if ((uint32_t)fd >= server->num_connection_slots)
+    {
+      uint32_t slots = server->num_connection_slots * 2;
+      while (slots <= (uint32_t)fd)
+      {
+        slots *= 2;
+      }
+      server->connections = realloc(server->connections, slots * sizeof(connection_t*));
+      memset(server->connections + server->num_connection_slots, 0,
+             (slots - server->num_connection_slots) * sizeof(connection_t*));
+      server->num_connection_slots = slots;
+    }
+    connection_t* connection  = calloc(1, sizeof(connection_t));
+    connection->fd            = fd;
+    connection->events        = EPOLLIN;
+    connection->format        = server->default_format;
+    server->connections[fd]   = connection;
+
+    struct epoll_event event;
+    event.events  = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+void
+server_read(
+  connection_t* connection
+)
+{
+  byte_buffer_t* input = &(connection->input);
+  while (!connection->closing)
+  {
+    byte_buffer_reserve(input, SERVER_READ_SIZE);
+    ssize_t bytes_read = read(connection->fd, input->data + input->length, SERVER_READ_SIZE);
+    if (bytes_read > 0)
+    {
+      input->length += bytes_read;
+      continue;
+    }
+    if (bytes_read == 0)
+    {
+      // Peer shut down its side, answer what it already sent and close
+      connection->closing = true;
+    }
+    else if (errno == EINTR)
+    {
+      continue;
+    }
+    else if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      connection->hung_up = true;
+    }
+    break;
+  }
+}
+
+/* Takes back the batches workers have finished and queues their responses */
+void
+server_collect(
+  server_t* server
+)
+{
+  uint64_t count;
+  if (read(server->wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+  {
+    perror("eventfd read");
+  }
+  pthread_mutex_lock(&(server->queue_lock));
+  server_job_t* job = server->done_head;
+  server->done_head = NULL;
+  pthread_mutex_unlock(&(server->queue_lock));
+
+  while (job)
+  {
+    server_job_t* next        = job->next;
+    connection_t* connection  = job->connection;
+    connection->busy          = false;
+    byte_buffer_append(&(connection->output), job->responses.data + job->responses.start,
+                       byte_buffer_size(&(job->responses)));
+    if (job->exit_requested)
+    {
+      connection->closing       = true;
+      connection->input.start   = connection->input.length;
+    }
+    byte_buffer_free(&(job->requests));
+    byte_buffer_free(&(job->responses));
+    free(job);
+    server_settle(server, connection);
+    job = next;
+  }
+}
+
+int
+server_listen(
+  const char* socket_path
+)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "Socket path too long.\n");
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+  unlink(socket_path);
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0)
+  {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void
+server_add_fd(
+  server_t* server,
+  int       fd
+)
+{
+  struct epoll_event event;
+  event.events  = EPOLLIN;
+  event.data.fd = fd;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int
+db_serve(
+  database_t* database,
+  const char* socket_path,
+  uint32_t    num_workers
+)
+{
+  // Blocked before the page writer and the workers start so only the signalfd ever sees them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  database_start_writer(database);
+
+  server_t server;
+  memset(&server, 0, sizeof(server));
+  server.database     = database;
+  server.default_format = database->result_format;
+  server.listen_fd    = server_listen(socket_path);
+  if (server.listen_fd < 0)
+  {
+    db_close(database);
+    return EXIT_FAILURE;
+  }
+  server.epoll_fd     = epoll_create1(EPOLL_CLOEXEC);
+  server.wakeup_fd    = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  server.signal_fd    = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  server.num_connection_slots = 64;
+  server.connections  = calloc(server.num_connection_slots, sizeof(connection_t*));
+  server.num_workers  = num_workers;
+  server.workers      = malloc(num_workers * sizeof(pthread_t));
+  pthread_mutex_init(&server.engine_lock, NULL);
+  pthread_mutex_init(&server.queue_lock, NULL);
+  pthread_cond_init(&server.queue_ready, NULL);
+  server_add_fd(&server, server.listen_fd);
+  server_add_fd(&server, server.wakeup_fd);
+  server_add_fd(&server, server.signal_fd);
+  for (uint32_t i = 0; i < num_workers; i++)
+  {
+    pthread_create(&server.workers[i], NULL, server_worker, &server);
+  }
+
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  bool running = true;
+  while (running)
+  {
+    int num_events = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+    if (num_events < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    for (int i = 0; i < num_events; i++)
+    {
+      int fd = events[i].data.fd;
+      if (fd == server.listen_fd)
+      {
+        server_accept(&server);
+      }
+      else if (fd == server.wakeup_fd)
+      {
+        server_collect(&server);
+      }
+      else if (fd == server.signal_fd)
+      {
+        running = false;
+      }
+      else if (server.connections[fd] != NULL)
+      {
+        connection_t* connection = server.connections[fd];
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        {
+          server_read(connection);
+        }
+        server_settle(&server, connection);
+      }
+    }
+  }
+
+  // Workers drain the queue before exiting, then the database is closed once
+  pthread_mutex_lock(&server.queue_lock);
+  server.stopping = true;
+  pthread_cond_broadcast(&server.queue_ready);
+  pthread_mutex_unlock(&server.queue_lock);
+  for (uint32_t i = 0; i < num_workers; i++)
+  {
+    pthread_join(server.workers[i], NULL);
+  }
+  server_collect(&server);
+  for (uint32_t fd = 0; fd < server.num_connection_slots; fd++)
+  {
+    if (server.connections[fd])
+    {
+      server_close(&server, server.connections[fd]);
+    }
+  }
+  close(server.listen_fd);
+  unlink(socket_path);
+  close(server.epoll_fd);
+  close(server.wakeup_fd);
+  close(server.signal_fd);
+  free(server.connections);
+  free(server.workers);
+
+  db_close(database);
+  return EXIT_SUCCESS;
+}
@@ -1,6 +1,6 @@
 describe 'database' do
   before do
-    `rm -rf mydb.db`
+    `rm -rf mydb.db mydb.db.warm`
   end
   def run_script(commands)
     raw_output = nil
@@ -149,6 +149,7 @@ describe 'database' do
   #    ])
   # end
 
+  # Ascending keys fill the left leaf and start a fresh one on the right
   it 'allows printing out the structure of a 3-leaf-node btree' do
     script = (1..14).map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -161,7 +162,7 @@ describe 'database' do
     expect(result[14...(result.length)]).to match_array([
       "db > Tree:",
       "- internal (size 1)",
-      "  - leaf (size 7)",
+      "  - leaf (size 13)",
       "    - 1",
       "    - 2",
       "    - 3",
@@ -169,14 +170,14 @@ describe 'database' do
       "    - 5",
       "    - 6",
       "    - 7",
-      "  - key 7",
-      "  - leaf (size 7)",
       "    - 8",
       "    - 9",
       "    - 10",
       "    - 11",
       "    - 12",
       "    - 13",
+      "  - key 13",
+      "  - leaf (size 1)",
       "    - 14",
       "db > Executed.",
       "db > ",
@@ -249,6 +250,646 @@ describe 'database' do
     ]
     result = run_script(script)
   end
-end
 
-  
\ No newline at end of file
+  it 'splits internal nodes and keeps every row reachable' do
+    script = (1..60).to_a.shuffle(random: Random.new(42)).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    rows = result[60...-2]
+    rows[0] = rows[0].sub("db > ", "")
+    expect(rows).to eq((1..60).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" })
+  end
+
+  it 'answers aggregate queries' do
+    script = (1..30).to_a.reverse.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script += [
+      "select count(*)",
+      "select min(id)",
+      "select max(id)",
+      "select sum(id)",
+      "select avg(id)",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result[30...(result.length)]).to eq([
+      "db > (30)",
+      "Executed.",
+      "db > (1)",
+      "Executed.",
+      "db > (30)",
+      "Executed.",
+      "db > (465)",
+      "Executed.",
+      "db > (15.50)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'looks up rows by id, indexed username and email prefix' do
+    script = (1..40).map do |i|
+      "insert #{i} user#{i % 7} person#{i}@example.com"
+    end
+    script += [
+      "create index on username",
+      "create index on email",
+      "create index on email",
+      "insert 41 user3 latecomer@example.com",
+      "select where id = 12",
+      "select where username = user3",
+      "select where email like person3%",
+      "select count(*) where username = user3",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result[40...(result.length)]).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Index already exists.",
+      "db > Executed.",
+      "db > (12, user5, person12@example.com)",
+      "Executed.",
+      "db > (3, user3, person3@example.com)",
+      "(10, user3, person10@example.com)",
+      "(17, user3, person17@example.com)",
+      "(24, user3, person24@example.com)",
+      "(31, user3, person31@example.com)",
+      "(38, user3, person38@example.com)",
+      "(41, user3, latecomer@example.com)",
+      "Executed.",
+      "db > (30, user2, person30@example.com)",
+      "(31, user3, person31@example.com)",
+      "(32, user4, person32@example.com)",
+      "(33, user5, person33@example.com)",
+      "(34, user6, person34@example.com)",
+      "(35, user0, person35@example.com)",
+      "(36, user1, person36@example.com)",
+      "(37, user2, person37@example.com)",
+      "(38, user3, person38@example.com)",
+      "(39, user4, person39@example.com)",
+      "(3, user3, person3@example.com)",
+      "Executed.",
+      "db > (7)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps several tables with their own schemas in one file' do
+    run_script([
+      "create table orders (oid int, note text(8), qty int)",
+      "insert into orders 2 second 20",
+      "insert into orders 1 first 10",
+      "insert into orders 3 waytoolongnote 1",
+      "insert into orders 4 refund -40",
+      "insert 1 user1 person1@example.com",
+      ".exit",
+    ])
+    result = run_script([
+      ".tables",
+      "select from orders",
+      "select sum(qty) from orders",
+      "select min(qty) from orders",
+      "select max(qty) from orders",
+      "select avg(qty) from orders",
+      "select",
+      "select from missing",
+      ".exit",
+    ])
+
+    expect(result).to eq([
+      "db > users (id int, username text(32), email text(255))",
+      "orders (oid int, note text(8), qty int)",
+      "db > (1, first, 10)",
+      "(2, second, 20)",
+      "(4, refund, -40)",
+      "Executed.",
+      "db > (-10)",
+      "Executed.",
+      "db > (-40)",
+      "Executed.",
+      "db > (20)",
+      "Executed.",
+      "db > (-3.33)",
+      "Executed.",
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > Error: Table not found.",
+      "db > ",
+    ])
+  end
+
+  it 'returns NULL for min and max of an empty table' do
+    script = [
+      "select count(*)",
+      "select max(id)",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result).to eq([
+      "db > (0)",
+      "Executed.",
+      "db > (NULL)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'reports engine counters and resets them' do
+    script = (1..20).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      ".stats",
+      ".stats reset",
+      ".stats",
+      ".exit",
+    ]
+    result = run_script(script)
+    first_stats = result[result.index("db > Stats:")..-1]
+
+    expect(first_stats).to include("leaf_splits: 1")
+    expect(first_stats).to include("internal_splits: 0")
+    expect(first_stats).to include("tree_height users: 2")
+    expect(first_stats.find { |line| line.start_with?("insert: count 20,") }).not_to eq(nil)
+
+    reset_stats = result[result.rindex("db > db > Stats:")..-1]
+    expect(reset_stats).to include("leaf_splits: 0")
+    expect(reset_stats).to include("cursors_allocated: 0")
+    expect(reset_stats.find { |line| line.start_with?("insert:") }).to eq(nil)
+  end
+
+  it 'explains how a statement was executed' do
+    script = (1..3).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      "explain analyze select where id = 2",
+      "explain analyze select where username = user3",
+      ".exit",
+    ]
+    result = run_script(script)
+    seek = result[result.index("db > (2, user2, person2@example.com)")..-1]
+    scan = result[result.index("db > (3, user3, person3@example.com)")..-1]
+
+    expect(seek[1..2]).to eq([
+      "Plan:",
+      "access path: point seek (table_find)",
+    ])
+    expect(seek).to include("pages read: 0")
+    expect(seek).to include("rows examined: 1")
+    expect(scan).to include("access path: full scan (table_start)")
+    expect(scan).to include("rows examined: 3")
+    expect(scan).to include("rows returned: 1")
+    expect(scan.find { |line| line.start_with?("parse_ns: ") }).not_to eq(nil)
+  end
+
+  it 'buffers inserts in memory and merges them with the tree' do
+    ids = [9, 2, 14, 5, 11, 1, 7, 3, 12, 8, 4, 13, 6, 10]
+    script = [".memtable 4"]
+    script += ids.map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      "insert 7 again again@example.com",
+      "insert 6 again again@example.com",
+      "select where id = 10",
+      "select where username = user6",
+      "select count(*)",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result.count("db > Error: Duplicate key.")).to eq(2)
+    expect(result).to include("db > (10, user10, person10@example.com)")
+    expect(result).to include("db > (6, user6, person6@example.com)")
+    expect(result).to include("db > (14)")
+
+    result = run_script(["select", ".exit"])
+    rows = (1..14).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expect(result).to eq(["db > " + rows[0]] + rows[1..-1] + ["Executed.", "db > "])
+  end
+
+  it 'skips lookups of absent keys with the primary key filter' do
+    script = (1..20).map { |i| "insert #{i * 2} user#{i} person#{i}@example.com" }
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "explain analyze select where id = 7",
+      "select where id = 8",
+      ".stats",
+      ".exit",
+    ])
+    expect(result).to include("access path: bloom filter, key absent")
+    expect(result).to include("db > (8, user4, person4@example.com)")
+    expect(result).to include("bloom_skips: 1")
+    expect(result).to include("bloom_rebuilds: 0")
+  end
+
+  it 'streams select results as binary rows' do
+    run_script([
+      "insert 1 alice alice@example.com",
+      "insert 2 bob bob@example.com",
+      ".exit",
+    ])
+    output = IO.popen(["./db_study", "--format=binary"], "r+b") do |pipe|
+      pipe.write("select\nselect count(*)\n.exit\n")
+      pipe.close_write
+      pipe.read
+    end
+
+    body = output.delete_prefix("db > ")
+    rows = []
+    loop do
+      length = body.slice!(0, 4).unpack1("V")
+      break if length == 0
+      row = body.slice!(0, length)
+      id, name_length = row.unpack("VV")
+      name = row[8, name_length]
+      email = row[12 + name_length..-1]
+      rows << [id, name, email]
+    end
+    expect(rows).to eq([[1, "alice", "alice@example.com"], [2, "bob", "bob@example.com"]])
+    expect(body).to eq("Executed.\ndb > (2)\nExecuted.\ndb > ")
+  end
+
+  it 'serves pipelined statements to clients over a unix socket' do
+    require 'socket'
+    socket_path = "db_study_spec.sock"
+    server = Process.spawn("./db_study", "--serve", socket_path, "--workers", "2")
+    # The server holds the database and the socket, it must not outlive a failure
+    begin
+      50.times { File.exist?(socket_path) ? break : sleep(0.05) }
+
+      frame = ->(text) { [text.bytesize].pack("V") + text }
+      read_response = lambda do |client|
+        length = client.read(4).unpack1("V")
+        body = client.read(length)
+        [body.getbyte(0), body[1..-1]]
+      end
+
+      client = UNIXSocket.new(socket_path)
+      requests = (1..3).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+      requests += ["insert 2 again again@example.com", "select where id = 2", "nonsense", ".exit"]
+      client.write(requests.map(&frame).join)
+      responses = requests.map { read_response.call(client) }
+      client.close
+
+      expect(responses[0..2]).to eq([[0, "Executed.\n"]] * 3)
+      expect(responses[3]).to eq([1, "Error: Duplicate key.\n"])
+      expect(responses[4]).to eq([0, "(2, user2, person2@example.com)\nExecuted.\n"])
+      expect(responses[5][0]).to eq(1)
+      expect(responses[6]).to eq([2, ""])
+    ensure
+      Process.kill("TERM", server) rescue nil
+      Process.wait(server) rescue nil
+    end
+    expect(File.exist?(socket_path)).to eq(false)
+    result = run_script(["select count(*)", ".exit"])
+    expect(result).to include("db > (3)")
+  end
+
+  it 'copies rows from a csv file, all or nothing' do
+    File.write("db_study_spec.csv", <<~CSV)
+      id,username,email
+      3,carol,carol@example.com
+      1,"al,""ice""",alice@example.com
+      2,bob,bob@example.com
+    CSV
+    File.write("db_study_spec_bad.csv", "4,dave,dave@example.com\n5,eve\n")
+    result = run_script([
+      "copy users from 'db_study_spec.csv'",
+      "copy users from 'db_study_spec_bad.csv'",
+      "copy users from 'db_study_spec.csv'",
+      "copy users from 'db_study_spec_missing.csv'",
+      "select",
+      ".exit",
+    ])
+    File.delete("db_study_spec.csv", "db_study_spec_bad.csv")
+
+    expect(result).to eq([
+      "db > Copied 3 rows.",
+      "Executed.",
+      "db > Copy stopped at line 2.",
+      "Syntax error. Could not parse statement.",
+      "db > Error: Duplicate key.",
+      "db > Error: Could not read file.",
+      "db > (1, al,\"ice\", alice@example.com)",
+      "(2, bob, bob@example.com)",
+      "(3, carol, carol@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'exports a table to csv and binary files' do
+    result = run_script([
+      ".memtable 4",
+      "insert 2 bob bob@example.com",
+      "insert 1 al,\"ice\" alice@example.com",
+      "copy users to 'db_study_spec.csv'",
+      "copy users to 'db_study_spec.bin' binary",
+      "copy users to 'db_study_spec.csv' json",
+      ".exit",
+    ])
+    csv = File.read("db_study_spec.csv")
+    binary = File.binread("db_study_spec.bin")
+    File.delete("db_study_spec.csv", "db_study_spec.bin")
+
+    expect(result).to eq([
+      "db > db > Executed.",
+      "db > Executed.",
+      "db > Copied 2 rows.",
+      "Executed.",
+      "db > Copied 2 rows.",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+    expect(csv).to eq("id,username,email\n1,\"al,\"\"ice\"\"\",alice@example.com\n2,bob,bob@example.com\n")
+    expect(binary[-4, 4].unpack1("V")).to eq(0)
+    expect(binary[4, 4].unpack1("V")).to eq(1)
+    expect(binary.bytesize).to eq(4 + 37 + 4 + 30 + 4)
+  end
+
+  it 'stamps the file format version and refuses newer files' do
+    run_script(["insert 1 user1 person1@example.com", ".exit"])
+    version_offset = 4040
+    expect(File.binread("mydb.db", 4, version_offset).unpack1("V")).to eq(6)
+
+    # Files from before checksums are rewritten with them on open
+    File.open("mydb.db", "r+b") { |file| file.pwrite([2].pack("V"), version_offset) }
+    result = run_script(["select", ".exit"])
+    expect(result).to include("db > (1, user1, person1@example.com)")
+    expect(File.binread("mydb.db", 4, version_offset).unpack1("V")).to eq(6)
+
+    File.open("mydb.db", "r+b") { |file| file.pwrite([7].pack("V"), version_offset) }
+    result = run_script(["select", ".exit"])
+    expect(result).to eq(["Db file format version 7 is newer than this build reads (6)."])
+  end
+
+  it 'compresses pages behind a page map and back' do
+    script = (1..60).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [".compress on", ".compress", ".exit"]
+    result = run_script(script)
+    stored = result.find { |line| line.include?("Stored") }
+    pages, bytes = stored.match(/\Adb > Stored (\d+) pages in (\d+) bytes\.\z/).captures.map(&:to_i)
+    expect(bytes * 4 < pages * 4096).to eq(true)
+    expect(result).to include("db > Usage: .compress on|off")
+    expect(File.size("mydb.db") < pages * 4096).to eq(true)
+
+    result = run_script(["insert 61 user61 person61@example.com", "select count(*)", ".check", ".exit"])
+    expect(result).to include("db > (61)")
+    expect(result.find { |line| line.include?("Checked") }).to match(/ 0 errors\.\z/)
+
+    result = run_script([".compress off", "select", ".exit"])
+    expect(File.size("mydb.db") % 4096).to eq(0)
+    rows = (1..61).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expect(result[1..61]).to eq(["db > " + rows[0]] + rows[1..-1])
+  end
+
+  it 'stores table leaves column by column with .layout' do
+    script = (1..40).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      "create table orders (oid int, note text(8), qty int)",
+      "insert into orders 1 first 10",
+      "insert into orders 2 second 20",
+      "insert into orders 3 third 20",
+      ".layout users pax",
+      ".layout orders pax",
+      ".layout orders columns",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to include("db > Table users uses pax leaves.")
+    expect(result).to include("db > Table orders uses pax leaves.")
+    expect(result).to include("db > Usage: .layout <table> rows|pax")
+
+    script = (41..80).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      "select where username = user57",
+      "select count(*) where email like person7%",
+      "select sum(id)",
+      "select from orders where qty = 20",
+      ".check",
+      ".layout users rows",
+      "select where id = 64",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[40..-1]).to eq([
+      "db > (57, user57, person57@example.com)",
+      "Executed.",
+      "db > (11)",
+      "Executed.",
+      "db > (3240)",
+      "Executed.",
+      "db > (2, second, 20)",
+      "(3, third, 20)",
+      "Executed.",
+      result[49],
+      "db > Table users uses rows leaves.",
+      "db > (64, user64, person64@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+    expect(result[49]).to match(/\Adb > Checked \d+ pages and 2 trees with \d+ threads, 0 errors\.\z/)
+  end
+
+  it 'keeps long text in overflow pages' do
+    long_body = "a" * 5000 + "z"
+    result = run_script([
+      "create table notes (id int, body text(8000))",
+      "insert into notes 1 #{long_body}",
+      "insert into notes 2 short",
+      "insert into notes 3 #{"b" * 8001}",
+      "insert into notes 2 #{long_body}",
+      "create index on notes body",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > String is too long.",
+      "db > Error: Duplicate key.",
+      "db > Error: Type mismatch.",
+      "db > ",
+    ])
+
+    result = run_script([
+      ".tables",
+      "select from notes where body = short",
+      "select count(*) from notes where body like #{"a" * 40}%",
+      "select from notes where id = 1",
+      ".check",
+      ".exit",
+    ])
+    expect(result[0..6]).to eq([
+      "db > users (id int, username text(32), email text(255))",
+      "notes (id int, body text(8000))",
+      "db > (2, short)",
+      "Executed.",
+      "db > (1)",
+      "Executed.",
+      "db > (1, #{long_body})",
+    ])
+    expect(result.find { |line| line.include?("Checked") }).to match(/ 0 errors\.\z/)
+  end
+
+  it 'checks page checksums and tree structure' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ["create index on username", ".check", ".exit"]
+    result = run_script(script)
+    expect(result.find { |line| line.include?("Checked") }).to match(/\Adb > Checked \d+ pages and 2 trees with \d+ threads, 0 errors\.\z/)
+
+    File.open("mydb.db", "r+b") { |file| file.pwrite("x", 4 * 4096 + 100) }
+    result = run_script([".check", ".exit"])
+    expect(result).to include("db > Page 4: checksum mismatch.")
+    expect(result.find { |line| line.include?("Checked") }).not_to include(" 0 errors")
+
+    result = run_script(["select", ".exit"])
+    expect(result.last).to eq("Page 4 failed its checksum. Corrupt file.")
+  end
+
+  it 'migrates a file from before the catalog' do
+    # One root leaf: type, is_root, parent, cells, next leaf, then (key, id, username, email) cells
+    cells = [3, 7].map { |i| [i, i].pack("VV") + ["user#{i}"].pack("a33") + ["person#{i}@example.com"].pack("a256") }
+    page = [1, 1, 0, cells.size, 0].pack("CCVVV") + cells.join
+    File.binwrite("mydb.db", page.ljust(4096, "\0"))
+
+    result = run_script(["insert 5 user5 person5@example.com", "select", ".check", ".exit"])
+    expect(result).to include("db > (3, user3, person3@example.com)")
+    expect(result).to include("(5, user5, person5@example.com)")
+    expect(result).to include("(7, user7, person7@example.com)")
+    expect(result.find { |line| line.include?("Checked") }).to match(/ 0 errors\.$/)
+    expect(File.exist?("mydb.db.migrate")).to eq(false)
+  end
+
+  it 'vacuums the file into packed leaves in key order' do
+    script = (1..30).to_a.reverse.map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [".vacuum 50", ".btree", "select count(*)", ".vacuum 0", ".exit"]
+    result = run_script(script)
+
+    expect(result.find { |line| line.start_with?("db > Vacuumed") }).to match(/\Adb > Vacuumed \d+ pages into \d+\.\z/)
+    expect(result.count { |line| line.strip == "- leaf (size 6)" }).to eq(5)
+    expect(result).to include("db > (30)")
+    expect(result).to include("db > Usage: .vacuum [fill percent 1-100]")
+    expect(File.exist?("mydb.db.vacuum")).to eq(false)
+
+    result = run_script(["select", "insert 31 user31 person31@example.com", "select count(*)", ".exit"])
+    rows = (1..30).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expect(result[0..29]).to eq(["db > " + rows[0]] + rows[1..-1])
+    expect(result).to include("db > (31)")
+  end
+
+  it 'orders, limits and offsets select results' do
+    script = (1..40).map { |i| "insert #{i} user#{i % 7} person#{i}@example.com" }
+    script += [
+      "select order by username desc limit 3 offset 1",
+      "select limit 2 offset 37",
+      "select order by id desc limit 2",
+      ".sort_memory 300",
+      "explain analyze select where email like person1% order by username",
+      "select order by username limit 1",
+      "select limit",
+      "select order username",
+      "select count(*) limit 1",
+      "select order by nope",
+      ".sort_memory 0",
+      ".exit",
+    ]
+    result = run_script(script)
+    rows = result[result.index("db > (13, user6, person13@example.com)")..-1]
+
+    expect(rows[0..13]).to eq([
+      "db > (13, user6, person13@example.com)",
+      "(20, user6, person20@example.com)",
+      "(27, user6, person27@example.com)",
+      "Executed.",
+      "db > (38, user3, person38@example.com)",
+      "(39, user4, person39@example.com)",
+      "Executed.",
+      "db > (40, user5, person40@example.com)",
+      "(39, user4, person39@example.com)",
+      "Executed.",
+      "db > db > (14, user0, person14@example.com)",
+      "(1, user1, person1@example.com)",
+      "(15, user1, person15@example.com)",
+      "(16, user2, person16@example.com)",
+    ])
+    expect(rows).to include("sort: external merge of 11 runs")
+    expect(rows).to include("db > (7, user0, person7@example.com)")
+    expect(rows.count("db > Syntax error. Could not parse statement.")).to eq(3)
+    expect(rows).to include("db > Error: Column not found.")
+    expect(rows).to include("db > Usage: .sort_memory <bytes>")
+  end
+
+  it 'checkpoints rows to disk without an exit' do
+    pipe = IO.popen("./db_study mydb.db", "r+")
+    (1..300).each { |i| pipe.puts "insert #{i} user#{i} person#{i}@example.com" }
+    pipe.flush
+    sleep(1.5)
+    Process.kill("KILL", pipe.pid)
+    pipe.close
+
+    result = run_script(["select count(*)", ".check", ".stats", ".exit"])
+    expect(result).to include("db > (300)")
+    expect(result.find { |line| line.start_with?("db > Checked ") }).to include("0 errors.")
+    expect(result).to include("pages_written: 0")
+  end
+
+  it 'loads the pages cached at exit again after a restart' do
+    run_script((1..100).map { |i| "insert #{i} user#{i} person#{i}@example.com" } + [".exit"])
+    expect(File.size("mydb.db.warm")).to eq(4 * (2 + File.size("mydb.db") / 4096))
+
+    pipe = IO.popen("./db_study mydb.db", "r+")
+    sleep(0.2)
+    pipe.puts "select count(*)"
+    pipe.puts ".stats"
+    pipe.puts ".exit"
+    pipe.close_write
+    result = pipe.gets(nil).split("\n")
+    pipe.close
+
+    # The catalog is read while opening, every other page comes from the list
+    expect(result).to include("db > (100)")
+    expect(result).to include("cache_misses: 1")
+    expect(result).to include("warm_pages_loaded: #{File.size("mydb.db") / 4096 - 1}")
+  end
+
+  it 'updates rows in place and upserts on conflict' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      "create index on username",
+      "update set username = renamed, email = new@example.com where id = 12",
+      "insert 5 again again@example.com on conflict do update",
+      "insert 31 user31 person31@example.com on conflict do update",
+      "insert 32 on on@example.com",
+      "insert 32 on conflict@example.com on conflict do update",
+      "update set id = 40 where id = 1",
+      "update set username = x where username = user2",
+      "select where username = renamed",
+      "select where username = user12",
+      "select where id = 5",
+      "select where id = 32",
+      "select count(*)",
+      ".check",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result).to include("db > Error: The key column cannot be updated.")
+    expect(result).to include("db > Error: Update needs where <key column> = <id>.")
+    expect(result).to include("db > (12, renamed, new@example.com)")
+    expect(result).not_to include("db > (12, user12, person12@example.com)")
+    expect(result).to include("db > (5, again, again@example.com)")
+    expect(result).to include("db > (32, on, conflict@example.com)")
+    expect(result).to include("db > (32)")
+    expect(result.find { |line| line.include?("Checked") }).to match(/ 0 errors\.$/)
+  end
+end